@@ -53,8 +53,15 @@ def generate_test(key_len, size):
     f.close()
 
 
-compression = ["uncompressed", "zstd", "md5", "sha256"]
-colors = {"uncompressed": "red", "zstd": "green", "md5": "yellow", "sha256": "orange"}
+compression = ["uncompressed", "zstd", "zstd_dict", "md5", "sha256", "fingerprint"]
+colors = {
+    "uncompressed": "red",
+    "zstd": "green",
+    "zstd_dict": "olive",
+    "md5": "yellow",
+    "sha256": "orange",
+    "fingerprint": "blue",
+}
 
 args = sys.argv
 
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../zddlsm/include/async_storage.h"
+#include "../zddlsm/include/frozen_index.h"
+#include "../zddlsm/include/zddlsm.h"
+#include "perf_counters.h"
+
+namespace BENCH {
+/*
+Key distributions. `uniform` and `zipf` share random keys and differ in
+access order, `sequential` keys are increasing numbers, `shared_prefix` keys
+share one of a few long prefixes.
+*/
+enum class Distribution {
+    uniform,
+    sequential,
+    zipf,
+    shared_prefix,
+};
+
+/*
+Number of distinct prefixes of `shared_prefix` keys.
+*/
+constexpr static uint32_t SHARED_PREFIXES = 16;
+
+constexpr static double ZIPF_DEFAULT_THETA = 0.99;
+
+inline Distribution ParseDistribution(const std::string& name) {
+    if (name == "uniform") {
+        return Distribution::uniform;
+    } else if (name == "sequential") {
+        return Distribution::sequential;
+    } else if (name == "zipf") {
+        return Distribution::zipf;
+    } else if (name == "shared_prefix") {
+        return Distribution::shared_prefix;
+    }
+    throw std::invalid_argument("unknown distribution: " + name);
+}
+
+inline std::string DistributionName(Distribution distribution) {
+    switch (distribution) {
+        case Distribution::sequential:
+            return "sequential";
+        case Distribution::zipf:
+            return "zipf";
+        case Distribution::shared_prefix:
+            return "shared_prefix";
+        default:
+            return "uniform";
+    }
+}
+
+inline std::string CompressionName(Compression::compression type) {
+    switch (type) {
+        case Compression::compression::zstd:
+            return "zstd";
+        case Compression::compression::md5:
+            return "md5";
+        case Compression::compression::sha256:
+            return "sha256";
+        case Compression::compression::fingerprint:
+            return "fingerprint";
+        default:
+            return "none";
+    }
+}
+
+inline Compression::compression ParseCompression(const std::string& name) {
+    for (Compression::compression type :
+         {Compression::compression::none, Compression::compression::zstd,
+          Compression::compression::md5, Compression::compression::sha256,
+          Compression::compression::fingerprint}) {
+        if (CompressionName(type) == name) {
+            return type;
+        }
+    }
+    throw std::invalid_argument("unknown compression: " + name);
+}
+
+/*
+Zipfian generator over [0, n) from "Quickly Generating Billion-Record
+Synthetic Databases" (Gray et al.), as used by YCSB. Item 0 is the hottest,
+so callers scramble the result. The constructor sums over all `n` items,
+`Next` is const, so threads share one generator.
+*/
+class ZipfGenerator {
+public:
+    ZipfGenerator(uint64_t n, double theta = ZIPF_DEFAULT_THETA)
+        : n_(n), theta_(theta) {
+        double zeta2 = 0;
+        for (uint64_t i = 1; i <= std::min<uint64_t>(n, 2); ++i) {
+            zeta2 += 1 / std::pow(i, theta);
+        }
+        zetan_ = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            zetan_ += 1 / std::pow(i, theta);
+        }
+        alpha_ = 1 / (1 - theta);
+        eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+    }
+
+    template <class Rng>
+    uint64_t Next(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta_)) {
+            return std::min<uint64_t>(1, n_ - 1);
+        }
+        return std::min<uint64_t>(
+            n_ - 1, n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+    }
+
+private:
+    uint64_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
+
+/*
+Spreads hot Zipf items over the key space.
+*/
+inline uint64_t Scramble(uint64_t item, uint64_t n) {
+    item ^= item >> 33;
+    item *= 0xff51afd7ed558ccdULL;
+    item ^= item >> 33;
+    return item % n;
+}
+
+inline std::string RandomKey(std::mt19937_64& rng, uint32_t key_len) {
+    std::uniform_int_distribution<int> dist(32, 126);
+    std::string key(key_len, 0);
+    for (char& c : key) {
+        c = static_cast<char>(dist(rng));
+    }
+    return key;
+}
+
+constexpr static double DEFAULT_PREFIX_SHARE = 0.75;
+
+/*
+`count` distinct keys of `key_len` bytes. `shared_prefix` keys share their
+first `prefix_share` part with other keys.
+*/
+inline std::vector<std::string> GenerateKeys(
+    Distribution distribution, size_t count, uint32_t key_len, uint64_t seed,
+    double prefix_share = DEFAULT_PREFIX_SHARE) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> keys;
+    keys.reserve(count);
+
+    if (distribution == Distribution::sequential) {
+        for (size_t i = 0; i != count; ++i) {
+            std::string number = std::to_string(i);
+            keys.push_back(std::string(key_len - std::min<size_t>(
+                                                     key_len, number.size()),
+                                       '0') +
+                           number);
+        }
+        return keys;
+    }
+
+    std::vector<std::string> prefixes;
+    uint32_t prefix_len = distribution == Distribution::shared_prefix
+                              ? key_len * prefix_share
+                              : 0;
+    for (uint32_t i = 0; i != SHARED_PREFIXES; ++i) {
+        prefixes.push_back(RandomKey(rng, prefix_len));
+    }
+    // printable keys have 95 values per byte
+    if ((prefix_len == 0 ? 1 : SHARED_PREFIXES) *
+            std::pow(95.0, key_len - prefix_len) <
+        count) {
+        throw std::invalid_argument("too many keys for key length");
+    }
+
+    std::unordered_set<std::string> seen;
+    seen.reserve(count);
+    while (keys.size() != count) {
+        std::string key = prefixes[rng() % SHARED_PREFIXES] +
+                          RandomKey(rng, key_len - prefix_len);
+        if (seen.insert(key).second) {
+            keys.push_back(std::move(key));
+        }
+    }
+    return keys;
+}
+
+/*
+Order in which `ops` operations access `n` keys.
+*/
+inline std::vector<size_t> AccessOrder(Distribution distribution, size_t ops,
+                                       size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<size_t> order(ops);
+    if (distribution == Distribution::sequential) {
+        for (size_t i = 0; i != ops; ++i) {
+            order[i] = i % n;
+        }
+    } else if (distribution == Distribution::zipf) {
+        ZipfGenerator zipf(n);
+        for (size_t& index : order) {
+            index = Scramble(zipf.Next(rng), n);
+        }
+    } else {
+        for (size_t& index : order) {
+            index = rng() % n;
+        }
+    }
+    return order;
+}
+
+inline uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/*
+Throughput and latency of one benchmark run.
+*/
+struct Result {
+    std::string name;
+    std::map<std::string, std::string> params;
+    uint64_t ops = 0;
+    double seconds = 0;
+    ZDDLSM::LatencyHistogram latency;
+    std::map<std::string, double> metrics;
+
+    std::string ToJson() const {
+        std::ostringstream out;
+        out << "{\"name\": \"" << name << "\"";
+        for (const auto& [key, value] : params) {
+            out << ", \"" << key << "\": \"" << value << "\"";
+        }
+        out << ", \"ops\": " << ops << ", \"seconds\": " << seconds
+            << ", \"ops_per_sec\": " << (seconds == 0 ? 0 : ops / seconds)
+            << ", \"p50_ns\": " << latency.Percentile(50)
+            << ", \"p99_ns\": " << latency.Percentile(99)
+            << ", \"p999_ns\": " << latency.Percentile(99.9)
+            << ", \"max_ns\": " << latency.Max();
+        for (const auto& [key, value] : metrics) {
+            out << ", \"" << key << "\": " << value;
+        }
+        out << "}";
+        return out.str();
+    }
+};
+
+/*
+Runs `op(i)` for i in [0, ops) and records latency of every call. Hardware
+counters, if opened, include the cost of the latency clock reads.
+*/
+template <class Op>
+Result Measure(const std::string& name, uint64_t ops, Op op) {
+    Result result;
+    result.name = name;
+    result.ops = ops;
+    PerfCounters& perf = PerfCounters::Global();
+    perf.Start();
+    uint64_t start = NowNs();
+    for (uint64_t i = 0; i != ops; ++i) {
+        uint64_t op_start = NowNs();
+        op(i);
+        result.latency.Record(NowNs() - op_start);
+    }
+    result.seconds = static_cast<double>(NowNs() - start) / 1e9;
+    AddPerfMetrics(perf.Stop(), ops, result.metrics);
+    return result;
+}
+
+/*
+Writes `results` as a JSON array to `out_name`, or to stdout if it's empty.
+*/
+inline void WriteResults(const std::vector<Result>& results,
+                         const std::string& out_name) {
+    std::ofstream file;
+    if (!out_name.empty()) {
+        file.open(out_name);
+    }
+    std::ostream& out = out_name.empty() ? std::cout : file;
+
+    out << "[\n";
+    for (size_t i = 0; i != results.size(); ++i) {
+        out << "  " << results[i].ToJson()
+            << (i + 1 == results.size() ? "\n" : ",\n");
+    }
+    out << "]\n";
+}
+
+/*
+Parses `name=value` arguments.
+*/
+inline std::map<std::string, std::string> ParseArgs(int argc, char* argv[]) {
+    std::map<std::string, std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("expected name=value, got " + arg);
+        }
+        args[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    return args;
+}
+
+inline std::string GetArg(const std::map<std::string, std::string>& args,
+                          const std::string& name,
+                          const std::string& default_value) {
+    auto it = args.find(name);
+    return it == args.end() ? default_value : it->second;
+}
+
+/*
+Parses `value` of argument `name` as an unsigned number no larger than `max`.
+Throws `std::invalid_argument` naming the argument for anything else, so
+mains report bad numbers like other bad arguments.
+*/
+inline uint64_t ToUint(const std::string& name, const std::string& value,
+                       uint64_t max = std::numeric_limits<uint64_t>::max()) {
+    size_t parsed = 0;
+    uint64_t number = 0;
+    try {
+        // stoull accepts and wraps a leading minus
+        if (value.find('-') == std::string::npos) {
+            number = std::stoull(value, &parsed);
+        }
+    } catch (const std::logic_error&) {
+        parsed = 0;
+    }
+    if (parsed == 0 || parsed != value.size() || number > max) {
+        throw std::invalid_argument("bad " + name + ": " + value);
+    }
+    return number;
+}
+
+inline double ToDouble(const std::string& name, const std::string& value) {
+    size_t parsed = 0;
+    double number = 0;
+    try {
+        number = std::stod(value, &parsed);
+    } catch (const std::logic_error&) {
+        parsed = 0;
+    }
+    if (parsed == 0 || parsed != value.size()) {
+        throw std::invalid_argument("bad " + name + ": " + value);
+    }
+    return number;
+}
+
+inline uint64_t GetUintArg(const std::map<std::string, std::string>& args,
+                           const std::string& name,
+                           const std::string& default_value,
+                           uint64_t max = std::numeric_limits<uint64_t>::max()) {
+    return ToUint(name, GetArg(args, name, default_value), max);
+}
+
+inline uint32_t GetUint32Arg(const std::map<std::string, std::string>& args,
+                             const std::string& name,
+                             const std::string& default_value) {
+    return static_cast<uint32_t>(GetUintArg(
+        args, name, default_value, std::numeric_limits<uint32_t>::max()));
+}
+
+inline double GetDoubleArg(const std::map<std::string, std::string>& args,
+                           const std::string& name,
+                           const std::string& default_value) {
+    return ToDouble(name, GetArg(args, name, default_value));
+}
+
+/*
+Opens the global hardware counters if `perf=on` is given. Benchmarks run
+without them when perf events are unavailable.
+*/
+inline void EnablePerf(const std::map<std::string, std::string>& args) {
+    if (GetArg(args, "perf", "off") != "on") {
+        return;
+    }
+    if (!PerfCounters::Global().Open()) {
+        std::cerr << "perf events are unavailable, hardware counters are "
+                     "not collected\n";
+    }
+}
+
+inline std::vector<std::string> Split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        items.push_back(item);
+    }
+    return items;
+}
+}  // namespace BENCH
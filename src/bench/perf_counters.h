@@ -0,0 +1,194 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+
+namespace BENCH {
+enum class PerfEvent {
+    cycles,
+    instructions,
+    llc_misses,
+    dtlb_misses,
+    branch_misses,
+};
+
+constexpr static uint32_t PERF_EVENTS_NUMBER =
+    static_cast<uint32_t>(PerfEvent::branch_misses) + 1;
+
+constexpr static const char* PERF_EVENT_NAMES[] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses",
+};
+
+/*
+Counter values of one measured phase. Events the kernel refused to open
+are not `valid`.
+*/
+struct PerfSample {
+    std::array<uint64_t, PERF_EVENTS_NUMBER> values{};
+    std::array<bool, PERF_EVENTS_NUMBER> valid{};
+};
+
+/*
+Hardware counters read with `perf_event_open`. Every event has its own
+descriptor, so a machine without e.g. dTLB events still reports the rest, and
+a machine without perf events at all (containers, `perf_event_paranoid` > 2)
+reports nothing. Counters are inherited by threads created after `Open`.
+*/
+class PerfCounters {
+public:
+    PerfCounters() { fds_.fill(-1); }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        for (int fd : fds_) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+
+    /*
+    Counters shared by `Measure` and the benchmark drivers. They stay closed
+    until `Open` is called.
+    */
+    static PerfCounters& Global() {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    /*
+    Opens the events counting the calling process in user space. Returns
+    false if none of them is available.
+    */
+    bool Open() {
+        for (uint32_t event = 0; event != PERF_EVENTS_NUMBER; ++event) {
+            if (fds_[event] != -1) {
+                continue;
+            }
+
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            SetEvent(static_cast<PerfEvent>(event), attr);
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[event] = static_cast<int>(
+                syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        return Available();
+    }
+
+    bool Available() const {
+        for (int fd : fds_) {
+            if (fd != -1) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Start() {
+        for (int fd : fds_) {
+            if (fd != -1) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    /*
+    Stops counting and returns values since `Start`, scaled up if the kernel
+    multiplexed the counters.
+    */
+    PerfSample Stop() {
+        PerfSample sample;
+        for (uint32_t event = 0; event != PERF_EVENTS_NUMBER; ++event) {
+            if (fds_[event] == -1) {
+                continue;
+            }
+            ioctl(fds_[event], PERF_EVENT_IOC_DISABLE, 0);
+
+            // value, time enabled, time running
+            uint64_t data[3];
+            if (read(fds_[event], data, sizeof(data)) != sizeof(data) ||
+                data[2] == 0) {
+                continue;
+            }
+            sample.values[event] = static_cast<uint64_t>(
+                static_cast<double>(data[0]) * data[1] / data[2]);
+            sample.valid[event] = true;
+        }
+        return sample;
+    }
+
+private:
+    static void SetEvent(PerfEvent event, perf_event_attr& attr) {
+        switch (event) {
+            case PerfEvent::cycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case PerfEvent::instructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case PerfEvent::llc_misses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL |
+                              PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                              PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+                break;
+            case PerfEvent::dtlb_misses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                              PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                              PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+                break;
+            case PerfEvent::branch_misses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+        }
+    }
+
+    std::array<int, PERF_EVENTS_NUMBER> fds_;
+};
+
+/*
+Adds per operation counter values of `sample` to `metrics`.
+*/
+inline void AddPerfMetrics(const PerfSample& sample, uint64_t ops,
+                           std::map<std::string, double>& metrics) {
+    if (ops == 0) {
+        return;
+    }
+    for (uint32_t event = 0; event != PERF_EVENTS_NUMBER; ++event) {
+        if (sample.valid[event]) {
+            metrics[std::string(PERF_EVENT_NAMES[event]) + "_per_op"] =
+                static_cast<double>(sample.values[event]) / ops;
+        }
+    }
+
+    uint32_t cycles = static_cast<uint32_t>(PerfEvent::cycles);
+    uint32_t instructions = static_cast<uint32_t>(PerfEvent::instructions);
+    if (sample.valid[cycles] && sample.valid[instructions] &&
+        sample.values[cycles] != 0) {
+        metrics["ipc"] = static_cast<double>(sample.values[instructions]) /
+                         sample.values[cycles];
+    }
+}
+}  // namespace BENCH
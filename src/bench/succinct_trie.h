@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace BENCH {
+/*
+Bit vector with rank and select support. Rank directory keeps one counter
+per `WORDS_PER_BLOCK` words.
+*/
+class BitVector {
+public:
+    static constexpr size_t WORDS_PER_BLOCK = 8;
+
+    void PushBack(bool bit) {
+        if (size_ % 64 == 0) {
+            words_.push_back(0);
+        }
+        words_.back() |= static_cast<uint64_t>(bit) << (size_ % 64);
+        ++size_;
+    }
+
+    void Build() {
+        ranks_.clear();
+        uint32_t ones = 0;
+        for (size_t word = 0; word != words_.size(); ++word) {
+            if (word % WORDS_PER_BLOCK == 0) {
+                ranks_.push_back(ones);
+            }
+            ones += std::popcount(words_[word]);
+        }
+        ranks_.push_back(ones);
+        words_.shrink_to_fit();
+        ranks_.shrink_to_fit();
+    }
+
+    bool Get(size_t pos) const { return words_[pos / 64] >> (pos % 64) & 1; }
+
+    size_t Size() const { return size_; }
+
+    /*
+    Number of ones in [0, pos).
+    */
+    size_t Rank1(size_t pos) const {
+        size_t word = pos / 64;
+        size_t ones = ranks_[word / WORDS_PER_BLOCK];
+        for (size_t w = word / WORDS_PER_BLOCK * WORDS_PER_BLOCK; w != word;
+             ++w) {
+            ones += std::popcount(words_[w]);
+        }
+        if (pos % 64 != 0) {
+            ones += std::popcount(words_[word] << (64 - pos % 64));
+        }
+        return ones;
+    }
+
+    /*
+    Position of the one with index `k`, counting from 0.
+    */
+    size_t Select1(size_t k) const {
+        size_t block = std::upper_bound(ranks_.begin(), ranks_.end(), k) -
+                       ranks_.begin() - 1;
+        size_t ones = ranks_[block];
+        size_t word = block * WORDS_PER_BLOCK;
+        while (ones + std::popcount(words_[word]) <= k) {
+            ones += std::popcount(words_[word]);
+            ++word;
+        }
+        uint64_t bits = words_[word];
+        for (; ones != k; ++ones) {
+            bits &= bits - 1;
+        }
+        return word * 64 + std::countr_zero(bits);
+    }
+
+    size_t Bytes() const {
+        return words_.capacity() * sizeof(uint64_t) +
+               ranks_.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    std::vector<uint64_t> words_;
+    std::vector<uint32_t> ranks_;
+    size_t size_ = 0;
+};
+
+/*
+Byte-wise LOUDS trie in the spirit of SuRF's LOUDS-Sparse. Edges are stored
+in BFS order: a label, whether it leads to a child node, and whether it
+starts a node. Keys must be prefix-free, e.g. of the same length.
+*/
+class SuccinctTrie {
+public:
+    /*
+    Builds the trie from sorted unique `keys` and their `values`.
+    */
+    SuccinctTrie(const std::vector<std::string>& keys,
+                 const std::vector<uint32_t>& values) {
+        struct Range {
+            size_t begin;
+            size_t end;
+            size_t depth;
+        };
+
+        std::vector<Range> queue;
+        if (!keys.empty()) {
+            queue.push_back({0, keys.size(), 0});
+        }
+        for (size_t node = 0; node != queue.size(); ++node) {
+            Range range = queue[node];
+            for (size_t begin = range.begin; begin != range.end;) {
+                uint8_t label = keys[begin][range.depth];
+                size_t end = begin;
+                while (end != range.end &&
+                       static_cast<uint8_t>(keys[end][range.depth]) == label) {
+                    ++end;
+                }
+
+                bool has_child = keys[begin].size() != range.depth + 1;
+                labels_.push_back(label);
+                louds_.PushBack(begin == range.begin);
+                has_child_.PushBack(has_child);
+                if (has_child) {
+                    queue.push_back({begin, end, range.depth + 1});
+                } else {
+                    values_.push_back(values[begin]);
+                }
+                begin = end;
+            }
+        }
+
+        nodes_ = queue.size();
+        labels_.shrink_to_fit();
+        values_.shrink_to_fit();
+        louds_.Build();
+        has_child_.Build();
+    }
+
+    std::optional<uint32_t> Find(const std::string& key) const {
+        size_t node = 0;
+        for (size_t depth = 0; depth != key.size() && node != nodes_;
+             ++depth) {
+            size_t begin = louds_.Select1(node);
+            size_t end = node + 1 == nodes_ ? labels_.size()
+                                            : louds_.Select1(node + 1);
+            auto it = std::lower_bound(labels_.begin() + begin,
+                                       labels_.begin() + end,
+                                       static_cast<uint8_t>(key[depth]));
+            if (it == labels_.begin() + end ||
+                *it != static_cast<uint8_t>(key[depth])) {
+                return std::nullopt;
+            }
+
+            size_t pos = it - labels_.begin();
+            bool last = depth + 1 == key.size();
+            if (!has_child_.Get(pos)) {
+                return last ? std::optional<uint32_t>(
+                                  values_[pos - has_child_.Rank1(pos)])
+                            : std::nullopt;
+            }
+            node = has_child_.Rank1(pos + 1);
+        }
+        return std::nullopt;
+    }
+
+    size_t Bytes() const {
+        return labels_.capacity() + values_.capacity() * sizeof(uint32_t) +
+               louds_.Bytes() + has_child_.Bytes();
+    }
+
+private:
+    std::vector<uint8_t> labels_;
+    BitVector louds_;
+    BitVector has_child_;
+    std::vector<uint32_t> values_;
+    size_t nodes_ = 0;
+};
+}  // namespace BENCH
@@ -0,0 +1,108 @@
+#include <iostream>
+
+#include "../zddlsm/include/trace_replayer.h"
+#include "bench_util.h"
+
+namespace BENCH {
+/*
+Loads `key<TAB>level` lines, a missing level is 0.
+*/
+void LoadKeys(ZDDLSM::Storage& zdd, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+    for (std::string line; std::getline(in, line);) {
+        size_t tab = line.find('\t');
+        uint32_t level =
+            tab == std::string::npos
+                ? 0
+                : static_cast<uint32_t>(
+                      ToUint("level", line.substr(tab + 1),
+                             std::numeric_limits<uint32_t>::max()));
+        zdd.Set(line.substr(0, tab), level);
+    }
+}
+
+/*
+Replays a trace recorded with `Storage::StartTrace`.
+*/
+void LoadTrace(ZDDLSM::Storage& zdd, ZDDLSM::TraceReader& reader) {
+    ZDDLSM::TraceReplayer replayer(zdd, reader.Header());
+    for (ZDDLSM::TraceRecord record; reader.Next(record);) {
+        replayer.Apply(record);
+    }
+}
+
+int Inspect(const std::map<std::string, std::string>& args) {
+    std::unique_ptr<Compression::ICompressor> compressor =
+        Compression::BuildCompressor(
+            ParseCompression(GetArg(args, "compression", "none")));
+    uint32_t key_len = GetUint32Arg(args, "key_len", "16");
+    ZDDLSM::Options options;
+    options.column_families = GetArg(args, "column_families", "on") == "on";
+
+    std::optional<ZDDLSM::TraceReader> reader;
+    if (args.contains("trace")) {
+        reader.emplace(args.at("trace"));
+        key_len = reader->Header().key_len;
+        options.column_families = reader->Header().column_families;
+        compressor = reader->Header().BuildCompressor();
+    }
+
+    ZDDLSM::Storage zdd(key_len, std::move(compressor), options);
+    if (reader.has_value()) {
+        LoadTrace(zdd, *reader);
+    } else if (args.contains("keys_file")) {
+        LoadKeys(zdd, args.at("keys_file"));
+    } else {
+        std::vector<std::string> keys = GenerateKeys(
+            ParseDistribution(GetArg(args, "distribution", "uniform")),
+            GetUintArg(args, "keys", "10000"), key_len,
+            GetUintArg(args, "seed", "42"));
+        for (size_t i = 0; i != keys.size(); ++i) {
+            zdd.Set(keys[i], i % 7);
+        }
+    }
+
+    std::string reorder = GetArg(args, "reorder", "none");
+    if (reorder == "window") {
+        zdd.ReorderTokens(ZDDLSM::ReorderMethod::window);
+    } else if (reorder == "sifting") {
+        zdd.ReorderTokens(ZDDLSM::ReorderMethod::sifting);
+    } else if (reorder != "none") {
+        throw std::invalid_argument("unknown reorder method: " + reorder);
+    }
+
+    std::string format = GetArg(args, "format", "text");
+    if (format == "dot") {
+        std::cout << zdd.ToDot(GetUintArg(args, "max_nodes", "1000"));
+    } else if (format == "json") {
+        std::cout << zdd.Analyze().ToJson() << "\n";
+    } else if (format == "text") {
+        std::cout << "keys: " << zdd.Size() << "\n" << zdd.Analyze().ToString();
+    } else {
+        throw std::invalid_argument("unknown format: " + format);
+    }
+
+    return 0;
+}
+}  // namespace BENCH
+
+int main(int argc, char* argv[]) {
+    try {
+        return BENCH::Inspect(BENCH::ParseArgs(argc, argv));
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n"
+                  << "usage: zdd_inspect [trace=FILE | keys_file=FILE | "
+                     "keys=N distribution=uniform seed=N]\n"
+                     "    [key_len=N] [compression=none] "
+                     "[column_families=on|off]\n"
+                     "    [reorder=none|window|sifting (token bits)] "
+                     "[format=text|json|dot] [max_nodes=N]\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,245 @@
+#include <iostream>
+
+#include "bench_util.h"
+
+namespace BENCH {
+/*
+Every `SCAN_SEEK_PERIOD`-th key starts a short scan.
+*/
+constexpr static uint64_t SCAN_SEEK_PERIOD = 100;
+
+struct Config {
+    uint64_t keys;
+    uint32_t key_len;
+    uint32_t scan_len;
+    uint32_t column_families;
+    uint32_t root_table_bits;
+    uint64_t seed;
+};
+
+void AddParams(std::vector<Result>& results, size_t from,
+               const std::map<std::string, std::string>& params) {
+    for (size_t i = from; i != results.size(); ++i) {
+        results[i].params.insert(params.begin(), params.end());
+    }
+}
+
+void RunStorage(const Config& config, Distribution distribution,
+                Compression::compression type, std::vector<Result>& results) {
+    size_t from = results.size();
+    std::vector<std::string> keys =
+        GenerateKeys(distribution, config.keys, config.key_len, config.seed);
+    std::vector<std::string> missing = GenerateKeys(
+        Distribution::uniform, config.keys, config.key_len, config.seed + 1);
+    std::vector<size_t> order =
+        AccessOrder(distribution, config.keys, config.keys, config.seed + 2);
+
+    ZDDLSM::Options options;
+    options.column_families = false;
+    options.root_table_bits = config.root_table_bits;
+    ZDDLSM::Storage zdd(config.key_len, type, options);
+
+    results.push_back(Measure("set", config.keys, [&](uint64_t i) {
+        zdd.Set(keys[i], i % 7);
+    }));
+    ZDDLSM::StorageStats stats = zdd.GetStats();
+    results.back().metrics["bytes_per_key"] = stats.bytes_per_key;
+    results.back().metrics["zdd_nodes"] = stats.zdd_nodes;
+
+    results.push_back(Measure("get_hit", config.keys, [&](uint64_t i) {
+        if (!zdd.GetLevel(keys[order[i]]).has_value()) {
+            throw std::logic_error("inserted key is not found");
+        }
+    }));
+
+    results.push_back(Measure("get_miss", config.keys, [&](uint64_t i) {
+        zdd.GetLevel(missing[i]);
+    }));
+
+    uint64_t scanned = 0;
+    results.push_back(Measure(
+        "scan", config.keys / SCAN_SEEK_PERIOD, [&](uint64_t i) {
+            ZDDLSM::Iterator it(&zdd, keys[order[i * SCAN_SEEK_PERIOD]]);
+            for (uint32_t step = 0; step != config.scan_len && (*it); ++step) {
+                ++scanned;
+                it.Next();
+            }
+        }));
+    results.back().metrics["keys_scanned"] = scanned;
+    results.back().params["scan_len"] = std::to_string(config.scan_len);
+
+    results.push_back(Measure("full_scan", 1, [&](uint64_t) {
+        scanned = 0;
+        for (ZDDLSM::Iterator it(&zdd); (*it); it.Next()) {
+            ++scanned;
+        }
+    }));
+    results.back().metrics["keys_scanned"] = scanned;
+
+    std::optional<ZDDLSM::FrozenIndex> frozen;
+    results.push_back(
+        Measure("freeze", 1, [&](uint64_t) { frozen.emplace(zdd.Freeze()); }));
+    results.back().metrics["bytes_per_key"] =
+        static_cast<double>(frozen->Bytes()) / frozen->Size();
+    results.back().metrics["frozen_nodes"] = frozen->NodeCount();
+
+    results.push_back(Measure("frozen_get_hit", config.keys, [&](uint64_t i) {
+        if (!frozen->GetLevel(keys[order[i]]).has_value()) {
+            throw std::logic_error("frozen key is not found");
+        }
+    }));
+
+    results.push_back(Measure("frozen_scan", 1, [&](uint64_t) {
+        scanned = 0;
+        for (ZDDLSM::FrozenIterator it(&*frozen); (*it); it.Next()) {
+            ++scanned;
+        }
+    }));
+    results.back().metrics["keys_scanned"] = scanned;
+    frozen.reset();
+
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<uint64_t> key_bytes(0);
+    results.push_back(Measure("parallel_scan", 1, [&](uint64_t) {
+        scanned = zdd.ParallelScan(
+            threads, [&](uint32_t, const ZDDLSM::KeyLevelPair& key) {
+                key_bytes.fetch_add(key.Key().size(),
+                                    std::memory_order_relaxed);
+            });
+    }));
+    results.back().metrics["keys_scanned"] = scanned;
+    results.back().params["threads"] = std::to_string(threads);
+
+    // the first call fills subtree sizes, later ones walk one path
+    results.push_back(Measure("key_at_rank", config.keys, [&](uint64_t i) {
+        if (!zdd.KeyAtRank(order[i]).has_value()) {
+            throw std::logic_error("rank of a stored key is not found");
+        }
+    }));
+
+    results.push_back(Measure("rank_of", config.keys, [&](uint64_t i) {
+        zdd.RankOf(keys[order[i]]);
+    }));
+
+    results.push_back(Measure("delete", config.keys / 2, [&](uint64_t i) {
+        zdd.Delete(keys[i]);
+    }));
+
+    // ranges are over stored keys, so they follow user keys uncompressed only
+    if (type == Compression::compression::none) {
+        std::vector<std::string> rest(keys.begin() + config.keys / 2,
+                                      keys.end());
+        std::sort(rest.begin(), rest.end());
+        uint64_t range_deleted = 0;
+        results.push_back(Measure("delete_range", 1, [&](uint64_t) {
+            range_deleted = zdd.DeleteRange(rest[rest.size() / 4],
+                                            rest[rest.size() * 3 / 4]);
+        }));
+        results.back().metrics["keys_deleted"] = range_deleted;
+    }
+
+    ZDDLSM::Storage other(config.key_len, type, options);
+    for (uint64_t i = 0; i != config.keys / 2; ++i) {
+        other.Set(keys[i], i % 5);
+    }
+    ZDDLSM::MergeStats merged{0, 0};
+    results.push_back(Measure("merge", 1, [&](uint64_t) {
+        merged = zdd.MergeFrom(other, ZDDLSM::ConflictPolicy::min_level);
+    }));
+    results.back().metrics["keys_merged"] = merged.added_keys;
+
+    std::vector<std::pair<std::string, uint32_t>> levels;
+    levels.reserve(config.keys);
+    for (uint64_t i = 0; i != config.keys; ++i) {
+        levels.emplace_back(keys[i], i % 7);
+    }
+    ZDDLSM::Storage loaded(config.key_len, type, options);
+    results.push_back(Measure("bulk_load", 1, [&](uint64_t) {
+        loaded.BulkLoad(levels);
+    }));
+    results.back().metrics["bytes_per_key"] = loaded.GetStats().bytes_per_key;
+    results.back().metrics["keys_loaded"] = loaded.Size();
+
+    AddParams(results, from,
+              {{"distribution", DistributionName(distribution)},
+               {"compression", CompressionName(type)},
+               {"key_len", std::to_string(config.key_len)},
+               {"keys", std::to_string(config.keys)},
+               {"root_table_bits", std::to_string(config.root_table_bits)}});
+}
+
+void RunColumnFamilies(const Config& config, Distribution distribution,
+                       std::vector<Result>& results) {
+    size_t from = results.size();
+    std::vector<std::string> keys =
+        GenerateKeys(distribution, config.keys, config.key_len, config.seed);
+    std::vector<size_t> order =
+        AccessOrder(distribution, config.keys, config.keys, config.seed + 2);
+
+    ZDDLSM::Storage zdd(config.key_len);
+    results.push_back(Measure("cf_set", config.keys, [&](uint64_t i) {
+        zdd.Set(i % config.column_families, keys[i], i % 7);
+    }));
+    results.back().metrics["bytes_per_key"] = zdd.GetStats().bytes_per_key;
+
+    results.push_back(Measure("cf_get_hit", config.keys, [&](uint64_t i) {
+        size_t index = order[i];
+        if (!zdd.GetLevel(index % config.column_families, keys[index])
+                 .has_value()) {
+            throw std::logic_error("inserted key is not found");
+        }
+    }));
+
+    results.push_back(Measure("cf_drop", config.column_families,
+                              [&](uint64_t i) { zdd.DropColumnFamily(i); }));
+
+    AddParams(results, from,
+              {{"distribution", DistributionName(distribution)},
+               {"compression", "none"},
+               {"key_len", std::to_string(config.key_len)},
+               {"keys", std::to_string(config.keys)},
+               {"column_families", std::to_string(config.column_families)}});
+}
+}  // namespace BENCH
+
+int main(int argc, char* argv[]) {
+    std::map<std::string, std::string> args;
+    BENCH::Config config;
+    try {
+        args = BENCH::ParseArgs(argc, argv);
+        config = BENCH::Config{
+            BENCH::GetUintArg(args, "keys", "100000"),
+            BENCH::GetUint32Arg(args, "key_len", "16"),
+            BENCH::GetUint32Arg(args, "scan_len", "100"),
+            BENCH::GetUint32Arg(args, "column_families", "4"),
+            BENCH::GetUint32Arg(args, "root_table_bits", "9"),
+            BENCH::GetUintArg(args, "seed", "42"),
+        };
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n"
+                  << "usage: zddlsm_bench [keys=N] [key_len=N] [scan_len=N] "
+                     "[column_families=N] [root_table_bits=N] [seed=N]\n"
+                     "    [distribution=uniform,sequential,zipf,shared_prefix]"
+                     "\n    [compression=none,zstd,md5,sha256,fingerprint] "
+                     "[perf=on] [out=FILE]\n";
+        return 1;
+    }
+    BENCH::EnablePerf(args);
+
+    std::vector<BENCH::Result> results;
+    for (const std::string& distribution_name : BENCH::Split(BENCH::GetArg(
+             args, "distribution", "uniform,sequential,zipf,shared_prefix"))) {
+        BENCH::Distribution distribution =
+            BENCH::ParseDistribution(distribution_name);
+        for (const std::string& compression : BENCH::Split(BENCH::GetArg(
+                 args, "compression", "none,zstd,md5,sha256,fingerprint"))) {
+            BENCH::RunStorage(config, distribution,
+                              BENCH::ParseCompression(compression), results);
+        }
+        BENCH::RunColumnFamilies(config, distribution, results);
+    }
+
+    BENCH::WriteResults(results, BENCH::GetArg(args, "out", ""));
+
+    return 0;
+}
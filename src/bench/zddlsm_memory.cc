@@ -0,0 +1,275 @@
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <unordered_map>
+
+#include "bench_util.h"
+#include "succinct_trie.h"
+
+namespace BENCH {
+const std::vector<std::string> STRUCTURES = {
+    "zdd", "std_map", "std_unordered_map", "sorted_vector", "succinct_trie",
+};
+
+/*
+Measurement sent by a child process.
+*/
+struct Measurement {
+    uint64_t bytes;
+    uint64_t estimated_bytes;
+    double build_seconds;
+    double lookup_seconds;
+    ZDDLSM::LatencyHistogram latency;
+    PerfSample lookup_perf;
+};
+
+/*
+Bytes currently allocated by malloc, including mmap-ed chunks.
+*/
+uint64_t AllocatedBytes() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/*
+Builds `structure` from `keys` and looks every key up in `order`. Hardware
+counters of lookups are collected if `perf` is set.
+*/
+Measurement MeasureStructure(const std::string& structure,
+                             const std::vector<std::string>& keys,
+                             const std::vector<size_t>& order,
+                             uint32_t key_len, bool perf) {
+    Measurement measurement{};
+    std::function<bool(const std::string&)> lookup;
+
+    // structures are built in place, so that nothing but them is allocated
+    std::optional<ZDDLSM::Storage> zdd;
+    std::map<std::string, uint32_t> map;
+    std::unordered_map<std::string, uint32_t> hash_map;
+    std::vector<std::pair<std::string, uint32_t>> sorted;
+    std::optional<SuccinctTrie> trie;
+
+    uint64_t before = AllocatedBytes();
+    uint64_t start = NowNs();
+    if (structure == "zdd") {
+        ZDDLSM::Options options;
+        options.column_families = false;
+        zdd.emplace(key_len, Compression::compression::none, options);
+        for (size_t i = 0; i != keys.size(); ++i) {
+            zdd->Set(keys[i], i % 7);
+        }
+        lookup = [&](const std::string& key) {
+            return zdd->GetLevel(key).has_value();
+        };
+    } else if (structure == "std_map") {
+        for (size_t i = 0; i != keys.size(); ++i) {
+            map.emplace(keys[i], i % 7);
+        }
+        lookup = [&](const std::string& key) {
+            return map.find(key) != map.end();
+        };
+    } else if (structure == "std_unordered_map") {
+        for (size_t i = 0; i != keys.size(); ++i) {
+            hash_map.emplace(keys[i], i % 7);
+        }
+        lookup = [&](const std::string& key) {
+            return hash_map.find(key) != hash_map.end();
+        };
+    } else if (structure == "sorted_vector") {
+        for (size_t i = 0; i != keys.size(); ++i) {
+            sorted.emplace_back(keys[i], i % 7);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        sorted.shrink_to_fit();
+        lookup = [&](const std::string& key) {
+            auto it = std::lower_bound(sorted.begin(), sorted.end(),
+                                       std::make_pair(key, uint32_t{0}));
+            return it != sorted.end() && it->first == key;
+        };
+    } else {
+        std::vector<std::pair<std::string, uint32_t>> input;
+        for (size_t i = 0; i != keys.size(); ++i) {
+            input.emplace_back(keys[i], i % 7);
+        }
+        std::sort(input.begin(), input.end());
+        std::vector<std::string> sorted_keys;
+        std::vector<uint32_t> values;
+        for (auto& [key, value] : input) {
+            sorted_keys.push_back(std::move(key));
+            values.push_back(value);
+        }
+        trie.emplace(sorted_keys, values);
+        lookup = [&](const std::string& key) {
+            return trie->Find(key).has_value();
+        };
+    }
+    measurement.build_seconds = static_cast<double>(NowNs() - start) / 1e9;
+    measurement.bytes = AllocatedBytes() - before;
+    // estimates are taken outside the build timer, GetStats walks the ZDD
+    if (zdd.has_value()) {
+        ZDDLSM::StorageStats stats = zdd->GetStats();
+        measurement.estimated_bytes =
+            stats.zdd_bytes + stats.data_bytes + stats.scan_bytes;
+    } else if (trie.has_value()) {
+        measurement.estimated_bytes = trie->Bytes();
+    }
+
+    // counters are opened in the process that does the lookups
+    PerfCounters counters;
+    if (perf) {
+        counters.Open();
+    }
+    counters.Start();
+    start = NowNs();
+    for (size_t index : order) {
+        uint64_t lookup_start = NowNs();
+        bool found = lookup(keys[index]);
+        measurement.latency.Record(NowNs() - lookup_start);
+        if (!found) {
+            throw std::logic_error(structure + " lost an inserted key");
+        }
+    }
+    measurement.lookup_seconds = static_cast<double>(NowNs() - start) / 1e9;
+    measurement.lookup_perf = counters.Stop();
+
+    return measurement;
+}
+
+/*
+Runs `MeasureStructure` in a child process, so that every structure starts
+with a fresh heap and SAPPORO node table.
+*/
+Measurement MeasureInChild(const std::string& structure,
+                           const std::vector<std::string>& keys,
+                           const std::vector<size_t>& order,
+                           uint32_t key_len, bool perf) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        try {
+            Measurement measurement =
+                MeasureStructure(structure, keys, order, key_len, perf);
+            bool ok = write(fds[1], &measurement, sizeof(measurement)) ==
+                      sizeof(measurement);
+            _exit(ok ? 0 : 1);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            _exit(1);
+        }
+    }
+
+    close(fds[1]);
+    Measurement measurement{};
+    ssize_t read_bytes = read(fds[0], &measurement, sizeof(measurement));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (read_bytes != sizeof(measurement) || status != 0) {
+        throw std::runtime_error("measurement of " + structure + " failed");
+    }
+    return measurement;
+}
+}  // namespace BENCH
+
+int main(int argc, char* argv[]) {
+    std::map<std::string, std::string> args;
+    uint64_t keys_number = 0;
+    uint64_t seed = 0;
+    std::vector<uint32_t> key_lens;
+    std::vector<std::pair<std::string, double>> shares;
+    try {
+        args = BENCH::ParseArgs(argc, argv);
+        keys_number = BENCH::GetUintArg(args, "keys", "100000");
+        seed = BENCH::GetUintArg(args, "seed", "42");
+        for (const std::string& key_len :
+             BENCH::Split(BENCH::GetArg(args, "key_len", "8,16,32"))) {
+            key_lens.push_back(static_cast<uint32_t>(BENCH::ToUint(
+                "key_len", key_len, std::numeric_limits<uint32_t>::max())));
+        }
+        for (const std::string& share : BENCH::Split(
+                 BENCH::GetArg(args, "prefix_share", "0,0.5,0.75"))) {
+            shares.emplace_back(share, BENCH::ToDouble("prefix_share", share));
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n"
+                  << "usage: zddlsm_memory [keys=N] [key_len=8,16,32] "
+                     "[prefix_share=0,0.5,0.75]\n"
+                     "    [structure=zdd,std_map,std_unordered_map,"
+                     "sorted_vector,succinct_trie] [seed=N] [perf=on]\n"
+                     "    [out=FILE]\n";
+        return 1;
+    }
+
+    bool perf = BENCH::GetArg(args, "perf", "off") == "on";
+    if (perf && !BENCH::PerfCounters().Open()) {
+        std::cerr << "perf events are unavailable, hardware counters are "
+                     "not collected\n";
+    }
+
+    std::vector<BENCH::Result> results;
+    for (uint32_t key_len : key_lens) {
+        for (const auto& [share, share_fraction] : shares) {
+            std::vector<std::string> keys;
+            try {
+                keys = BENCH::GenerateKeys(BENCH::Distribution::shared_prefix,
+                                           keys_number, key_len, seed,
+                                           share_fraction);
+            } catch (const std::invalid_argument& e) {
+                std::cerr << "key_len " << key_len << ", prefix_share "
+                          << share << ": " << e.what() << "\n";
+                continue;
+            }
+            std::vector<size_t> order = BENCH::AccessOrder(
+                BENCH::Distribution::uniform, keys_number, keys_number, seed);
+
+            for (const std::string& structure :
+                 BENCH::Split(BENCH::GetArg(args, "structure",
+                                            "zdd,std_map,std_unordered_map,"
+                                            "sorted_vector,succinct_trie"))) {
+                if (std::find(BENCH::STRUCTURES.begin(),
+                              BENCH::STRUCTURES.end(),
+                              structure) == BENCH::STRUCTURES.end()) {
+                    std::cerr << "unknown structure: " << structure << "\n";
+                    return 1;
+                }
+                BENCH::Measurement measurement =
+                    BENCH::MeasureInChild(structure, keys, order, key_len,
+                                          perf);
+
+                BENCH::Result result;
+                result.name = structure;
+                result.params["key_len"] = std::to_string(key_len);
+                result.params["prefix_share"] = share;
+                result.params["keys"] = std::to_string(keys_number);
+                result.ops = order.size();
+                result.seconds = measurement.lookup_seconds;
+                result.latency = measurement.latency;
+                result.metrics["bytes_per_key"] =
+                    static_cast<double>(measurement.bytes) / keys_number;
+                result.metrics["build_seconds"] = measurement.build_seconds;
+                if (measurement.estimated_bytes != 0) {
+                    result.metrics["estimated_bytes_per_key"] =
+                        static_cast<double>(measurement.estimated_bytes) /
+                        keys_number;
+                }
+                BENCH::AddPerfMetrics(measurement.lookup_perf, result.ops,
+                                      result.metrics);
+                results.push_back(std::move(result));
+            }
+        }
+    }
+
+    BENCH::WriteResults(results, BENCH::GetArg(args, "out", ""));
+
+    return 0;
+}
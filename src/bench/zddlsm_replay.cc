@@ -0,0 +1,92 @@
+#include <iostream>
+#include <thread>
+
+#include "../zddlsm/include/trace_replayer.h"
+#include "bench_util.h"
+
+namespace BENCH {
+constexpr static const char* TRACE_OP_NAMES[] = {
+    "set", "delete", "get_level", "iterator_seek", "iterator_next",
+    "delete_range", "delete_prefix", "set_location", "iterator_skip",
+    "merge_key", "drop_column_family",
+};
+
+constexpr static uint32_t TRACE_OPS_NUMBER =
+    static_cast<uint32_t>(ZDDLSM::TraceOp::drop_column_family) + 1;
+}  // namespace BENCH
+
+int Replay(std::map<std::string, std::string>& args) {
+    std::string pacing = BENCH::GetArg(args, "pacing", "max");
+
+    // keys are compressed the way the trace header says
+    ZDDLSM::TraceReader reader(args["trace"]);
+    const ZDDLSM::TraceHeader& header = reader.Header();
+    ZDDLSM::Options options;
+    options.column_families = header.column_families;
+    ZDDLSM::Storage zdd(header.key_len, header.BuildCompressor(), options);
+    ZDDLSM::TraceReplayer replayer(zdd, header);
+    std::string compression = BENCH::CompressionName(header.compression);
+
+    std::vector<BENCH::Result> results(BENCH::TRACE_OPS_NUMBER);
+    ZDDLSM::TraceRecord record;
+    uint64_t start = BENCH::NowNs();
+    while (reader.Next(record)) {
+        if (pacing == "original") {
+            uint64_t due = start + record.time_ns;
+            uint64_t now = BENCH::NowNs();
+            if (due > now) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+        }
+
+        uint64_t op_start = BENCH::NowNs();
+        replayer.Apply(record);
+        uint64_t op_end = BENCH::NowNs();
+
+        BENCH::Result& result = results[static_cast<uint32_t>(record.op)];
+        result.latency.Record(op_end - op_start);
+        result.seconds += static_cast<double>(op_end - op_start) / 1e9;
+        ++result.ops;
+    }
+    double total_seconds = static_cast<double>(BENCH::NowNs() - start) / 1e9;
+    double bytes_per_key = zdd.GetStats().bytes_per_key;
+
+    std::vector<BENCH::Result> replayed;
+    for (uint32_t op = 0; op != BENCH::TRACE_OPS_NUMBER; ++op) {
+        if (results[op].ops == 0) {
+            continue;
+        }
+        results[op].name = BENCH::TRACE_OP_NAMES[op];
+        results[op].params["pacing"] = pacing;
+        results[op].params["compression"] = compression;
+        results[op].metrics["replay_seconds"] = total_seconds;
+        results[op].metrics["bytes_per_key"] = bytes_per_key;
+        replayed.push_back(std::move(results[op]));
+    }
+
+    BENCH::WriteResults(replayed, BENCH::GetArg(args, "out", ""));
+
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::map<std::string, std::string> args;
+    try {
+        args = BENCH::ParseArgs(argc, argv);
+        if (!args.contains("trace")) {
+            throw std::invalid_argument("trace is required");
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n"
+                  << "usage: zddlsm_replay trace=FILE [pacing=max|original] "
+                     "[out=FILE]\n";
+        return 1;
+    }
+
+    try {
+        return Replay(args);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
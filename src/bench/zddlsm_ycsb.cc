@@ -0,0 +1,269 @@
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "bench_util.h"
+
+namespace BENCH {
+enum class OpType {
+    read,
+    update,
+    insert,
+    scan,
+    read_modify_write,
+};
+
+constexpr static uint32_t OP_TYPES_NUMBER =
+    static_cast<uint32_t>(OpType::read_modify_write) + 1;
+
+constexpr static const char* OP_NAMES[] = {
+    "read", "update", "insert", "scan", "read_modify_write",
+};
+
+constexpr static uint32_t MAX_SCAN_LEN = 100;
+
+/*
+Operation mix of a YCSB core workload. `latest` reads recently inserted keys
+(workload D), otherwise requests follow Zipf over all keys.
+*/
+struct Workload {
+    std::string name;
+    double read;
+    double update;
+    double insert;
+    double scan;
+    double read_modify_write;
+    bool latest;
+};
+
+const std::vector<Workload> WORKLOADS = {
+    {"A", 0.5, 0.5, 0, 0, 0, false},    {"B", 0.95, 0.05, 0, 0, 0, false},
+    {"C", 1, 0, 0, 0, 0, false},        {"D", 0.95, 0, 0.05, 0, 0, true},
+    {"E", 0, 0, 0.05, 0.95, 0, false},  {"F", 0.5, 0, 0, 0, 0.5, false},
+};
+
+struct Config {
+    uint64_t records;
+    uint32_t key_len;
+    double duration;
+    double theta;
+    uint64_t seed;
+};
+
+/*
+Key of record `id`, "user" followed by a hash of `id` as in YCSB.
+*/
+std::string KeyOf(uint64_t id, uint32_t key_len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t byte = 0; byte != sizeof(id); ++byte) {
+        hash = (hash ^ ((id >> (byte * 8)) & 0xFF)) * 0x100000001b3ULL;
+    }
+    std::string key = "user" + std::to_string(hash);
+    key.resize(key_len, '0');
+    return key;
+}
+
+OpType ChooseOp(const Workload& workload, double u) {
+    double bounds[] = {workload.read, workload.update, workload.insert,
+                       workload.scan, workload.read_modify_write};
+    for (uint32_t op = 0; op != OP_TYPES_NUMBER; ++op) {
+        if (u < bounds[op]) {
+            return static_cast<OpType>(op);
+        }
+        u -= bounds[op];
+    }
+    return OpType::read;
+}
+
+struct ThreadResult {
+    uint64_t ops = 0;
+    std::array<ZDDLSM::LatencyHistogram, OP_TYPES_NUMBER> latency;
+};
+
+/*
+Runs reads, updates and inserts through the combiner of `async`. Returns
+false for operations it doesn't support.
+*/
+bool RunAsync(ZDDLSM::AsyncStorage& async, OpType op, uint64_t id,
+              const Config& config, std::atomic<uint64_t>& inserted,
+              std::mt19937_64& rng) {
+    switch (op) {
+        case OpType::read:
+            async.GetLevel(KeyOf(id, config.key_len)).wait();
+            return true;
+        case OpType::update:
+            async.Set(KeyOf(id, config.key_len), rng() % 7).wait();
+            return true;
+        case OpType::insert:
+            async.Set(KeyOf(inserted.fetch_add(1), config.key_len), rng() % 7)
+                .wait();
+            return true;
+        default:
+            return false;
+    }
+}
+
+void RunThread(ZDDLSM::Storage& zdd, ZDDLSM::AsyncStorage* async,
+               const Workload& workload, const Config& config,
+               const ZipfGenerator& zipf, std::atomic<uint64_t>& inserted,
+               uint64_t deadline_ns, uint64_t seed, ThreadResult& result) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    while (NowNs() < deadline_ns) {
+        OpType op = ChooseOp(workload, uniform(rng));
+        uint64_t records = inserted.load();
+        uint64_t item = zipf.Next(rng);
+        uint64_t id = workload.latest ? records - 1 - item % records
+                                      : Scramble(item, records);
+        uint64_t start = NowNs();
+        if (async == nullptr ||
+            !RunAsync(*async, op, id, config, inserted, rng)) {
+            ZDDLSM::LockGuard guard = zdd.Lock();
+            switch (op) {
+                case OpType::read:
+                    zdd.GetLevel(KeyOf(id, config.key_len));
+                    break;
+                case OpType::update:
+                    zdd.Set(KeyOf(id, config.key_len), rng() % 7);
+                    break;
+                case OpType::insert:
+                    zdd.Set(KeyOf(inserted.fetch_add(1), config.key_len),
+                            rng() % 7);
+                    break;
+                case OpType::scan: {
+                    uint64_t scan_len = 1 + rng() % MAX_SCAN_LEN;
+                    ZDDLSM::Iterator it(&zdd, KeyOf(id, config.key_len));
+                    for (uint64_t i = 0; i != scan_len && (*it); ++i) {
+                        it.Next();
+                    }
+                    break;
+                }
+                case OpType::read_modify_write: {
+                    std::string key = KeyOf(id, config.key_len);
+                    zdd.Set(key, zdd.GetLevel(key).value_or(0) + 1);
+                    break;
+                }
+            }
+        }
+        result.latency[static_cast<uint32_t>(op)].Record(NowNs() - start);
+        ++result.ops;
+    }
+}
+
+Result RunWorkload(ZDDLSM::Storage& zdd, ZDDLSM::AsyncStorage* async,
+                   const Workload& workload, const Config& config,
+                   const ZipfGenerator& zipf, std::atomic<uint64_t>& inserted,
+                   uint32_t threads_number) {
+    std::vector<ThreadResult> thread_results(threads_number);
+    std::vector<std::thread> threads;
+    PerfCounters& perf = PerfCounters::Global();
+    perf.Start();
+    uint64_t start = NowNs();
+    uint64_t deadline = start + static_cast<uint64_t>(config.duration * 1e9);
+    for (uint32_t i = 0; i != threads_number; ++i) {
+        threads.emplace_back(RunThread, std::ref(zdd), async,
+                             std::cref(workload), std::cref(config),
+                             std::cref(zipf), std::ref(inserted), deadline,
+                             config.seed + i, std::ref(thread_results[i]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    Result result;
+    result.name = "ycsb_" + workload.name;
+    result.seconds = static_cast<double>(NowNs() - start) / 1e9;
+    PerfSample sample = perf.Stop();
+    result.params["threads"] = std::to_string(threads_number);
+    result.params["records"] = std::to_string(config.records);
+    result.params["key_len"] = std::to_string(config.key_len);
+    result.params["async"] = async == nullptr ? "off" : "on";
+
+    for (uint32_t op = 0; op != OP_TYPES_NUMBER; ++op) {
+        ZDDLSM::LatencyHistogram latency;
+        for (const ThreadResult& thread_result : thread_results) {
+            latency.Merge(thread_result.latency[op]);
+        }
+        if (latency.Count() != 0) {
+            std::string name = OP_NAMES[op];
+            result.metrics[name + "_ops"] = latency.Count();
+            result.metrics[name + "_p50_ns"] = latency.Percentile(50);
+            result.metrics[name + "_p99_ns"] = latency.Percentile(99);
+            result.metrics[name + "_p999_ns"] = latency.Percentile(99.9);
+        }
+        result.latency.Merge(latency);
+    }
+    result.ops = result.latency.Count();
+    AddPerfMetrics(sample, result.ops, result.metrics);
+    return result;
+}
+}  // namespace BENCH
+
+int main(int argc, char* argv[]) {
+    std::map<std::string, std::string> args;
+    BENCH::Config config;
+    std::vector<uint32_t> thread_counts;
+    try {
+        args = BENCH::ParseArgs(argc, argv);
+        config = BENCH::Config{
+            BENCH::GetUintArg(args, "records", "100000"),
+            BENCH::GetUint32Arg(args, "key_len", "24"),
+            BENCH::GetDoubleArg(args, "duration", "5"),
+            BENCH::GetDoubleArg(args, "theta", "0.99"),
+            BENCH::GetUintArg(args, "seed", "42"),
+        };
+        for (const std::string& threads : BENCH::Split(
+                 BENCH::GetArg(args, "threads", "1,2,4,8,16,32"))) {
+            thread_counts.push_back(static_cast<uint32_t>(
+                BENCH::ToUint("threads", threads, 1024)));
+        }
+        if (!(config.theta >= 0 && config.theta < 1)) {
+            throw std::invalid_argument("theta must be in [0, 1)");
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\n"
+                  << "usage: zddlsm_ycsb [workload=A,B,C,D,E,F] "
+                     "[threads=1,2,4,8,16,32]\n"
+                     "    [records=N] [key_len=N] [duration=SECONDS] "
+                     "[theta=0.99] [seed=N] [async=on]\n"
+                     "    [perf=on] [out=FILE]\n";
+        return 1;
+    }
+    BENCH::EnablePerf(args);
+
+    // zeta sums take O(records), so they are done once, off the clock
+    const BENCH::ZipfGenerator zipf(config.records, config.theta);
+    std::vector<BENCH::Result> results;
+    for (const std::string& name :
+         BENCH::Split(BENCH::GetArg(args, "workload", "A,B,C,D,E,F"))) {
+        auto workload = std::find_if(
+            BENCH::WORKLOADS.begin(), BENCH::WORKLOADS.end(),
+            [&name](const BENCH::Workload& w) { return w.name == name; });
+        if (workload == BENCH::WORKLOADS.end()) {
+            std::cerr << "unknown workload: " << name << "\n";
+            return 1;
+        }
+
+        // one load per workload, thread counts run on the same storage
+        ZDDLSM::Storage zdd(config.key_len);
+        for (uint64_t id = 0; id != config.records; ++id) {
+            zdd.Set(BENCH::KeyOf(id, config.key_len), id % 7);
+        }
+        std::atomic<uint64_t> inserted = config.records;
+        std::optional<ZDDLSM::AsyncStorage> async;
+        if (BENCH::GetArg(args, "async", "off") == "on") {
+            async.emplace(zdd);
+        }
+
+        for (uint32_t threads : thread_counts) {
+            results.push_back(BENCH::RunWorkload(
+                zdd, async.has_value() ? &*async : nullptr, *workload, config,
+                zipf, inserted, threads));
+        }
+    }
+
+    BENCH::WriteResults(results, BENCH::GetArg(args, "out", ""));
+
+    return 0;
+}
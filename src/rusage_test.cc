@@ -8,6 +8,11 @@
 #include "zddlsm/include/zddlsm.h"
 
 namespace TEST {
+/*
+Number of test keys used to train zstd dictionary.
+*/
+constexpr static size_t DICT_SAMPLES = 10000;
+
 std::string GenerateKey(size_t count) {
     std::string bytes(count, 0);
     std::random_device rd;
@@ -48,24 +53,27 @@ double GetTimeInSecs(std::chrono::_V2::system_clock::time_point start) {
            1000;
 }
 
-void PrintResults(uint32_t test_size, Compression::compression type,
+std::string CompressionName(Compression::compression type,
+                            bool zstd_dictionary) {
+    switch (type) {
+        case Compression::compression::zstd:
+            return zstd_dictionary ? "zstd_dict" : "zstd";
+        case Compression::compression::md5:
+            return "md5";
+        case Compression::compression::sha256:
+            return "sha256";
+        case Compression::compression::fingerprint:
+            return "fingerprint";
+        default:
+            return "uncompressed";
+    }
+}
+
+void PrintResults(uint32_t test_size, const std::string& compression,
                   uint32_t step, const std::vector<double>& time_samples,
                   const std::vector<double>& mem_samples,
                   const std::string& tests_dir, const std::string& test_name) {
-    auto compression = [type]() {
-        switch (type) {
-            case Compression::compression::zstd:
-                return "zstd";
-            case Compression::compression::md5:
-                return "md5";
-            case Compression::compression::sha256:
-                return "sha256";
-            default:
-                return "uncompressed";
-        }
-    };
-
-    std::ofstream f(tests_dir + test_name + "_" + compression() + ".out");
+    std::ofstream f(tests_dir + test_name + "_" + compression + ".out");
 
     size_t n = test_size / step + 1;
     f << n << "\n";
@@ -84,10 +92,8 @@ void PrintResults(uint32_t test_size, Compression::compression type,
 }
 
 void test(uint32_t key_byte_len, uint32_t test_size,
-          Compression::compression type, const std::string& tests_dir,
-          const std::string& test_name) {
-    ZDDLSM::Storage zdd(key_byte_len, type);
-
+          Compression::compression type, bool zstd_dictionary,
+          const std::string& tests_dir, const std::string& test_name) {
     uint32_t step = 1000;
 
     std::vector<double> time_samples;
@@ -95,18 +101,7 @@ void test(uint32_t key_byte_len, uint32_t test_size,
     time_samples.reserve(test_size);
     mem_samples.reserve(test_size);
 
-    auto compression = [type]() {
-        switch (type) {
-            case Compression::compression::zstd:
-                return "zstd";
-            case Compression::compression::md5:
-                return "md5";
-            case Compression::compression::sha256:
-                return "sha256";
-            default:
-                return "uncompressed";
-        }
-    };
+    std::string compression = CompressionName(type, zstd_dictionary);
 
     std::fstream testfile(tests_dir + test_name);
     std::string key;
@@ -120,12 +115,26 @@ void test(uint32_t key_byte_len, uint32_t test_size,
 
     testfile.close();
 
+    std::unique_ptr<Compression::ICompressor> compressor;
+    if (zstd_dictionary) {
+        // dictionary is trained on a prefix of the test keys
+        std::vector<std::string> samples(
+            keys.begin(),
+            keys.begin() + std::min<size_t>(keys.size(), DICT_SAMPLES));
+        compressor = std::make_unique<Compression::ZstdCompressor>(
+            Compression::ZstdCompressor::TrainDictionary(samples));
+    } else {
+        compressor = Compression::BuildCompressor(type);
+    }
+
+    ZDDLSM::Storage zdd(key_byte_len, std::move(compressor));
+
     auto start = std::chrono::high_resolution_clock::now();
     for (size_t i = 0; i <= test_size; ++i) {
         if (i % step == 0) {
             double mem_used = GetMemoryUsage();
             double time_used = GetTimeInSecs(start);
-            std::cout << "Compression type: " << compression() << "\n";
+            std::cout << "Compression type: " << compression << "\n";
             std::cout << "Inserted        : " << i << "\n";
             std::cout << "Memory used     : " << mem_used << "MB\n";
             std::cout << "Time used       : " << time_used << "s\n\n";
@@ -151,8 +160,8 @@ void test(uint32_t key_byte_len, uint32_t test_size,
 
     std::cerr << "Tests passed!\n";
 
-    PrintResults(test_size, type, step, time_samples, mem_samples, tests_dir,
-                 test_name);
+    PrintResults(test_size, compression, step, time_samples, mem_samples,
+                 tests_dir, test_name);
 }
 }  // namespace TEST
 
@@ -169,18 +178,21 @@ int main(int argc, char* argv[]) {
     std::string test_name = argv[5];
 
     auto compression = [&compression_type]() {
-        if (compression_type == "zstd") {
+        if (compression_type == "zstd" || compression_type == "zstd_dict") {
             return Compression::compression::zstd;
         } else if (compression_type == "md5") {
             return Compression::compression::md5;
         } else if (compression_type == "sha256") {
             return Compression::compression::sha256;
+        } else if (compression_type == "fingerprint") {
+            return Compression::compression::fingerprint;
         } else {
             return Compression::compression::none;
         }
     };
 
-    TEST::test(key_byte_len, test_size, compression(), tests_dir, test_name);
+    TEST::test(key_byte_len, test_size, compression(),
+               compression_type == "zstd_dict", tests_dir, test_name);
 
     return 0;
 }
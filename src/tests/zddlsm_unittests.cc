@@ -1,7 +1,12 @@
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <random>
 #include <thread>
 
+#include "../zddlsm/include/async_storage.h"
+#include "../zddlsm/include/frozen_index.h"
+#include "../zddlsm/include/trace_replayer.h"
 #include "../zddlsm/include/zddlsm.h"
 #include "gtest/gtest.h"
 
@@ -18,6 +23,32 @@ std::string GenerateKey(size_t count) {
     return bytes;
 }
 
+/*
+`count` distinct decimal keys in scrambled order with levels `i % 6`,
+`step` has to be coprime with 10007.
+*/
+std::vector<std::pair<std::string, uint32_t>> ScrambledKeys(uint32_t count,
+                                                            uint32_t step) {
+    std::vector<std::pair<std::string, uint32_t>> keys;
+    for (uint32_t i = 0; i != count; ++i) {
+        keys.emplace_back(std::to_string(i * step % 10007), i % 6);
+    }
+    return keys;
+}
+
+/*
+Sets `keys` in the default column family and key "other" with level 1 in
+column family `other_cf`.
+*/
+void FillStorage(ZDDLSM::Storage& zdd,
+                 const std::vector<std::pair<std::string, uint32_t>>& keys,
+                 uint32_t other_cf) {
+    for (const auto& [key, level] : keys) {
+        zdd.Set(key, level);
+    }
+    zdd.Set(other_cf, "other", 1);
+}
+
 TEST(Set, single_insert_works_correctly) {
     std::ifstream file;
     file.open("../src/tests/files/lex_sorted_strings_256.txt");
@@ -620,4 +651,1318 @@ TEST(Compression, storage_works_with_sha256) {
         zdd.Set(cf_id, key, level + 1);
         EXPECT_EQ(zdd.GetLevel(cf_id, key).value(), level + 1);
     }
-}
\ No newline at end of file
+}
+
+TEST(Compression, fingerprint_width_is_configurable) {
+    for (uint32_t width : {32, 64, 96, 128}) {
+        Compression::FingerprintHasher hasher(width);
+
+        EXPECT_EQ(hasher.BytesNeeds(256), width / 8);
+        EXPECT_EQ(hasher.Compress("").size(), width / 8);
+        EXPECT_EQ(hasher.Compress(GenerateKey(300)).size(), width / 8);
+        EXPECT_EQ(hasher.Compress("key"), hasher.Compress("key"));
+        EXPECT_NE(hasher.Compress("key"), hasher.Compress("kez"));
+    }
+
+    EXPECT_THROW(Compression::FingerprintHasher(48), std::invalid_argument);
+}
+
+TEST(Compression, storage_works_with_fingerprint) {
+    uint32_t key_size = 256;
+
+    ZDDLSM::Storage zdd(key_size, Compression::compression::fingerprint);
+    ZDDLSM::Storage zdd_32(
+        key_size, std::make_unique<Compression::FingerprintHasher>(32));
+
+    uint32_t keys_number = 100;
+    std::vector<std::string> keys;
+
+    int cf_id = 1;
+    int level = 1;
+
+    for (uint32_t i = 0; i != keys_number; ++i) {
+        keys.push_back(GenerateKey(key_size));
+    }
+
+    for (const std::string& key : keys) {
+        zdd.Set(cf_id, key, level);
+        zdd_32.Set(cf_id, key, level);
+        EXPECT_EQ(zdd.GetLevel(cf_id, key).value(), level);
+        EXPECT_EQ(zdd_32.GetLevel(cf_id, key).value(), level);
+    }
+
+    for (const std::string& key : keys) {
+        zdd.Set(cf_id, key, level + 1);
+        EXPECT_EQ(zdd.GetLevel(cf_id, key).value(), level + 1);
+    }
+}
+
+TEST(Compression, zstd_dictionary) {
+    std::vector<std::string> samples;
+    for (uint32_t i = 0; i != 2000; ++i) {
+        samples.push_back("tenant-" + std::to_string(i % 17) + "/user:" +
+                          std::to_string(1000000 + i * 7919) + "/session");
+    }
+
+    Compression::ZstdCompressor plain;
+    Compression::ZstdCompressor with_dict(
+        Compression::ZstdCompressor::TrainDictionary(samples), 3);
+
+    EXPECT_EQ(with_dict.Level(), 3);
+
+    size_t plain_size = 0;
+    size_t dict_size = 0;
+    for (uint32_t i = 0; i != 100; ++i) {
+        std::string key = "tenant-" + std::to_string(i % 13) + "/user:" +
+                          std::to_string(5000000 + i * 104729) + "/session";
+        plain_size += plain.Compress(key).size();
+        dict_size += with_dict.Compress(key).size();
+        EXPECT_EQ(with_dict.Compress(key), with_dict.Compress(key));
+    }
+
+    EXPECT_LT(dict_size, plain_size);
+    EXPECT_THROW(Compression::ZstdCompressor::TrainDictionary({"a", "b"}),
+                 std::runtime_error);
+}
+
+TEST(Compression, zstd_contexts_are_per_thread) {
+    Compression::ZstdCompressor compressor;
+    std::string key = GenerateKey(64);
+    std::string expected = compressor.Compress(key);
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i != 4; ++i) {
+        threads.emplace_back([&compressor, &key, &expected]() {
+            for (uint32_t j = 0; j != 100; ++j) {
+                EXPECT_EQ(compressor.Compress(key), expected);
+            }
+        });
+    }
+
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+TEST(Compression, zstd_frames_fit_bytes_needs) {
+    Compression::ZstdCompressor compressor;
+
+    for (size_t key_size : {1, 2, 7, 16, 64, 255, 256, 4096, 200000}) {
+        std::string random_key = GenerateKey(key_size);
+        std::string repeated_key(key_size, 'x');
+        EXPECT_LE(compressor.Compress(random_key).size(),
+                  compressor.BytesNeeds(key_size));
+        EXPECT_LE(compressor.Compress(repeated_key).size(),
+                  compressor.BytesNeeds(key_size));
+    }
+
+    // magicless frames without content size and checksum
+    EXPECT_EQ(compressor.BytesNeeds(256), 256 + 5);
+}
+
+TEST(Compression, zstd_compressors_share_thread_context) {
+    std::vector<std::string> samples;
+    for (uint32_t i = 0; i != 2000; ++i) {
+        samples.push_back("tenant-" + std::to_string(i % 17) + "/user:" +
+                          std::to_string(1000000 + i * 7919) + "/session");
+    }
+
+    Compression::ZstdCompressor fast(1);
+    Compression::ZstdCompressor strong(19);
+    Compression::ZstdCompressor with_dict(
+        Compression::ZstdCompressor::TrainDictionary(samples));
+
+    std::string key = "tenant-5/user:4242424/session/tenant-5/user:4242424";
+    std::string fast_key = fast.Compress(key);
+    std::string strong_key = strong.Compress(key);
+    std::string dict_key = with_dict.Compress(key);
+
+    EXPECT_LT(dict_key.size(), key.size());
+    for (uint32_t i = 0; i != 10; ++i) {
+        EXPECT_EQ(with_dict.Compress(key), dict_key);
+        EXPECT_EQ(fast.Compress(key), fast_key);
+        EXPECT_EQ(strong.Compress(key), strong_key);
+        EXPECT_EQ(strong.Compress(key), strong_key);
+    }
+}
+
+TEST(KeyEncoding, keys_with_zero_bytes_are_distinct) {
+    ZDDLSM::Storage zdd(8);
+
+    std::string key_a = "a";
+    std::string key_a0("a\0", 2);
+    std::string key_0a("\0a", 2);
+
+    zdd.Set(key_a, 1);
+    zdd.Set(key_a0, 2);
+    zdd.Set(key_0a, 3);
+    zdd.Set("", 4);
+
+    EXPECT_EQ(zdd.GetLevel(key_a), 1);
+    EXPECT_EQ(zdd.GetLevel(key_a0), 2);
+    EXPECT_EQ(zdd.GetLevel(key_0a), 3);
+    EXPECT_EQ(zdd.GetLevel(""), 4);
+    EXPECT_FALSE(zdd.GetLevel(std::string("a\0\0", 3)).has_value());
+
+    ZDDLSM::Iterator it(&zdd);
+    std::vector<ZDDLSM::KeyLevelPair> expected = {
+        {"", 4}, {key_0a, 3}, {key_a, 1}, {key_a0, 2}};
+    for (const ZDDLSM::KeyLevelPair& kl : expected) {
+        EXPECT_EQ(kl, (*it).value());
+        it.Next();
+    }
+    EXPECT_FALSE(it.HasNext());
+}
+
+TEST(KeyEncoding, fixed_width_keys_have_no_markers) {
+    ZDDLSM::Storage zdd(
+        16, std::make_unique<Compression::FingerprintHasher>(32));
+    Compression::FingerprintHasher hasher(32);
+
+    std::vector<ZDDLSM::KeyLevelPair> expected;
+    for (uint32_t i = 0; i != 2000; ++i) {
+        std::string key = "key" + std::to_string(i);
+        zdd.Set(key, i % 5);
+        expected.emplace_back(hasher.Compress(key), i % 5);
+    }
+    std::sort(expected.begin(), expected.end(),
+              [](const auto& lhs, const auto& rhs) {
+                  return lhs.Key() < rhs.Key();
+              });
+
+    for (const ZDDLSM::LevelProfile& level : zdd.Analyze().levels) {
+        if (level.region == ZDDLSM::VarRegion::key) {
+            EXPECT_LT(level.bit, 32);
+        }
+    }
+
+    // trailing zero bytes of fingerprints come back too
+    ZDDLSM::Iterator it(&zdd);
+    for (const ZDDLSM::KeyLevelPair& kl : expected) {
+        ASSERT_TRUE(it.HasNext());
+        EXPECT_EQ(kl, (*it).value());
+        it.Next();
+    }
+    EXPECT_FALSE(it.HasNext());
+}
+
+TEST(KeyEncoding, storage_without_column_families) {
+    ZDDLSM::Options options;
+    options.column_families = false;
+    ZDDLSM::Storage zdd(16, Compression::compression::none, options);
+
+    zdd.Set("abc", 1);
+    zdd.Set("ab", 2);
+
+    EXPECT_EQ(zdd.GetLevel("abc"), 1);
+    EXPECT_EQ(zdd.GetLevel("ab"), 2);
+    EXPECT_THROW(zdd.Set(1, "abc", 1), std::logic_error);
+    EXPECT_THROW(zdd.GetLevel(1, "abc"), std::logic_error);
+
+    ZDDLSM::Iterator it(&zdd, "abb");
+    EXPECT_EQ(ZDDLSM::KeyLevelPair("abc", 1), (*it).value());
+
+    zdd.Delete("abc");
+    zdd.Delete("ab");
+    EXPECT_TRUE(zdd.IsEmpty());
+}
+
+TEST(ColumnFamilyLogic, iterator_returns_column_family_levels) {
+    ZDDLSM::Storage zdd(16);
+
+    zdd.Set(3, "a", 1);
+    zdd.Set(3, "b", 2);
+    zdd.Set("a", 5);
+
+    ZDDLSM::Iterator it(&zdd, 3);
+    EXPECT_EQ(ZDDLSM::KeyLevelPair("a", 1), (*it).value());
+    it.Next();
+    EXPECT_EQ(ZDDLSM::KeyLevelPair("b", 2), (*it).value());
+    it.Next();
+    EXPECT_FALSE(it.HasNext());
+
+    ZDDLSM::Iterator default_it(&zdd);
+    EXPECT_EQ(ZDDLSM::KeyLevelPair("a", 5), (*default_it).value());
+}
+
+TEST(ColumnFamilyLogic, drop_column_family_keeps_others) {
+    ZDDLSM::Storage zdd(16);
+
+    EXPECT_TRUE(zdd.CreateColumnFamily(7));
+    EXPECT_FALSE(zdd.CreateColumnFamily(7));
+    for (uint32_t i = 0; i != 100; ++i) {
+        zdd.Set(1, "key" + std::to_string(i), 1);
+        zdd.Set(2, "key" + std::to_string(i), 2);
+    }
+    zdd.Delete(2, "key0");
+
+    EXPECT_EQ(zdd.ListColumnFamilies(), std::vector<uint32_t>({1, 2, 7}));
+    std::map<uint32_t, ZDDLSM::ColumnFamilyStats> stats =
+        zdd.GetColumnFamilyStats();
+    EXPECT_EQ(stats[1].live_keys, 100);
+    EXPECT_EQ(stats[2].live_keys, 99);
+    EXPECT_EQ(stats[2].deleted_keys, 1);
+    EXPECT_EQ(stats[7].zdd_nodes, 0);
+
+    EXPECT_EQ(zdd.DropColumnFamily(1), 100);
+    EXPECT_EQ(zdd.DropColumnFamily(1), 0);
+    EXPECT_EQ(zdd.ListColumnFamilies(), std::vector<uint32_t>({2, 7}));
+    EXPECT_EQ(zdd.GetStats().live_keys, 99);
+    EXPECT_FALSE(zdd.GetLevel(1, "key1").has_value());
+    EXPECT_EQ(zdd.GetLevel(2, "key1"), 2);
+
+    ZDDLSM::Iterator it(&zdd, 1);
+    EXPECT_FALSE(it.HasNext());
+}
+
+TEST(TokenReorder, sifting_keeps_keys_and_order) {
+    ZDDLSM::Storage zdd(8);
+    std::map<std::string, uint32_t> keys;
+    for (uint32_t i = 0; i != 500; ++i) {
+        std::string key = std::to_string(i * 7919 % 100000);
+        zdd.Set(i % 3, key, i % 5);
+        if (i % 3 == 1) {
+            keys[key] = i % 5;
+        }
+    }
+
+    uint64_t key_nodes = zdd.Analyze().key_nodes;
+    ZDDLSM::ReorderStats stats = zdd.ReorderTokens();
+    EXPECT_LE(stats.nodes_after, stats.nodes_before);
+    // key bits are never moved
+    EXPECT_EQ(zdd.Analyze().key_nodes, key_nodes);
+
+    for (uint32_t i = 0; i != 500; ++i) {
+        std::string key = std::to_string(i * 7919 % 100000);
+        EXPECT_EQ(zdd.GetLevel(i % 3, key), i % 5);
+    }
+
+    ZDDLSM::Iterator it(&zdd, 1);
+    for (const auto& [key, level] : keys) {
+        ASSERT_TRUE((*it).has_value());
+        EXPECT_EQ(ZDDLSM::KeyLevelPair(key, level), (*it).value());
+        it.Next();
+    }
+    EXPECT_FALSE((*it).has_value());
+}
+
+TEST(TokenReorder, window_and_threshold) {
+    ZDDLSM::Options options;
+    options.token_reorder_threshold = 1000;
+    ZDDLSM::Storage zdd(8, Compression::compression::none, options);
+    for (uint32_t i = 0; i != 3000; ++i) {
+        zdd.Set(std::to_string(i), i % 7);
+    }
+
+    ZDDLSM::ReorderStats stats = zdd.ReorderTokens(ZDDLSM::ReorderMethod::window);
+    EXPECT_LE(stats.nodes_after, stats.nodes_before);
+
+    for (uint32_t i = 0; i != 3000; ++i) {
+        EXPECT_EQ(zdd.GetLevel(std::to_string(i)), i % 7);
+    }
+    zdd.Set("new", 3);
+    EXPECT_EQ(zdd.GetLevel("new"), 3);
+}
+
+TEST(NodeManager, storages_with_different_key_widths) {
+    ZDDLSM::Storage narrow(4);
+    narrow.Set("abcd", 1);
+    uint64_t narrow_nodes = narrow.NodeCount();
+
+    ZDDLSM::Storage wide(300);
+    std::string long_key(300, 'x');
+    wide.Set(long_key, 2);
+    wide.Set("abcd", 3);
+
+    EXPECT_EQ(narrow.GetLevel("abcd"), 1);
+    EXPECT_EQ(wide.GetLevel(long_key), 2);
+    EXPECT_EQ(wide.GetLevel("abcd"), 3);
+    EXPECT_EQ(narrow.NodeCount(), narrow_nodes);
+    EXPECT_GT(wide.NodeCount(), narrow_nodes);
+
+    ZDDLSM::Iterator it(&wide, "abcd");
+    it.Next();
+    EXPECT_EQ(ZDDLSM::KeyLevelPair(long_key, 2), (*it).value());
+}
+
+TEST(GarbageCollection, node_budget_triggers_collection) {
+    ZDDLSM::Options options;
+    options.gc.growth_fraction = 0;
+    options.gc.node_budget = 1;
+    ZDDLSM::Storage zdd(16, Compression::compression::none, options);
+    EXPECT_FALSE(zdd.MaybeCollect());
+
+    for (uint32_t i = 0; i != 2000; ++i) {
+        zdd.Set("budget" + std::to_string(i), i % 7);
+    }
+
+    ZDDLSM::GcStats stats = zdd.GetGcStats();
+    EXPECT_GT(stats.runs, 0);
+    EXPECT_LE(stats.max_pause_us, stats.total_pause_us);
+    for (uint32_t i = 0; i != 2000; ++i) {
+        EXPECT_EQ(zdd.GetLevel("budget" + std::to_string(i)), i % 7);
+    }
+}
+
+TEST(GarbageCollection, background_collection) {
+    ZDDLSM::Options options;
+    options.gc.node_budget = 1;
+    options.gc.background = true;
+    options.gc.background_period = std::chrono::milliseconds(1);
+    ZDDLSM::Storage zdd(16, Compression::compression::none, options);
+    // collections free nodes of every storage, so another storage used
+    // from another thread is guarded as well
+    ZDDLSM::Storage other(16);
+    std::thread writer([&other]() {
+        for (uint32_t i = 0; i != 2000; ++i) {
+            ZDDLSM::LockGuard guard = other.Lock();
+            other.Set("other" + std::to_string(i), i % 5);
+            if (i % 2 == 1) {
+                other.Delete("other" + std::to_string(i - 1));
+            }
+        }
+    });
+
+    for (uint32_t i = 0; i != 2000; ++i) {
+        ZDDLSM::LockGuard guard = zdd.Lock();
+        zdd.Set("background" + std::to_string(i), i % 7);
+    }
+    writer.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    ZDDLSM::LockGuard guard = zdd.Lock();
+    ZDDLSM::LockGuard other_guard = other.Lock();
+    EXPECT_GT(zdd.GetGcStats().runs, 0);
+    EXPECT_EQ(zdd.GetLevel("background1999"), 1999 % 7);
+    EXPECT_EQ(other.Size(), 1000);
+    for (uint32_t i = 1; i < 2000; i += 2) {
+        EXPECT_EQ(other.GetLevel("other" + std::to_string(i)), i % 5);
+    }
+}
+
+TEST(Set, storages_of_different_threads) {
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> found{0};
+    for (uint32_t t = 0; t != 4; ++t) {
+        threads.emplace_back([t, &found]() {
+            // each thread has its own storage of a different width
+            ZDDLSM::Storage zdd(8 + 4 * t);
+            for (uint32_t i = 0; i != 500; ++i) {
+                ZDDLSM::LockGuard guard = zdd.Lock();
+                zdd.Set(std::to_string(i * (t + 1)), t);
+            }
+            ZDDLSM::LockGuard guard = zdd.Lock();
+            for (uint32_t i = 0; i != 500; ++i) {
+                found += zdd.GetLevel(std::to_string(i * (t + 1))) == t;
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(found, 2000);
+}
+
+TEST(GarbageCollection, invalid_policy) {
+    ZDDLSM::Options options;
+    options.gc.growth_fraction = 1.5;
+    EXPECT_THROW(ZDDLSM::Storage(8, Compression::compression::none, options),
+                 std::invalid_argument);
+}
+
+TEST(Stats, counters_and_dump) {
+    ZDDLSM::Storage zdd(8);
+    zdd.Set("a", 1);
+    zdd.Set("b", 2);
+    zdd.Set("a", 3);
+    zdd.Delete("b");
+    EXPECT_EQ(zdd.GetLevel("a"), 3);
+    EXPECT_FALSE(zdd.GetLevel("b").has_value());
+    ZDDLSM::Iterator it(&zdd);
+    it.Next();
+
+    ZDDLSM::StorageStats stats = zdd.GetStats();
+    EXPECT_EQ(stats.live_keys, 1);
+    EXPECT_EQ(stats.deleted_keys, 1);
+    EXPECT_EQ(stats.data_entries, 1);
+    EXPECT_EQ(stats.zdd_nodes, zdd.NodeCount());
+    EXPECT_GT(stats.bytes_per_key, 0);
+    EXPECT_EQ(stats.ops.sets, 3);
+    EXPECT_EQ(stats.ops.inserts, 2);
+    EXPECT_EQ(stats.ops.deletes, 1);
+    EXPECT_EQ(stats.ops.gets, 2);
+    EXPECT_EQ(stats.ops.get_hits, 1);
+    EXPECT_EQ(stats.ops.iterator_seeks, 1);
+    EXPECT_EQ(stats.ops.iterator_steps, 1);
+
+    EXPECT_NE(stats.ToString().find("live keys: 1"), std::string::npos);
+    EXPECT_NE(stats.ToJson().find("\"get_hits\": 1"), std::string::npos);
+}
+
+TEST(Profiling, histogram_percentiles) {
+    ZDDLSM::LatencyHistogram histogram;
+    for (uint64_t ns = 1; ns <= 1000; ++ns) {
+        histogram.Record(ns);
+    }
+
+    EXPECT_EQ(histogram.Count(), 1000);
+    EXPECT_EQ(histogram.Max(), 1000);
+    EXPECT_NEAR(histogram.Percentile(50), 500, 500 / 8);
+    EXPECT_NEAR(histogram.Percentile(99), 990, 990 / 8);
+    EXPECT_EQ(histogram.Percentile(100), 1000);
+}
+
+TEST(Profiling, storage_records_phases) {
+    ZDDLSM::Storage zdd(8);
+    zdd.Set("key", 1);
+    zdd.GetLevel("key");
+    zdd.Delete("key");
+
+    const ZDDLSM::Profiler& profile = zdd.GetProfile();
+#ifdef ZDDLSM_PROFILING
+    EXPECT_EQ(profile.Histogram(ZDDLSM::Phase::update).Count(), 2);
+    EXPECT_GT(profile.Histogram(ZDDLSM::Phase::descent).Count(), 0);
+    EXPECT_GT(profile.Counters().child_calls, 0);
+    EXPECT_GT(profile.Counters().nodes_visited, 0);
+#else
+    EXPECT_EQ(profile.Histogram(ZDDLSM::Phase::update).Count(), 0);
+    EXPECT_EQ(profile.Counters().child_calls, 0);
+#endif
+}
+
+TEST(Trace, records_operations) {
+    std::string path = "zddlsm_trace_test.bin";
+    {
+        ZDDLSM::Storage zdd(8);
+        zdd.Set("untraced", 1);
+        zdd.StartTrace(path);
+        zdd.Set("a", 1);
+        zdd.Set(3, "b", 70000);
+        zdd.GetLevel("a");
+        zdd.Delete(3, "b");
+        ZDDLSM::Iterator it(&zdd, "a");
+        it.Next();
+        zdd.Set(3, "c", 1);
+        ZDDLSM::Iterator cf_it(&zdd, 3, "");
+        cf_it.Next();
+        zdd.StopTrace();
+        zdd.Set("untraced", 2);
+    }
+
+    ZDDLSM::TraceReader reader(path);
+    EXPECT_EQ(reader.Header().key_len, 8);
+    EXPECT_TRUE(reader.Header().column_families);
+    EXPECT_EQ(reader.Header().compression, Compression::compression::none);
+    EXPECT_EQ(reader.Header().stored_len, 8);
+
+    std::vector<ZDDLSM::TraceRecord> records;
+    for (ZDDLSM::TraceRecord record; reader.Next(record);) {
+        records.push_back(record);
+    }
+    std::remove(path.c_str());
+
+    ASSERT_EQ(records.size(), 9);
+    EXPECT_EQ(records[0].op, ZDDLSM::TraceOp::set);
+    EXPECT_EQ(records[0].key, "a");
+    EXPECT_FALSE(records[0].has_cf);
+    EXPECT_EQ(records[1].cf_id, 3);
+    EXPECT_EQ(records[1].level, 70000);
+    EXPECT_TRUE(records[1].has_cf);
+    EXPECT_EQ(records[2].op, ZDDLSM::TraceOp::get_level);
+    EXPECT_EQ(records[3].op, ZDDLSM::TraceOp::del);
+    EXPECT_EQ(records[4].op, ZDDLSM::TraceOp::iterator_seek);
+    EXPECT_EQ(records[5].op, ZDDLSM::TraceOp::iterator_next);
+    EXPECT_EQ(records[5].iterator_id, records[4].iterator_id);
+    EXPECT_FALSE(records[5].has_cf);
+    EXPECT_NE(records[7].iterator_id, records[4].iterator_id);
+    EXPECT_EQ(records[8].op, ZDDLSM::TraceOp::iterator_next);
+    EXPECT_EQ(records[8].iterator_id, records[7].iterator_id);
+    EXPECT_TRUE(records[8].has_cf);
+    EXPECT_EQ(records[8].cf_id, 3);
+    for (size_t i = 1; i != records.size(); ++i) {
+        EXPECT_LE(records[i - 1].time_ns, records[i].time_ns);
+    }
+}
+
+TEST(Trace, replays_interleaved_iterators_with_traced_compression) {
+    std::string path = "zddlsm_replay_test.bin";
+    ZDDLSM::Storage zdd(8, std::make_unique<Compression::FingerprintHasher>(32));
+    zdd.StartTrace(path);
+    for (uint32_t i = 0; i != 50; ++i) {
+        zdd.Set(i % 2, "key" + std::to_string(i), i % 5);
+    }
+    ZDDLSM::Iterator first(&zdd, 0, "");
+    ZDDLSM::Iterator second(&zdd, 1, "");
+    first.SkipN(3);
+    for (uint32_t i = 0; i != 10; ++i) {
+        first.Next();
+        second.Next();
+    }
+    zdd.Delete(1, "key7");
+    // a dropped family loses its keys in the replay too
+    for (uint32_t i = 0; i != 5; ++i) {
+        zdd.Set(2, "drop" + std::to_string(i), 1);
+    }
+    zdd.DropColumnFamily(2);
+    zdd.Set(2, "after", 3);
+    zdd.StopTrace();
+
+    ZDDLSM::TraceReader reader(path);
+    EXPECT_EQ(reader.Header().compression,
+              Compression::compression::fingerprint);
+    EXPECT_EQ(reader.Header().stored_len, 4);
+
+    ZDDLSM::Storage mismatched(8, Compression::compression::fingerprint);
+    EXPECT_THROW(ZDDLSM::TraceReplayer(mismatched, reader.Header()),
+                 std::invalid_argument);
+
+    ZDDLSM::Storage replayed(8, reader.Header().BuildCompressor());
+    ZDDLSM::TraceReplayer replayer(replayed, reader.Header());
+    uint32_t records = 0;
+    uint32_t drops = 0;
+    for (ZDDLSM::TraceRecord record; reader.Next(record); ++records) {
+        if (record.op == ZDDLSM::TraceOp::drop_column_family) {
+            EXPECT_EQ(record.cf_id, 2);
+            ++drops;
+        }
+        replayer.Apply(record);
+    }
+    std::remove(path.c_str());
+    EXPECT_EQ(records, 50 + 2 + 1 + 20 + 1 + 5 + 1 + 1);
+    EXPECT_EQ(drops, 1);
+    EXPECT_EQ(replayed.GetStats().ops.iterator_steps, 20);
+    EXPECT_EQ(replayed.Size(), zdd.Size());
+
+    for (uint32_t cf_id : {0, 1, 2}) {
+        ZDDLSM::Iterator original(&zdd, cf_id, "");
+        ZDDLSM::Iterator copy(&replayed, cf_id, "");
+        for (; original.HasNext(); original.Next(), copy.Next()) {
+            ASSERT_TRUE(copy.HasNext());
+            EXPECT_EQ(*original, *copy);
+        }
+        EXPECT_FALSE(copy.HasNext());
+    }
+}
+
+TEST(Analyze, profiles_levels_and_column_families) {
+    ZDDLSM::Storage zdd(8);
+    EXPECT_EQ(zdd.Analyze().nodes, 0);
+
+    zdd.Set(1, "analyze1", 3);
+    zdd.Set(1, "analyze2", 3);
+    zdd.Set(2, "analyze1", 5);
+
+    ZDDLSM::ZddAnalysis analysis = zdd.Analyze();
+    EXPECT_EQ(analysis.nodes, zdd.NodeCount());
+    EXPECT_EQ(analysis.data_nodes + analysis.key_nodes, analysis.nodes);
+    uint64_t level_nodes = 0;
+    for (const ZDDLSM::LevelProfile& level : analysis.levels) {
+        level_nodes += level.nodes;
+    }
+    EXPECT_EQ(level_nodes, analysis.nodes);
+    EXPECT_GE(analysis.sharing_ratio, 1);
+
+    ASSERT_EQ(analysis.nodes_per_cf.size(), 2);
+    EXPECT_TRUE(analysis.nodes_per_cf.contains(1));
+    EXPECT_TRUE(analysis.nodes_per_cf.contains(2));
+    EXPECT_NE(analysis.ToJson().find("\"nodes_per_cf\": {\"1\": "),
+              std::string::npos);
+
+    EXPECT_EQ(zdd.ToDot().rfind("digraph zdd {", 0), 0);
+    EXPECT_THROW(zdd.ToDot(1), std::length_error);
+}
+
+TEST(AsyncStorage, combines_writes_in_submission_order) {
+    ZDDLSM::Storage zdd(16);
+    std::vector<std::future<void>> writes;
+    {
+        ZDDLSM::AsyncStorage async(zdd);
+        for (uint32_t i = 0; i != 500; ++i) {
+            writes.push_back(async.Set("async" + std::to_string(i), i % 7));
+        }
+        // repeated keys have to see the previous write
+        writes.push_back(async.Set("async1", 100));
+        writes.push_back(async.Delete("async2"));
+        writes.push_back(async.Set(3, "async3", 5));
+        for (std::future<void>& write : writes) {
+            write.wait();
+        }
+
+        EXPECT_EQ(async.GetLevel("async1").get(), 100);
+        EXPECT_EQ(async.GetLevel("async2").get(), std::nullopt);
+        EXPECT_EQ(async.GetLevel(3, "async3").get(), 5);
+        EXPECT_EQ(async.GetLevel("async499").get(), 499 % 7);
+        EXPECT_LE(async.WriteGroups(), writes.size());
+        EXPECT_GE(async.Batches(), 1);
+
+        std::promise<std::optional<uint32_t>> level;
+        async.Submit(ZDDLSM::AsyncOp::get_level, "async10", 0,
+                     [&level](std::optional<uint32_t> value,
+                              std::exception_ptr) { level.set_value(value); });
+        EXPECT_EQ(level.get_future().get(), 10 % 7);
+    }
+    EXPECT_EQ(zdd.Size(), 500);
+    EXPECT_EQ(zdd.GetLevel("async0"), 0);
+}
+
+/*
+Keeps the first two key bytes, so that distinct keys share a stored key.
+*/
+class TruncatingCompressor : public Compression::ICompressor {
+public:
+    std::string Compress(const std::string& key) const {
+        if (key == "bad") {
+            throw std::runtime_error("can't compress");
+        }
+        return key.substr(0, 2);
+    }
+
+    uint32_t BytesNeeds(uint32_t) const { return 2; }
+
+    Compression::compression Type() const {
+        return Compression::compression::none;
+    }
+};
+
+TEST(AsyncStorage, groups_writes_by_stored_key) {
+    ZDDLSM::Storage zdd(8, std::make_unique<TruncatingCompressor>());
+    EXPECT_THROW(ZDDLSM::AsyncStorage(zdd, 0), std::invalid_argument);
+
+    std::vector<std::future<void>> writes;
+    {
+        ZDDLSM::AsyncStorage async(zdd);
+        writes.push_back(async.Set("ab1", 1));
+        writes.push_back(async.Set("cd", 4));
+        writes.push_back(async.Set("ab2", 2));
+        writes.push_back(async.Set("bad", 3));
+        writes.push_back(async.Set("ef", 5));
+        for (std::future<void>& write : writes) {
+            write.wait();
+        }
+    }
+
+    EXPECT_NO_THROW(writes[0].get());
+    EXPECT_THROW(writes[3].get(), std::runtime_error);
+    EXPECT_NO_THROW(writes[4].get());
+    EXPECT_EQ(zdd.Size(), 3);
+    EXPECT_EQ(zdd.GetLevel("ab1"), 2);
+    EXPECT_EQ(zdd.GetLevel("cd"), 4);
+    EXPECT_EQ(zdd.GetLevel("ef"), 5);
+}
+
+TEST(AsyncStorage, many_threads) {
+    ZDDLSM::Storage zdd(16);
+    ZDDLSM::AsyncStorage async(zdd);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t != 8; ++t) {
+        threads.emplace_back([&async, t]() {
+            for (uint32_t i = 0; i != 100; ++i) {
+                std::string key =
+                    "thread" + std::to_string(t) + "_" + std::to_string(i);
+                async.Set(key, t).wait();
+                EXPECT_EQ(async.GetLevel(key).get(), t);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(zdd.Size(), 800);
+
+    ZDDLSM::Options options;
+    options.column_families = false;
+    ZDDLSM::Storage no_cf(8, Compression::compression::none, options);
+    ZDDLSM::AsyncStorage no_cf_async(no_cf);
+    EXPECT_THROW(no_cf_async.Set(1, "key", 1), std::logic_error);
+}
+
+TEST(DeleteRange, matches_per_key_deletes) {
+    ZDDLSM::Storage zdd(8);
+    std::set<std::string> expected;
+    std::mt19937 gen(7);
+    for (uint32_t i = 0; i != 300; ++i) {
+        std::string key = "r" + std::to_string(gen() % 1000);
+        key.resize(1 + gen() % 6, 'x');
+        zdd.Set(key, i % 7);
+        expected.insert(key);
+    }
+    zdd.Set(1, "r5", 1);
+
+    for (auto [begin, end] : std::vector<std::pair<std::string, std::string>>{
+             {"r1", "r3"}, {"r5", "r50"}, {"r9", "r9"}, {"", "r0"},
+             {"r7", "\xff"}}) {
+        uint64_t removed = 0;
+        for (auto it = expected.lower_bound(begin);
+             it != expected.end() && *it < end;) {
+            it = expected.erase(it);
+            ++removed;
+        }
+        EXPECT_EQ(zdd.DeleteRange(begin, end), removed);
+    }
+
+    EXPECT_EQ(zdd.Size(), expected.size() + 1);
+    ZDDLSM::Iterator it(&zdd);
+    for (const std::string& key : expected) {
+        ASSERT_TRUE((*it).has_value());
+        EXPECT_EQ((*it)->Key(), key);
+        EXPECT_EQ(zdd.GetLevel(key), (*it)->Level());
+        it.Next();
+    }
+    EXPECT_FALSE((*it).has_value());
+    EXPECT_EQ(zdd.GetLevel(1, "r5"), 1);
+
+    EXPECT_EQ(zdd.DeleteRange(1, "r", "s"), 1);
+    EXPECT_EQ(zdd.GetLevel(1, "r5"), std::nullopt);
+}
+
+TEST(DeleteRange, empty_end_is_unbounded) {
+    ZDDLSM::Storage zdd(8);
+    zdd.Set("a", 1);
+    zdd.Set("m", 2);
+    zdd.Set("\xff", 3);
+    zdd.Set("\xff\xff\xff", 4);
+    zdd.Set(1, "z", 5);
+
+    EXPECT_EQ(zdd.DeleteRange("m", ""), 3);
+    EXPECT_EQ(zdd.Size(), 2);
+    EXPECT_EQ(zdd.GetLevel("a"), 1);
+    EXPECT_EQ(zdd.GetLevel("\xff"), std::nullopt);
+    EXPECT_EQ(zdd.GetLevel(1, "z"), 5);
+
+    EXPECT_EQ(zdd.DeleteRange("", ""), 1);
+    EXPECT_EQ(zdd.Size(), 1);
+    EXPECT_EQ(zdd.DeleteRange(1, "", ""), 1);
+    EXPECT_EQ(zdd.Size(), 0);
+}
+
+TEST(DeletePrefix, drops_tenant_keys) {
+    ZDDLSM::Storage zdd(16);
+    for (uint32_t i = 0; i != 100; ++i) {
+        zdd.Set("tenant1/" + std::to_string(i), 1);
+        zdd.Set("tenant2/" + std::to_string(i), 2);
+        zdd.Set(1, "tenant1/" + std::to_string(i), 3);
+    }
+    zdd.Set("tenant1", 4);
+    zdd.Set("tenant", 5);
+
+    EXPECT_EQ(zdd.DeletePrefix("tenant1"), 101);
+    EXPECT_EQ(zdd.DeletePrefix("tenant1"), 0);
+    EXPECT_EQ(zdd.DeletePrefix("missing"), 0);
+    EXPECT_EQ(zdd.Size(), 201);
+    EXPECT_EQ(zdd.GetLevel("tenant1/5"), std::nullopt);
+    EXPECT_EQ(zdd.GetLevel("tenant2/5"), 2);
+    EXPECT_EQ(zdd.GetLevel("tenant"), 5);
+    EXPECT_EQ(zdd.GetLevel(1, "tenant1/5"), 3);
+
+    EXPECT_EQ(zdd.DeletePrefix(1, ""), 100);
+    EXPECT_EQ(zdd.GetLevel(1, "tenant1/5"), std::nullopt);
+    EXPECT_EQ(zdd.GetLevel("tenant2/99"), 2);
+
+    zdd.Set("tenant1/5", 6);
+    EXPECT_EQ(zdd.GetLevel("tenant1/5"), 6);
+}
+
+TEST(MergeFrom, unions_keys_and_resolves_conflicts) {
+    ZDDLSM::Storage zdd(8);
+    ZDDLSM::Storage other(8);
+    std::map<std::string, uint32_t> expected;
+    for (uint32_t i = 0; i != 300; ++i) {
+        std::string key = "key" + std::to_string(i);
+        if (i < 200) {
+            zdd.Set(key, i % 4 + 2);
+            expected[key] = i % 4 + 2;
+        }
+        if (i >= 100) {
+            other.Set(key, i % 3);
+            expected[key] = i < 200 ? std::min(i % 4 + 2, i % 3) : i % 3;
+        }
+    }
+    other.Set(5, "cf_key", 7);
+    other.ReorderTokens();
+
+    ZDDLSM::MergeStats stats =
+        zdd.MergeFrom(other, ZDDLSM::ConflictPolicy::min_level);
+    EXPECT_EQ(stats.added_keys, 101);
+    EXPECT_EQ(stats.conflicts, 100);
+    EXPECT_EQ(zdd.Size(), 301);
+    EXPECT_EQ(zdd.GetLevel(5, "cf_key"), 7);
+
+    std::map<std::string, uint32_t> scanned;
+    for (ZDDLSM::Iterator it(&zdd); (*it); it.Next()) {
+        scanned[(*it)->Key()] = (*it)->Level();
+    }
+    EXPECT_EQ(scanned, expected);
+
+    // merged keys stay writable and a second merge moves tokens again
+    zdd.Set("key250", 9);
+    zdd.Delete("key150");
+    EXPECT_EQ(zdd.MergeFrom(other, ZDDLSM::ConflictPolicy::ours).added_keys,
+              1);
+    EXPECT_EQ(zdd.GetLevel("key250"), 9);
+    EXPECT_EQ(zdd.GetLevel("key150"), 150 % 3);
+    EXPECT_EQ(zdd.Size(), 301);
+
+    EXPECT_THROW(zdd.MergeFrom(zdd), std::invalid_argument);
+}
+
+TEST(MergeFrom, repeats_without_running_out_of_tokens_and_is_traced) {
+    std::string path = "zddlsm_merge_trace_test.bin";
+    ZDDLSM::Storage zdd(8);
+    EXPECT_THROW(
+        zdd.MergeFrom(ZDDLSM::Storage(8, Compression::compression::zstd)),
+        std::invalid_argument);
+    zdd.StartTrace(path);
+    zdd.Set("shared", 100);
+    // merged keys take the next tokens, so any number of merges fits
+    uint32_t merges = 300;
+    for (uint32_t i = 0; i != merges; ++i) {
+        ZDDLSM::Storage other(8);
+        other.Set("m" + std::to_string(i), ZDDLSM::KeyLocation{i % 5, i, i});
+        other.Set(2, "shared", i);
+        zdd.MergeFrom(other, ZDDLSM::ConflictPolicy::theirs);
+        // tokens of local sets follow the merged ones
+        zdd.Set("local" + std::to_string(i), i % 3);
+    }
+    zdd.StopTrace();
+
+    EXPECT_EQ(zdd.Size(), 2 * merges + 2);
+    for (uint32_t i = 0; i != merges; ++i) {
+        EXPECT_EQ(zdd.GetLevel("local" + std::to_string(i)), i % 3);
+    }
+    for (uint32_t i = 0; i != merges; ++i) {
+        EXPECT_EQ(zdd.GetLocation("m" + std::to_string(i)),
+                  (ZDDLSM::KeyLocation{i % 5, i, i}));
+    }
+    EXPECT_EQ(zdd.GetLevel(2, "shared"), merges - 1);
+    EXPECT_EQ(zdd.GetLevel("shared"), 100);
+
+    ZDDLSM::TraceReader reader(path);
+    ZDDLSM::Storage replayed(8, reader.Header().BuildCompressor());
+    ZDDLSM::TraceReplayer replayer(replayed, reader.Header());
+    for (ZDDLSM::TraceRecord record; reader.Next(record);) {
+        replayer.Apply(record);
+    }
+    std::remove(path.c_str());
+    EXPECT_EQ(replayed.Size(), zdd.Size());
+    for (uint32_t i = 0; i != merges; ++i) {
+        EXPECT_EQ(replayed.GetLocation("m" + std::to_string(i)),
+                  (ZDDLSM::KeyLocation{i % 5, i, i}));
+    }
+    EXPECT_EQ(replayed.GetLevel(2, "shared"), merges - 1);
+}
+
+TEST(Rank, rank_select_and_skip_follow_key_order) {
+    ZDDLSM::Storage zdd(8);
+    std::vector<std::pair<std::string, uint32_t>> set =
+        ScrambledKeys(500, 7919);
+    FillStorage(zdd, set, 1);
+    std::vector<std::string> keys;
+    for (const auto& [key, level] : set) {
+        keys.push_back(key);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    for (uint32_t i = 0; i != keys.size(); ++i) {
+        EXPECT_EQ(zdd.RankOf(keys[i]), i);
+        EXPECT_EQ(zdd.KeyAtRank(i)->Key(), keys[i]);
+        EXPECT_EQ(zdd.KeyAtRank(i)->Level(), zdd.GetLevel(keys[i]));
+    }
+    EXPECT_EQ(zdd.RankOf(keys[10] + "0"), 11);
+    EXPECT_EQ(zdd.RankOf(""), 0);
+    EXPECT_EQ(zdd.RankOf("a"), keys.size());
+    EXPECT_FALSE(zdd.KeyAtRank(keys.size()).has_value());
+    EXPECT_EQ(zdd.KeyAtRank(1, 0)->Key(), "other");
+
+    ZDDLSM::Iterator it(&zdd, keys[3]);
+    it.SkipN(100);
+    EXPECT_EQ((*it)->Key(), keys[103]);
+    it.Next();
+    EXPECT_EQ((*it)->Key(), keys[104]);
+    it.SkipN(1000);
+    EXPECT_FALSE(it.HasNext());
+
+    // deleted keys leave ranks at once
+    zdd.Delete(keys[0]);
+    EXPECT_EQ(zdd.RankOf(keys[1]), 0);
+}
+
+TEST(Rank, samples_are_distinct_and_in_range) {
+    ZDDLSM::Storage zdd(8);
+    for (uint32_t i = 0; i != 1000; ++i) {
+        zdd.Set(std::to_string(1000 + i), 1);
+    }
+
+    std::vector<ZDDLSM::KeyLevelPair> samples =
+        zdd.SampleKeys(50, "1200", "1800", 7);
+    ASSERT_EQ(samples.size(), 50);
+    for (size_t i = 0; i != samples.size(); ++i) {
+        EXPECT_GE(samples[i].Key(), "1200");
+        EXPECT_LT(samples[i].Key(), "1800");
+        if (i != 0) {
+            EXPECT_LT(samples[i - 1].Key(), samples[i].Key());
+        }
+    }
+    EXPECT_EQ(zdd.SampleKeys(50, "1200", "1800", 7).front(), samples.front());
+
+    EXPECT_EQ(zdd.SampleKeys(100, "1990", "").size(), 10);
+    EXPECT_TRUE(zdd.SampleKeys(10, "1800", "1200").empty());
+}
+
+TEST(ParallelScan, partitions_follow_key_order) {
+    ZDDLSM::Storage zdd(8);
+    FillStorage(zdd, ScrambledKeys(1000, 4001), 3);
+
+    std::vector<ZDDLSM::KeyLevelPair> expected;
+    for (ZDDLSM::Iterator it(&zdd); (*it); it.Next()) {
+        expected.push_back((*it).value());
+    }
+
+    EXPECT_EQ(zdd.GetStats().scan_bytes, 0);
+
+    std::vector<std::vector<ZDDLSM::KeyLevelPair>> partitions(4);
+    std::mutex mutex;
+    EXPECT_EQ(zdd.ParallelScan(4,
+                               [&](uint32_t partition,
+                                   const ZDDLSM::KeyLevelPair& key) {
+                                   std::lock_guard<std::mutex> guard(mutex);
+                                   partitions[partition].push_back(key);
+                               }),
+              1000);
+
+    std::vector<ZDDLSM::KeyLevelPair> scanned;
+    for (const auto& partition : partitions) {
+        EXPECT_EQ(partition.size(), 250);
+        scanned.insert(scanned.end(), partition.begin(), partition.end());
+    }
+    EXPECT_EQ(scanned, expected);
+
+    // the copy is memory of the storage
+    uint64_t scan_bytes = zdd.GetStats().scan_bytes;
+    EXPECT_GT(scan_bytes, 1000 * sizeof(uint32_t));
+    EXPECT_EQ(zdd.GetColumnFamilyStats()[0].scan_bytes, scan_bytes);
+    EXPECT_EQ(zdd.GetColumnFamilyStats()[3].scan_bytes, 0);
+
+    EXPECT_EQ(zdd.ParallelScan(3, 16, [](uint32_t, const auto& key) {
+        EXPECT_EQ(key.Key(), "other");
+    }), 1);
+    EXPECT_THROW(zdd.ParallelScan(2,
+                                  [](uint32_t, const ZDDLSM::KeyLevelPair&) {
+                                      throw std::runtime_error("stop");
+                                  }),
+                 std::runtime_error);
+
+    // the kept copy follows new keys and new levels
+    zdd.Set(expected[0].Key(), 5);
+    zdd.Set("new", 4);
+    std::map<std::string, uint32_t> rescanned;
+    EXPECT_EQ(zdd.ParallelScan(2,
+                               [&](uint32_t, const ZDDLSM::KeyLevelPair& key) {
+                                   std::lock_guard<std::mutex> guard(mutex);
+                                   rescanned[key.Key()] = key.Level();
+                               }),
+              1001);
+    EXPECT_EQ(rescanned[expected[0].Key()], 5);
+    EXPECT_EQ(rescanned["new"], 4);
+}
+
+TEST(BulkLoad, matches_sets) {
+    std::vector<std::pair<std::string, uint32_t>> keys =
+        ScrambledKeys(1000, 2003);
+    keys.emplace_back("", 2);
+    keys.emplace_back("17", 1);
+    // repeats in other chunks, the last one wins as with sets
+    std::string repeated = keys[10].first;
+    keys.insert(keys.begin() + 500, {repeated, 4});
+    keys.emplace_back(repeated, 5);
+
+    // both column families already hold keys, some of them loaded again
+    ZDDLSM::Storage expected(8);
+    ZDDLSM::Storage zdd(8);
+    for (ZDDLSM::Storage* storage : {&expected, &zdd}) {
+        FillStorage(*storage, ScrambledKeys(300, 7919), 2);
+        storage->Set("17", 3);
+        storage->Set(2, keys[20].first, 3);
+    }
+    for (uint32_t cf_id : {0, 2}) {
+        for (const auto& [key, level] : keys) {
+            expected.Set(cf_id, key, level);
+        }
+        zdd.BulkLoad(cf_id, keys, 3);
+    }
+
+    EXPECT_EQ(zdd.Size(), expected.Size());
+    for (uint32_t cf_id : {0, 2}) {
+        ZDDLSM::Iterator it(&zdd, cf_id, "");
+        for (ZDDLSM::Iterator exp_it(&expected, cf_id, ""); (*exp_it);
+             exp_it.Next()) {
+            ASSERT_TRUE((*it).has_value());
+            EXPECT_EQ((*it).value(), (*exp_it).value());
+            it.Next();
+        }
+        EXPECT_FALSE((*it).has_value());
+    }
+    EXPECT_EQ(zdd.GetLevel(repeated), 5);
+    EXPECT_EQ(zdd.GetLevel(2, "other"), 1);
+
+    zdd.BulkLoad(4, {{"b", 1}, {"a", 2}}, 1);
+    EXPECT_EQ(zdd.GetLevel(4, "a"), 2);
+    EXPECT_EQ(zdd.GetLevel(4, "b"), 1);
+    EXPECT_FALSE(zdd.GetLevel(4, "17").has_value());
+    zdd.BulkLoad({});
+}
+
+TEST(BulkLoad, rethrows_compressor_errors) {
+    ZDDLSM::Storage zdd(8, std::make_unique<TruncatingCompressor>());
+    zdd.Set("xy", 1);
+    std::vector<std::pair<std::string, uint32_t>> keys;
+    for (uint32_t i = 0; i != 100; ++i) {
+        keys.emplace_back(std::to_string(i), 2);
+    }
+    keys[70].first = "bad";
+
+    // the error of one worker doesn't stop the others or change the storage
+    EXPECT_THROW(zdd.BulkLoad(keys, 4), std::runtime_error);
+    EXPECT_EQ(zdd.Size(), 1);
+    EXPECT_FALSE(zdd.GetLevel("10").has_value());
+
+    keys[70].first = "good";
+    zdd.BulkLoad(keys, 4);
+    EXPECT_EQ(zdd.GetLevel("10"), 2);
+    EXPECT_EQ(zdd.GetLevel("xy"), 1);
+}
+
+TEST(FrozenIndex, matches_storage_and_maps_from_disk) {
+    ZDDLSM::Storage zdd(8, Compression::compression::zstd);
+    auto keys = ScrambledKeys(1000, 6007);
+    FillStorage(zdd, keys, 3);
+    zdd.Set("", 3);
+    zdd.Delete(keys[0].first);
+    // deleted and set again at another level
+    zdd.Delete(keys[1].first);
+    zdd.Set(keys[1].first, 5);
+
+    ZDDLSM::FrozenIndex frozen = zdd.Freeze();
+    EXPECT_EQ(frozen.Size(), zdd.Size());
+    zdd.Set("after", 2);
+    EXPECT_FALSE(frozen.GetLevel("after").has_value());
+    EXPECT_FALSE(frozen.GetLevel(keys[0].first).has_value());
+    EXPECT_EQ(frozen.GetLevel(keys[1].first), 5);
+    EXPECT_EQ(frozen.GetLevel(""), 3);
+    EXPECT_EQ(frozen.GetLevel(3, "other"), 1);
+    for (const auto& [key, level] : keys) {
+        EXPECT_EQ(frozen.GetLevel(key), zdd.GetLevel(key));
+        EXPECT_EQ(frozen.GetLevel(key + "0"), zdd.GetLevel(key + "0"));
+    }
+
+    std::string path = "zddlsm_frozen_test.bin";
+    frozen.Save(path);
+    ZDDLSM::FrozenIndex mapped = ZDDLSM::FrozenIndex::Open(
+        path, std::make_shared<Compression::ZstdCompressor>());
+    zdd.Delete("after");
+    for (const std::string& seek : {std::string(), std::string("5")}) {
+        ZDDLSM::Iterator it(&zdd, seek);
+        ZDDLSM::FrozenIterator frozen_it(&mapped, seek);
+        for (; (*it); it.Next(), frozen_it.Next()) {
+            EXPECT_EQ(*frozen_it, *it);
+        }
+        EXPECT_FALSE((*frozen_it).has_value());
+    }
+    EXPECT_EQ(mapped.GetLevel(3, "other"), 1);
+    EXPECT_THROW(ZDDLSM::FrozenIndex::Open(path), std::invalid_argument);
+    std::remove(path.c_str());
+    EXPECT_THROW(ZDDLSM::FrozenIndex::Open(path), std::runtime_error);
+}
+
+TEST(FrozenIndex, rejects_corrupted_files) {
+    ZDDLSM::Storage zdd(8, Compression::compression::none);
+    FillStorage(zdd, ScrambledKeys(100, 7919), 3);
+    std::string path = "zddlsm_frozen_corrupted_test.bin";
+    zdd.Freeze().Save(path);
+
+    std::string image;
+    {
+        std::ifstream in(path, std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    // header is 40 bytes, then two column family roots of 8 bytes
+    constexpr size_t FIRST_NODE = 40 + 2 * 8;
+    auto open_patched = [&](size_t offset, uint32_t value) {
+        std::string patched = image;
+        std::memcpy(patched.data() + offset, &value, sizeof(value));
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << patched;
+        return ZDDLSM::FrozenIndex::Open(path);
+    };
+    EXPECT_NO_THROW(open_patched(0, 0x4644445a));
+    // key byte bits
+    EXPECT_THROW(open_patched(12, 7), std::runtime_error);
+    // root of the first column family
+    EXPECT_THROW(open_patched(40 + 4, 1u << 20), std::runtime_error);
+    // children: past the nodes, a missing level, back to the node itself
+    EXPECT_THROW(open_patched(FIRST_NODE + 4, 1u << 20), std::runtime_error);
+    EXPECT_THROW(open_patched(FIRST_NODE + 8, ZDDLSM::FrozenIndex::LEAF | 500),
+                 std::runtime_error);
+    EXPECT_THROW(open_patched(FIRST_NODE + 4, 0), std::runtime_error);
+    EXPECT_THROW(open_patched(FIRST_NODE + 8, ZDDLSM::FrozenIndex::EMPTY),
+                 std::runtime_error);
+    // counts whose sizes wrap around: 2^62 more nodes, 2^32 - 1 families
+    EXPECT_THROW(open_patched(24 + 4, 1u << 30), std::runtime_error);
+    EXPECT_THROW(open_patched(20, UINT32_MAX), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST(RootTable, lookups_match_full_descent) {
+    std::vector<std::unique_ptr<ZDDLSM::Storage>> storages;
+    for (uint32_t bits : {0u, 1u, 9u, 16u}) {
+        ZDDLSM::Options options;
+        options.root_table_bits = bits;
+        storages.push_back(std::make_unique<ZDDLSM::Storage>(
+            4, Compression::compression::none, options));
+    }
+
+    std::mt19937 gen(7);
+    std::vector<std::string> keys{"", "a", "ab"};
+    for (uint32_t i = 0; i != 300; ++i) {
+        keys.push_back(std::to_string(gen() % 5000));
+    }
+    for (size_t i = 0; i != keys.size(); ++i) {
+        for (auto& zdd : storages) {
+            zdd->Set(keys[i], i % 5);
+            if (i % 3 == 0) {
+                zdd->Delete(keys[i / 2]);
+            }
+            if (i == keys.size() / 2) {
+                zdd->DeleteRange("2", "3");
+                zdd->ReorderTokens();
+            }
+        }
+    }
+    keys.push_back("missing");
+    for (const std::string& key : keys) {
+        for (auto& zdd : storages) {
+            EXPECT_EQ(zdd->GetLevel(key), storages[0]->GetLevel(key)) << key;
+        }
+    }
+
+    ZDDLSM::Options options;
+    options.root_table_bits = 21;
+    EXPECT_THROW(ZDDLSM::Storage(4, Compression::compression::none, options),
+                 std::invalid_argument);
+}
+
+TEST(RootTable, stays_current_through_batch_writes) {
+    std::vector<std::unique_ptr<ZDDLSM::Storage>> storages;
+    for (uint32_t bits : {0u, 9u}) {
+        ZDDLSM::Options options;
+        options.root_table_bits = bits;
+        storages.push_back(std::make_unique<ZDDLSM::Storage>(
+            4, Compression::compression::none, options));
+    }
+    auto keys = ScrambledKeys(400, 4001);
+    auto check = [&](const std::string& step) {
+        for (const auto& [key, level] : keys) {
+            EXPECT_EQ(storages[1]->GetLevel(key), storages[0]->GetLevel(key))
+                << step << " " << key;
+        }
+        EXPECT_EQ(storages[1]->GetLevel(2, "other"),
+                  storages[0]->GetLevel(2, "other"))
+            << step;
+    };
+
+    // every step starts with a current table, built by the previous check
+    for (auto& zdd : storages) {
+        FillStorage(*zdd, {keys.begin(), keys.begin() + 100}, 2);
+    }
+    check("fill");
+    for (auto& zdd : storages) {
+        ZDDLSM::AsyncStorage async(*zdd);
+        std::vector<std::future<void>> done;
+        for (size_t i = 100; i != 200; ++i) {
+            done.push_back(async.Set(keys[i].first, keys[i].second));
+            done.push_back(async.Delete(keys[i - 100].first));
+        }
+        for (auto& future : done) {
+            future.get();
+        }
+    }
+    check("async");
+    for (auto& zdd : storages) {
+        zdd->BulkLoad({keys.begin() + 150, keys.begin() + 300});
+    }
+    check("bulk load");
+    for (auto& zdd : storages) {
+        ZDDLSM::Storage other(4, Compression::compression::none);
+        FillStorage(other, {keys.begin() + 250, keys.end()}, 2);
+        zdd->MergeFrom(other, ZDDLSM::ConflictPolicy::theirs);
+    }
+    check("merge");
+    for (auto& zdd : storages) {
+        zdd->DeletePrefix("1");
+        zdd->DeleteRange("5", "7");
+    }
+    check("delete range");
+    for (auto& zdd : storages) {
+        zdd->ReorderTokens();
+    }
+    check("reorder");
+}
+
+TEST(KeyLocation, maps_keys_to_files_and_blocks) {
+    std::string path = "zddlsm_location_trace_test.bin";
+    ZDDLSM::Storage zdd(8);
+    zdd.StartTrace(path);
+    zdd.Set("a", ZDDLSM::KeyLocation{2, 17, 1ULL << 40});
+    zdd.Set(3, "b", ZDDLSM::KeyLocation{1, 5, 9});
+    zdd.Set("c", 4);
+    zdd.StopTrace();
+
+    EXPECT_EQ(zdd.GetLocation("a"), (ZDDLSM::KeyLocation{2, 17, 1ULL << 40}));
+    EXPECT_EQ(zdd.GetLevel("a"), 2);
+    EXPECT_EQ(zdd.GetLocation(3, "b"), (ZDDLSM::KeyLocation{1, 5, 9}));
+    EXPECT_EQ(zdd.GetLocation("c"), ZDDLSM::KeyLocation{4});
+    EXPECT_FALSE(zdd.GetLocation("b").has_value());
+
+    // a new level without a file means the key moved
+    zdd.Set("a", 3);
+    EXPECT_EQ(zdd.GetLocation("a"), ZDDLSM::KeyLocation{3});
+
+    ZDDLSM::Storage other(8);
+    other.Set("a", ZDDLSM::KeyLocation{0, 1, 2});
+    other.Set("d", ZDDLSM::KeyLocation{6, 7, 8});
+    zdd.MergeFrom(other, ZDDLSM::ConflictPolicy::min_level);
+    EXPECT_EQ(zdd.GetLocation("a"), (ZDDLSM::KeyLocation{0, 1, 2}));
+    EXPECT_EQ(zdd.GetLocation("d"), (ZDDLSM::KeyLocation{6, 7, 8}));
+
+    // taking their level drops our file too
+    ZDDLSM::Storage moved(8);
+    moved.Set("d", 5);
+    zdd.MergeFrom(moved, ZDDLSM::ConflictPolicy::theirs);
+    EXPECT_EQ(zdd.GetLocation("d"), ZDDLSM::KeyLocation{5});
+    zdd.Delete("a");
+    zdd.Set("a", 1);
+    EXPECT_EQ(zdd.GetLocation("a"), ZDDLSM::KeyLocation{1});
+
+    // keys set with levels only keep no file and block
+    ZDDLSM::Storage levels(8);
+    ZDDLSM::Storage located(8);
+    for (const auto& [key, level] : ScrambledKeys(1000, 7919)) {
+        levels.Set(key, level);
+        located.Set(key, ZDDLSM::KeyLocation{level, 1, 2});
+    }
+    EXPECT_EQ(levels.GetStats().data_entries,
+              located.GetStats().data_entries);
+    EXPECT_LT(levels.GetStats().data_bytes * 3 / 2,
+              located.GetStats().data_bytes);
+
+    ZDDLSM::TraceReader reader(path);
+    std::vector<ZDDLSM::TraceRecord> records;
+    for (ZDDLSM::TraceRecord record; reader.Next(record);) {
+        records.push_back(record);
+    }
+    std::remove(path.c_str());
+    ASSERT_EQ(records.size(), 3);
+    EXPECT_EQ(records[0].op, ZDDLSM::TraceOp::set_location);
+    EXPECT_EQ(records[0].file_number, 1ULL << 40);
+    EXPECT_EQ(records[0].block_hint, 17);
+    EXPECT_EQ(records[1].cf_id, 3);
+    EXPECT_EQ(records[2].op, ZDDLSM::TraceOp::set);
+}
@@ -0,0 +1,245 @@
+#include "include/async_storage.h"
+
+#include <set>
+
+namespace {
+ZDDLSM::AsyncStorage::Callback Fulfill(
+    std::shared_ptr<std::promise<void>> promise) {
+    return [promise](std::optional<uint32_t>, std::exception_ptr error) {
+        if (error != nullptr) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    };
+}
+
+ZDDLSM::AsyncStorage::Callback Fulfill(
+    std::shared_ptr<std::promise<std::optional<uint32_t>>> promise) {
+    return [promise](std::optional<uint32_t> level, std::exception_ptr error) {
+        if (error != nullptr) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(level);
+        }
+    };
+}
+
+uint32_t CheckBatch(uint32_t max_batch) {
+    if (max_batch == 0) {
+        throw std::invalid_argument("max_batch must be positive");
+    }
+    return max_batch;
+}
+}  // namespace
+
+namespace ZDDLSM {
+AsyncStorage::AsyncStorage(Storage& storage, uint32_t max_batch)
+    : storage_(storage),
+      max_batch_(CheckBatch(max_batch)),
+      head_(nullptr),
+      sleeping_(false),
+      stop_(false),
+      batches_(0),
+      write_groups_(0),
+      combiner_(&AsyncStorage::Combine, this) {}
+
+AsyncStorage::~AsyncStorage() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    combiner_.join();
+}
+
+std::future<void> AsyncStorage::Set(const std::string& key,
+                                    uint32_t to_level) {
+    auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    Submit(AsyncOp::set, key, to_level, Fulfill(promise));
+    return future;
+}
+
+std::future<void> AsyncStorage::Set(uint32_t cf_id, const std::string& key,
+                                    uint32_t to_level) {
+    auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    Submit(AsyncOp::set, cf_id, key, to_level, Fulfill(promise));
+    return future;
+}
+
+std::future<void> AsyncStorage::Delete(const std::string& key) {
+    auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    Submit(AsyncOp::del, key, 0, Fulfill(promise));
+    return future;
+}
+
+std::future<void> AsyncStorage::Delete(uint32_t cf_id,
+                                       const std::string& key) {
+    auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> future = promise->get_future();
+    Submit(AsyncOp::del, cf_id, key, 0, Fulfill(promise));
+    return future;
+}
+
+std::future<std::optional<uint32_t>> AsyncStorage::GetLevel(
+    const std::string& key) {
+    auto promise = std::make_shared<std::promise<std::optional<uint32_t>>>();
+    std::future<std::optional<uint32_t>> future = promise->get_future();
+    Submit(AsyncOp::get_level, key, 0, Fulfill(promise));
+    return future;
+}
+
+std::future<std::optional<uint32_t>> AsyncStorage::GetLevel(
+    uint32_t cf_id, const std::string& key) {
+    auto promise = std::make_shared<std::promise<std::optional<uint32_t>>>();
+    std::future<std::optional<uint32_t>> future = promise->get_future();
+    Submit(AsyncOp::get_level, cf_id, key, 0, Fulfill(promise));
+    return future;
+}
+
+void AsyncStorage::Submit(AsyncOp op, const std::string& key,
+                          uint32_t to_level, Callback callback) {
+    Push(std::unique_ptr<Request>(new Request{op, false, Storage::DEFAULT_CF,
+                                              key, to_level,
+                                              std::move(callback), nullptr}));
+}
+
+void AsyncStorage::Submit(AsyncOp op, uint32_t cf_id, const std::string& key,
+                          uint32_t to_level, Callback callback) {
+    storage_.CheckColumnFamilies();
+    Push(std::unique_ptr<Request>(new Request{
+        op, true, cf_id, key, to_level, std::move(callback), nullptr}));
+}
+
+void AsyncStorage::Push(std::unique_ptr<Request> request) {
+    Request* node = request.release();
+    node->next = head_.load();
+    while (!head_.compare_exchange_weak(node->next, node)) {
+    }
+
+    // pairs with the check of `head_` after `sleeping_` is set by combiner
+    if (sleeping_.load()) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        cv_.notify_one();
+    }
+}
+
+void AsyncStorage::Combine() {
+    while (true) {
+        Request* list = head_.exchange(nullptr);
+        if (list == nullptr) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stop_) {
+                break;
+            }
+            sleeping_.store(true);
+            cv_.wait(lock,
+                     [this]() { return head_.load() != nullptr || stop_; });
+            sleeping_.store(false);
+            continue;
+        }
+
+        std::vector<std::unique_ptr<Request>> batch;
+        for (; list != nullptr; list = list->next) {
+            batch.emplace_back(list);
+        }
+        std::reverse(batch.begin(), batch.end());
+
+        ++batches_;
+        Process(batch);
+    }
+}
+
+void AsyncStorage::Process(std::vector<std::unique_ptr<Request>>& batch) {
+    std::vector<std::optional<uint32_t>> levels(batch.size());
+    std::vector<std::exception_ptr> errors(batch.size());
+    std::vector<std::optional<Storage::InternalKey>> ikeys(batch.size());
+    // a write whose key can't be compressed fails alone
+    auto encode = [&](size_t i) {
+        if (!ikeys[i].has_value() && errors[i] == nullptr) {
+            try {
+                ikeys[i].emplace(storage_.MakeKey(
+                    batch[i]->cf_id, batch[i]->key, *storage_.compressor_));
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+        return ikeys[i].has_value();
+    };
+    {
+        LockGuard guard = storage_.Lock();
+        for (size_t from = 0; from != batch.size();) {
+            const Request& request = *batch[from];
+            if (request.op == AsyncOp::get_level) {
+                try {
+                    levels[from] =
+                        request.has_cf
+                            ? storage_.GetLevel(request.cf_id, request.key)
+                            : storage_.GetLevel(request.key);
+                } catch (...) {
+                    errors[from] = std::current_exception();
+                }
+                ++from;
+                continue;
+            }
+
+            // a repeated stored key starts a new group, so that it sees the
+            // previous write; distinct keys may compress to the same one
+            std::set<std::pair<uint32_t, std::string>> keys;
+            size_t to = from;
+            while (to != batch.size() && to - from != max_batch_ &&
+                   batch[to]->op == request.op && encode(to) &&
+                   keys.emplace(batch[to]->cf_id, ikeys[to]->StoredKey())
+                       .second) {
+                ++to;
+            }
+            if (to == from) {
+                ++from;
+                continue;
+            }
+            try {
+                ApplyWrites(batch, ikeys, from, to);
+            } catch (...) {
+                std::fill(errors.begin() + from, errors.begin() + to,
+                          std::current_exception());
+            }
+            from = to;
+        }
+    }
+
+    for (size_t i = 0; i != batch.size(); ++i) {
+        batch[i]->callback(levels[i], errors[i]);
+    }
+}
+
+void AsyncStorage::ApplyWrites(
+    std::vector<std::unique_ptr<Request>>& batch,
+    std::vector<std::optional<Storage::InternalKey>>& ikeys, size_t from,
+    size_t to) {
+    ++write_groups_;
+    if (batch[from]->op == AsyncOp::set) {
+        std::vector<std::pair<Storage::InternalKey, uint32_t>> keys;
+        keys.reserve(to - from);
+        for (size_t i = from; i != to; ++i) {
+            const Request& request = *batch[i];
+            storage_.Trace(TraceOp::set, request.has_cf, request.cf_id,
+                           request.key, request.level);
+            keys.emplace_back(std::move(*ikeys[i]), request.level);
+        }
+        storage_.SetMany(keys);
+    } else {
+        std::vector<Storage::InternalKey> keys;
+        keys.reserve(to - from);
+        for (size_t i = from; i != to; ++i) {
+            const Request& request = *batch[i];
+            storage_.Trace(TraceOp::del, request.has_cf, request.cf_id,
+                           request.key);
+            keys.push_back(std::move(*ikeys[i]));
+        }
+        storage_.DeleteMany(keys);
+    }
+}
+}  // namespace ZDDLSM
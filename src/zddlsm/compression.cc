@@ -2,36 +2,247 @@
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <zdict.h>
+// the magicless frame format is an experimental parameter
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <stdexcept>
 #include <vector>
 
+namespace {
+/*
+wyhash (public domain, Wang Yi). Only the parts needed for fingerprinting.
+*/
+constexpr uint64_t WYHASH_SECRET[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull};
+
+inline void WyMum(uint64_t* a, uint64_t* b) {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = static_cast<uint64_t>(r);
+    *b = static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t WyMix(uint64_t a, uint64_t b) {
+    WyMum(&a, &b);
+    return a ^ b;
+}
+
+inline uint64_t WyRead8(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t WyRead4(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t WyRead3(const uint8_t* p, size_t k) {
+    return (static_cast<uint64_t>(p[0]) << 16) |
+           (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64_t WyHash(const void* key, size_t len, uint64_t seed) {
+    const uint8_t* p = static_cast<const uint8_t*>(key);
+    seed ^= WyMix(seed ^ WYHASH_SECRET[0], WYHASH_SECRET[1]);
+    uint64_t a;
+    uint64_t b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (WyRead4(p) << 32) | WyRead4(p + ((len >> 3) << 2));
+            b = (WyRead4(p + len - 4) << 32) |
+                WyRead4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = WyRead3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed;
+            uint64_t see2 = seed;
+            do {
+                seed = WyMix(WyRead8(p) ^ WYHASH_SECRET[1],
+                             WyRead8(p + 8) ^ seed);
+                see1 = WyMix(WyRead8(p + 16) ^ WYHASH_SECRET[2],
+                             WyRead8(p + 24) ^ see1);
+                see2 = WyMix(WyRead8(p + 32) ^ WYHASH_SECRET[3],
+                             WyRead8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = WyMix(WyRead8(p) ^ WYHASH_SECRET[1], WyRead8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = WyRead8(p + i - 16);
+        b = WyRead8(p + i - 8);
+    }
+
+    a ^= WYHASH_SECRET[1];
+    b ^= seed;
+    WyMum(&a, &b);
+    return WyMix(a ^ WYHASH_SECRET[0] ^ len, b ^ WYHASH_SECRET[1]);
+}
+
+/*
+Seeds of independent 64-bit lanes. Fingerprints wider than 64 bits are
+concatenations of lanes.
+*/
+constexpr uint64_t FINGERPRINT_SEEDS[2] = {0x9e3779b97f4a7c15ull,
+                                           0xc2b2ae3d27d4eb4full};
+}  // namespace
+
 namespace Compression {
-constexpr static uint32_t COMPRESSION_LEVEL_ZSTD = 6;
+namespace {
+/*
+Keys are never decompressed, so frames are magicless and carry no content
+size, checksum or dictionary id. Their header is then a frame and a window
+descriptor. zstd stores blocks that don't shrink raw, after a block header.
+*/
+constexpr size_t ZSTD_KEY_FRAME_HEADER = 2;
+constexpr size_t ZSTD_BLOCK_HEADER = 3;
+constexpr size_t ZSTD_BLOCK_SIZE = 128 << 10;
+
+/*
+Per-thread zstd context and output buffer reused by every `ZstdCompressor`.
+`compressor` is the id of the compressor whose parameters are set.
+*/
+struct ZstdThreadContext {
+    ZstdThreadContext() : cctx(ZSTD_createCCtx()), compressor(0) {}
+
+    ~ZstdThreadContext() { ZSTD_freeCCtx(cctx); }
+
+    ZSTD_CCtx* cctx;
+    std::vector<char> buffer;
+    uint64_t compressor;
+};
+
+uint64_t NextZstdCompressorId() {
+    static std::atomic<uint64_t> next_id{1};
+    return next_id.fetch_add(1);
+}
+
+ZstdThreadContext& GetZstdThreadContext() {
+    thread_local ZstdThreadContext context;
+    return context;
+}
+
+void CheckZstd(size_t code) {
+    if (ZSTD_isError(code)) {
+        throw std::runtime_error(ZSTD_getErrorName(code));
+    }
+}
+}  // namespace
+
+ZstdCompressor::ZstdCompressor(int level)
+    : level_(level), cdict_(nullptr), id_(NextZstdCompressorId()) {}
+
+ZstdCompressor::ZstdCompressor(const std::string& dictionary, int level)
+    : level_(level),
+      dictionary_(dictionary),
+      cdict_(nullptr),
+      id_(NextZstdCompressorId()) {
+    if (!dictionary_.empty()) {
+        cdict_ =
+            ZSTD_createCDict(dictionary_.data(), dictionary_.size(), level_);
+        if (cdict_ == nullptr) {
+            throw std::runtime_error("failed to load zstd dictionary");
+        }
+    }
+}
+
+ZstdCompressor::~ZstdCompressor() { ZSTD_freeCDict(cdict_); }
 
 std::string ZstdCompressor::Compress(const std::string& key) const {
     if (key.size() == 0) {
         return "";
     }
 
-    uint32_t compressed_size_ub = ZSTD_compressBound(key.size());
-    std::vector<char> buffer(compressed_size_ub);
-    uint32_t compressed_size =
-        ZSTD_compress(buffer.data(), compressed_size_ub, key.data(), key.size(),
-                      COMPRESSION_LEVEL_ZSTD);
+    ZstdThreadContext& context = GetZstdThreadContext();
+    if (context.cctx == nullptr) {
+        throw std::runtime_error("failed to create zstd context");
+    }
+
+    size_t compressed_size_ub = ZSTD_compressBound(key.size());
+    if (context.buffer.size() < compressed_size_ub) {
+        context.buffer.resize(compressed_size_ub);
+    }
+
+    // parameters stick to the context until another compressor uses it
+    if (context.compressor != id_) {
+        context.compressor = 0;
+        CheckZstd(
+            ZSTD_CCtx_reset(context.cctx, ZSTD_reset_session_and_parameters));
+        CheckZstd(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_compressionLevel,
+                                         level_));
+        CheckZstd(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_format,
+                                         ZSTD_f_zstd1_magicless));
+        CheckZstd(
+            ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_contentSizeFlag, 0));
+        CheckZstd(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_checksumFlag, 0));
+        CheckZstd(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_dictIDFlag, 0));
+        if (cdict_ != nullptr) {
+            CheckZstd(ZSTD_CCtx_refCDict(context.cctx, cdict_));
+        }
+        context.compressor = id_;
+    }
+
+    size_t compressed_size =
+        ZSTD_compress2(context.cctx, context.buffer.data(), compressed_size_ub,
+                       key.data(), key.size());
+    CheckZstd(compressed_size);
+
+    return std::string(context.buffer.data(), compressed_size);
+}
+
+std::string ZstdCompressor::TrainDictionary(
+    const std::vector<std::string>& samples, size_t max_dict_size) {
+    std::string samples_buffer;
+    std::vector<size_t> samples_sizes;
+    samples_sizes.reserve(samples.size());
+
+    for (const std::string& sample : samples) {
+        samples_buffer += sample;
+        samples_sizes.push_back(sample.size());
+    }
+
+    std::string dictionary(max_dict_size, '\0');
+    size_t dict_size = ZDICT_trainFromBuffer(
+        dictionary.data(), dictionary.size(), samples_buffer.data(),
+        samples_sizes.data(), samples_sizes.size());
 
-    if (ZSTD_isError(compressed_size)) {
-        throw std::runtime_error(ZSTD_getErrorName(compressed_size));
+    if (ZDICT_isError(dict_size)) {
+        throw std::runtime_error(ZDICT_getErrorName(dict_size));
     }
 
-    return std::string(buffer.data(), compressed_size);
+    dictionary.resize(dict_size);
+    return dictionary;
 }
 
 uint32_t ZstdCompressor::BytesNeeds(uint32_t key_byte_len) const {
-    return ZSTD_compressBound(key_byte_len);
+    // an empty key is still one empty block
+    size_t blocks = std::max<size_t>(
+        1, (key_byte_len + ZSTD_BLOCK_SIZE - 1) / ZSTD_BLOCK_SIZE);
+    return ZSTD_KEY_FRAME_HEADER + blocks * ZSTD_BLOCK_HEADER + key_byte_len;
 }
 
+compression ZstdCompressor::Type() const { return compression::zstd; }
+
 std::string MD5Hasher::Compress(const std::string& key) const {
     std::string compressed_key(MD5_DIGEST_LENGTH, '\0');
     MD5(reinterpret_cast<const unsigned char*>(key.data()), key.size(),
@@ -44,6 +255,10 @@ uint32_t MD5Hasher::BytesNeeds(uint32_t key_byte_len) const {
     return MD5_DIGEST_LENGTH;
 }
 
+bool MD5Hasher::FixedWidth() const { return true; }
+
+compression MD5Hasher::Type() const { return compression::md5; }
+
 std::string SHA256Hasher::Compress(const std::string& key) const {
     std::string compressed_key(SHA256_DIGEST_LENGTH, '\0');
     SHA256(reinterpret_cast<const unsigned char*>(key.data()), key.size(),
@@ -56,6 +271,41 @@ uint32_t SHA256Hasher::BytesNeeds(uint32_t key_byte_len) const {
     return SHA256_DIGEST_LENGTH;
 }
 
+bool SHA256Hasher::FixedWidth() const { return true; }
+
+compression SHA256Hasher::Type() const { return compression::sha256; }
+
+FingerprintHasher::FingerprintHasher(uint32_t width_bits)
+    : width_bytes_(width_bits / 8) {
+    if (width_bits != 32 && width_bits != 64 && width_bits != 96 &&
+        width_bits != 128) {
+        throw std::invalid_argument(
+            "fingerprint width must be 32, 64, 96 or 128 bits");
+    }
+}
+
+std::string FingerprintHasher::Compress(const std::string& key) const {
+    std::string fingerprint(width_bytes_, '\0');
+
+    for (uint32_t lane = 0, offset = 0; offset < width_bytes_; ++lane) {
+        uint64_t hash = WyHash(key.data(), key.size(), FINGERPRINT_SEEDS[lane]);
+        for (uint32_t i = 0; i != sizeof(hash) && offset < width_bytes_;
+             ++i, ++offset) {
+            fingerprint[offset] = static_cast<char>(hash >> (56 - 8 * i));
+        }
+    }
+
+    return fingerprint;
+}
+
+uint32_t FingerprintHasher::BytesNeeds(uint32_t) const {
+    return width_bytes_;
+}
+
+bool FingerprintHasher::FixedWidth() const { return true; }
+
+compression FingerprintHasher::Type() const { return compression::fingerprint; }
+
 std::string NoCompression::Compress(const std::string& key) const {
     return key;
 }
@@ -64,6 +314,8 @@ uint32_t NoCompression::BytesNeeds(uint32_t key_byte_len) const {
     return key_byte_len;
 }
 
+compression NoCompression::Type() const { return compression::none; }
+
 std::unique_ptr<ICompressor> BuildCompressor(compression type) {
     switch (type) {
         case compression::md5:
@@ -72,6 +324,8 @@ std::unique_ptr<ICompressor> BuildCompressor(compression type) {
             return std::make_unique<SHA256Hasher>();
         case compression::zstd:
             return std::make_unique<ZstdCompressor>();
+        case compression::fingerprint:
+            return std::make_unique<FingerprintHasher>();
         default:
             return std::make_unique<NoCompression>();
     }
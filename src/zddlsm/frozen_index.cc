@@ -0,0 +1,466 @@
+#include "include/frozen_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+constexpr static char FROZEN_MAGIC[] = {'Z', 'D', 'D', 'F'};
+constexpr static uint32_t FROZEN_VERSION = 3;
+
+/*
+Bits per key byte of fixed-width and variable-width keys, as in `Storage`.
+*/
+constexpr static uint32_t BITS_IN_BYTE = 8;
+constexpr static uint32_t BITS_PER_KEY_BYTE = BITS_IN_BYTE + 1;
+
+/*
+Nodes laid out breadth-first before the depth-first part, 48 KB of them.
+*/
+constexpr static uint32_t HOT_NODES = 4096;
+
+/*
+File layout: the header, column family roots, nodes, then levels.
+*/
+struct FileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t key_bit_len;
+    uint32_t key_byte_bits;
+    uint32_t compression;
+    uint32_t families;
+    uint64_t nodes;
+    uint64_t leaves;
+};
+
+bool IsNode(uint32_t child) {
+    return child != ZDDLSM::FrozenIndex::EMPTY &&
+           (child & ZDDLSM::FrozenIndex::LEAF) == 0;
+}
+
+/*
+Whether `child` of node `parent` (or a root, if `parent` is `nodes`) can be
+followed: nodes are laid out after their parents, so lookups can't loop.
+*/
+bool IsValidChild(uint32_t child, uint64_t parent, uint64_t nodes,
+                  uint64_t leaves) {
+    if (child == ZDDLSM::FrozenIndex::EMPTY) {
+        return true;
+    }
+    if ((child & ZDDLSM::FrozenIndex::LEAF) != 0) {
+        return (child & ~ZDDLSM::FrozenIndex::LEAF) < leaves;
+    }
+    return child < nodes && (parent == nodes || child > parent);
+}
+}  // namespace
+
+namespace ZDDLSM {
+FrozenIndex::FrozenIndex(
+    uint32_t key_bit_len, uint32_t key_byte_bits,
+    std::shared_ptr<const Compression::ICompressor> compressor)
+    : key_bit_len_(key_bit_len),
+      key_byte_bits_(key_byte_bits),
+      compressor_(std::move(compressor)),
+      mapping_(nullptr),
+      mapping_size_(0),
+      nodes_(nullptr),
+      levels_(nullptr),
+      node_count_(0),
+      leaf_count_(0) {}
+
+FrozenIndex::FrozenIndex(FrozenIndex&& other) noexcept
+    : key_bit_len_(other.key_bit_len_),
+      key_byte_bits_(other.key_byte_bits_),
+      compressor_(std::move(other.compressor_)),
+      roots_(std::move(other.roots_)),
+      owned_nodes_(std::move(other.owned_nodes_)),
+      owned_levels_(std::move(other.owned_levels_)),
+      mapping_(std::exchange(other.mapping_, nullptr)),
+      mapping_size_(std::exchange(other.mapping_size_, 0)),
+      nodes_(std::exchange(other.nodes_, nullptr)),
+      levels_(std::exchange(other.levels_, nullptr)),
+      node_count_(std::exchange(other.node_count_, 0)),
+      leaf_count_(std::exchange(other.leaf_count_, 0)) {}
+
+FrozenIndex& FrozenIndex::operator=(FrozenIndex&& other) noexcept {
+    if (this != &other) {
+        if (mapping_ != nullptr) {
+            munmap(mapping_, mapping_size_);
+        }
+        key_bit_len_ = other.key_bit_len_;
+        key_byte_bits_ = other.key_byte_bits_;
+        compressor_ = std::move(other.compressor_);
+        roots_ = std::move(other.roots_);
+        owned_nodes_ = std::move(other.owned_nodes_);
+        owned_levels_ = std::move(other.owned_levels_);
+        mapping_ = std::exchange(other.mapping_, nullptr);
+        mapping_size_ = std::exchange(other.mapping_size_, 0);
+        nodes_ = std::exchange(other.nodes_, nullptr);
+        levels_ = std::exchange(other.levels_, nullptr);
+        node_count_ = std::exchange(other.node_count_, 0);
+        leaf_count_ = std::exchange(other.leaf_count_, 0);
+    }
+    return *this;
+}
+
+FrozenIndex::~FrozenIndex() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+void FrozenIndex::Build(const std::vector<Node>& tree,
+                        const std::vector<std::pair<uint32_t, uint32_t>>& roots,
+                        std::vector<uint32_t> levels) {
+    // key nodes are never shared, so every node is reached once
+    std::vector<uint32_t> order;
+    order.reserve(tree.size());
+    std::deque<uint32_t> queue;
+    for (const auto& [cf_id, root] : roots) {
+        if (IsNode(root)) {
+            queue.push_back(root);
+        }
+    }
+    while (!queue.empty() && order.size() < HOT_NODES) {
+        uint32_t node = queue.front();
+        queue.pop_front();
+        order.push_back(node);
+        for (uint32_t child : tree[node].children) {
+            if (IsNode(child)) {
+                queue.push_back(child);
+            }
+        }
+    }
+
+    // the rest depth-first, 0-branches right after their parents
+    std::vector<uint32_t> stack;
+    for (uint32_t subtree : queue) {
+        stack.push_back(subtree);
+        while (!stack.empty()) {
+            uint32_t node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (uint32_t child : {tree[node].children[1],
+                                   tree[node].children[0]}) {
+                if (IsNode(child)) {
+                    stack.push_back(child);
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t> remap(tree.size());
+    for (uint32_t i = 0; i != order.size(); ++i) {
+        remap[order[i]] = i;
+    }
+    auto moved = [&](uint32_t child) {
+        return IsNode(child) ? remap[child] : child;
+    };
+
+    owned_nodes_.resize(order.size());
+    for (uint32_t i = 0; i != order.size(); ++i) {
+        const Node& node = tree[order[i]];
+        owned_nodes_[i] = {node.pos,
+                           {moved(node.children[0]), moved(node.children[1])}};
+    }
+    roots_.clear();
+    for (const auto& [cf_id, root] : roots) {
+        roots_.emplace_back(cf_id, moved(root));
+    }
+    std::sort(roots_.begin(), roots_.end());
+    owned_levels_ = std::move(levels);
+
+    nodes_ = owned_nodes_.data();
+    levels_ = owned_levels_.data();
+    node_count_ = owned_nodes_.size();
+    leaf_count_ = owned_levels_.size();
+}
+
+uint32_t FrozenIndex::RootOf(uint32_t cf_id) const {
+    auto it = std::lower_bound(
+        roots_.begin(), roots_.end(), cf_id,
+        [](const auto& root, uint32_t id) { return root.first < id; });
+    return it == roots_.end() || it->first != cf_id ? EMPTY : it->second;
+}
+
+uint64_t FrozenIndex::Bytes() const {
+    return node_count_ * sizeof(Node) + leaf_count_ * sizeof(uint32_t) +
+           roots_.size() * sizeof(roots_[0]);
+}
+
+std::optional<uint32_t> FrozenIndex::GetLevel(const std::string& key) const {
+    return GetLevel(Storage::DEFAULT_CF, key);
+}
+
+std::optional<uint32_t> FrozenIndex::GetLevel(uint32_t cf_id,
+                                              const std::string& key) const {
+    Storage::InternalKey ikey(key, cf_id, *compressor_, key_byte_bits_);
+    uint32_t key_len = std::min(key_bit_len_, ikey.BitLen());
+    uint32_t child = RootOf(cf_id);
+    uint32_t pos = 0;
+    while (IsNode(child)) {
+        const Node& node = nodes_[child];
+        // the 0-branch is mostly the next node, fetch the other one while
+        // the key is checked
+        if (IsNode(node.children[1])) {
+            __builtin_prefetch(&nodes_[node.children[1]]);
+        }
+
+        // bits skipped by ZDD are zero
+        for (; pos < std::min(node.pos, key_len); ++pos) {
+            if (ikey.Bit(pos)) {
+                return std::nullopt;
+            }
+        }
+        bool bit = node.pos < key_len && ikey.Bit(node.pos);
+        child = node.children[bit ? 1 : 0];
+        pos = node.pos + 1;
+    }
+    if (child == EMPTY) {
+        return std::nullopt;
+    }
+
+    for (; pos < key_len; ++pos) {
+        if (ikey.Bit(pos)) {
+            return std::nullopt;
+        }
+    }
+    return levels_[child & ~LEAF];
+}
+
+void FrozenIndex::Save(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("can't open frozen index " + path);
+    }
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, FROZEN_MAGIC, sizeof(FROZEN_MAGIC));
+    header.version = FROZEN_VERSION;
+    header.key_bit_len = key_bit_len_;
+    header.key_byte_bits = key_byte_bits_;
+    header.compression = static_cast<uint32_t>(compressor_->Type());
+    header.families = roots_.size();
+    header.nodes = node_count_;
+    header.leaves = leaf_count_;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto& [cf_id, root] : roots_) {
+        uint32_t entry[2] = {cf_id, root};
+        out.write(reinterpret_cast<const char*>(entry), sizeof(entry));
+    }
+    out.write(reinterpret_cast<const char*>(nodes_),
+              node_count_ * sizeof(Node));
+    out.write(reinterpret_cast<const char*>(levels_),
+              leaf_count_ * sizeof(uint32_t));
+    if (!out.flush()) {
+        throw std::runtime_error("can't write frozen index " + path);
+    }
+}
+
+FrozenIndex FrozenIndex::Open(
+    const std::string& path,
+    std::shared_ptr<const Compression::ICompressor> compressor) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("can't open frozen index " + path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 ||
+        static_cast<size_t>(file_stat.st_size) < sizeof(FileHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a frozen index");
+    }
+    size_t size = file_stat.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("can't map frozen index " + path);
+    }
+
+    FrozenIndex index(0, 0, std::move(compressor));
+    index.mapping_ = mapping;
+    index.mapping_size_ = size;
+
+    // counts are bounded first, so the size check can't wrap
+    const auto* header = static_cast<const FileHeader*>(mapping);
+    if (!std::equal(FROZEN_MAGIC, FROZEN_MAGIC + sizeof(FROZEN_MAGIC),
+                    header->magic) ||
+        header->version != FROZEN_VERSION || header->nodes >= LEAF ||
+        header->leaves >= LEAF ||
+        header->families >
+            (size - sizeof(FileHeader)) / (2 * sizeof(uint32_t)) ||
+        size != sizeof(FileHeader) + header->families * 2 * sizeof(uint32_t) +
+                    header->nodes * sizeof(Node) +
+                    header->leaves * sizeof(uint32_t)) {
+        throw std::runtime_error(path + " is not a frozen index");
+    }
+    bool fixed_width = header->key_byte_bits == BITS_IN_BYTE;
+    if ((!fixed_width && header->key_byte_bits != BITS_PER_KEY_BYTE) ||
+        header->key_bit_len % header->key_byte_bits != 0) {
+        throw std::runtime_error(path + " is not a frozen index");
+    }
+
+    // keys are looked up as they were stored
+    const auto& used = *index.compressor_;
+    if (header->compression != static_cast<uint32_t>(used.Type()) ||
+        fixed_width != used.FixedWidth() ||
+        (fixed_width &&
+         header->key_bit_len != used.BytesNeeds(0) * BITS_IN_BYTE)) {
+        throw std::invalid_argument(path +
+                                    " was frozen with another compressor");
+    }
+
+    const auto* roots = reinterpret_cast<const uint32_t*>(header + 1);
+    const auto* nodes =
+        reinterpret_cast<const Node*>(roots + 2 * header->families);
+    for (uint32_t i = 0; i != header->families; ++i) {
+        if ((i != 0 && roots[2 * i] <= roots[2 * i - 2]) ||
+            !IsValidChild(roots[2 * i + 1], header->nodes, header->nodes,
+                          header->leaves)) {
+            throw std::runtime_error(path + " is not a frozen index");
+        }
+        index.roots_.emplace_back(roots[2 * i], roots[2 * i + 1]);
+    }
+    // ZDD nodes never have an empty 1-branch, iterators rely on it
+    for (uint64_t i = 0; i != header->nodes; ++i) {
+        if (nodes[i].children[1] == EMPTY) {
+            throw std::runtime_error(path + " is not a frozen index");
+        }
+        for (uint32_t child : nodes[i].children) {
+            if (!IsValidChild(child, i, header->nodes, header->leaves)) {
+                throw std::runtime_error(path + " is not a frozen index");
+            }
+        }
+    }
+    index.key_bit_len_ = header->key_bit_len;
+    index.key_byte_bits_ = header->key_byte_bits;
+    index.nodes_ = nodes;
+    index.levels_ = reinterpret_cast<const uint32_t*>(index.nodes_ +
+                                                      header->nodes);
+    index.node_count_ = header->nodes;
+    index.leaf_count_ = header->leaves;
+    return index;
+}
+
+FrozenIterator::FrozenIterator(const FrozenIndex* index,
+                               const std::string& key)
+    : index_(index), leaf_(FrozenIndex::EMPTY), end_(false) {
+    Init(Storage::DEFAULT_CF, key);
+}
+
+FrozenIterator::FrozenIterator(const FrozenIndex* index, uint32_t cf_id,
+                               const std::string& key)
+    : index_(index), leaf_(FrozenIndex::EMPTY), end_(false) {
+    Init(cf_id, key);
+}
+
+FrozenIterator::FrozenIterator(const FrozenIndex* index)
+    : FrozenIterator(index, std::string()) {}
+
+FrozenIterator::FrozenIterator(const FrozenIndex* index, uint32_t cf_id)
+    : FrozenIterator(index, cf_id, std::string()) {}
+
+void FrozenIterator::Init(uint32_t cf_id, const std::string& key) {
+    uint32_t child = index_->RootOf(cf_id);
+    if (child == FrozenIndex::EMPTY) {
+        end_ = true;
+        return;
+    }
+
+    Storage::InternalKey ikey(key, cf_id, Compression::NoCompression(),
+                              index_->key_byte_bits_);
+    uint32_t key_len = std::min(index_->key_bit_len_, ikey.BitLen());
+    uint32_t pos = 0;
+
+    // follow `key` while it's possible, then step to the first larger key
+    while (IsNode(child)) {
+        const FrozenIndex::Node& node = index_->nodes_[child];
+        for (; pos < std::min(node.pos, key_len); ++pos) {
+            if (ikey.Bit(pos)) {
+                Advance();
+                return;
+            }
+        }
+
+        bool bit = node.pos < key_len && ikey.Bit(node.pos);
+        pos = node.pos + 1;
+        if (!bit && node.children[0] == FrozenIndex::EMPTY) {
+            path_.push_back({child, true});
+            Descend(node.children[1]);
+            return;
+        }
+        if (!bit && IsNode(node.children[1])) {
+            __builtin_prefetch(&index_->nodes_[node.children[1]]);
+        }
+        path_.push_back({child, bit});
+        child = node.children[bit ? 1 : 0];
+    }
+
+    leaf_ = child;
+    for (; pos < key_len; ++pos) {
+        if (ikey.Bit(pos)) {
+            Advance();
+            return;
+        }
+    }
+}
+
+void FrozenIterator::Descend(uint32_t child) {
+    while (IsNode(child)) {
+        const FrozenIndex::Node& node = index_->nodes_[child];
+        bool right = node.children[0] == FrozenIndex::EMPTY;
+        // the 1-branch is visited after the whole 0-branch
+        if (!right && IsNode(node.children[1])) {
+            __builtin_prefetch(&index_->nodes_[node.children[1]]);
+        }
+        path_.push_back({child, right});
+        child = node.children[right ? 1 : 0];
+    }
+    leaf_ = child;
+}
+
+void FrozenIterator::Advance() {
+    while (!path_.empty() && path_.back().right) {
+        path_.pop_back();
+    }
+
+    if (path_.empty()) {
+        end_ = true;
+        return;
+    }
+
+    path_.back().right = true;
+    Descend(index_->nodes_[path_.back().node].children[1]);
+}
+
+void FrozenIterator::Next() {
+    if (!end_) {
+        Advance();
+    }
+}
+
+std::optional<KeyLevelPair> FrozenIterator::operator*() const {
+    if (end_) {
+        return std::nullopt;
+    }
+
+    std::string key;
+    for (const PathNode& node : path_) {
+        if (node.right) {
+            Storage::AppendKeyPos(key, index_->nodes_[node.node].pos,
+                                  index_->key_byte_bits_);
+        }
+    }
+    Storage::PadKey(key, index_->key_bit_len_, index_->key_byte_bits_);
+    return KeyLevelPair(std::move(key),
+                        index_->levels_[leaf_ & ~FrozenIndex::LEAF]);
+}
+}  // namespace ZDDLSM
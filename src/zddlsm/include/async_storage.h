@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zddlsm.h"
+
+namespace ZDDLSM {
+enum class AsyncOp {
+    set,
+    del,
+    get_level,
+};
+
+/*
+Front end which runs operations of many threads on one combiner thread.
+Callers publish requests to a lock-free list and wait on futures instead of
+spinning on `Storage::Lock`. The combiner takes the whole list at once and
+applies consecutive writes of distinct keys with one ZDD union or
+difference.
+
+`storage` must outlive the front end. Other threads may still use it
+directly under `Storage::Lock`.
+*/
+class AsyncStorage {
+public:
+    /*
+    Called on the combiner thread with the level for `get_level` and
+    `std::nullopt` for writes, or with the exception the operation threw.
+    It must not throw itself.
+    */
+    using Callback =
+        std::function<void(std::optional<uint32_t> level,
+                           std::exception_ptr error)>;
+
+    /*
+    At most `max_batch` writes are merged into one ZDD operation. Throws
+    `std::invalid_argument` if `max_batch` is 0.
+    */
+    explicit AsyncStorage(Storage& storage, uint32_t max_batch = 1024);
+
+    AsyncStorage(const AsyncStorage&) = delete;
+    AsyncStorage& operator=(const AsyncStorage&) = delete;
+
+    /*
+    Completes submitted requests and stops the combiner.
+    */
+    ~AsyncStorage();
+
+    std::future<void> Set(const std::string& key, uint32_t to_level);
+
+    std::future<void> Set(uint32_t cf_id, const std::string& key,
+                          uint32_t to_level);
+
+    std::future<void> Delete(const std::string& key);
+
+    std::future<void> Delete(uint32_t cf_id, const std::string& key);
+
+    std::future<std::optional<uint32_t>> GetLevel(const std::string& key);
+
+    std::future<std::optional<uint32_t>> GetLevel(uint32_t cf_id,
+                                                  const std::string& key);
+
+    /*
+    Callback flavour of the calls above. `to_level` is used by `set` only.
+    Column family requests throw `std::logic_error` right away if column
+    families are disabled.
+    */
+    void Submit(AsyncOp op, const std::string& key, uint32_t to_level,
+                Callback callback);
+
+    void Submit(AsyncOp op, uint32_t cf_id, const std::string& key,
+                uint32_t to_level, Callback callback);
+
+    /*
+    Number of drained lists and of ZDD unions or differences applied for
+    writes, to see how well writes are combined.
+    */
+    uint64_t Batches() const { return batches_.load(); }
+    uint64_t WriteGroups() const { return write_groups_.load(); }
+
+private:
+    struct Request {
+        AsyncOp op;
+        bool has_cf;
+        uint32_t cf_id;
+        std::string key;
+        uint32_t level;
+        Callback callback;
+        Request* next;
+    };
+
+    Storage& storage_;
+    uint32_t max_batch_;
+
+    /*
+    Requests pushed since the last drain, newest first.
+    */
+    std::atomic<Request*> head_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> sleeping_;
+    bool stop_;
+
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> write_groups_;
+
+    std::thread combiner_;
+
+    void Push(std::unique_ptr<Request> request);
+
+    void Combine();
+
+    /*
+    Applies `batch` in submission order under `Storage::Lock` and runs
+    callbacks after releasing it.
+    */
+    void Process(std::vector<std::unique_ptr<Request>>& batch);
+
+    /*
+    Applies writes [`from`, `to`) of one kind, whose keys are already in
+    `ikeys`, with one ZDD operation.
+    */
+    void ApplyWrites(std::vector<std::unique_ptr<Request>>& batch,
+                     std::vector<std::optional<Storage::InternalKey>>& ikeys,
+                     size_t from, size_t to);
+};
+}  // namespace ZDDLSM
@@ -1,5 +1,11 @@
+#pragma once
+
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
+
+struct ZSTD_CDict_s;
 
 namespace Compression {
 enum class compression {
@@ -7,6 +13,7 @@ enum class compression {
     md5,
     sha256,
     zstd,
+    fingerprint,
 };
 
 class ICompressor {
@@ -16,13 +23,69 @@ public:
     virtual std::string Compress(const std::string& key) const = 0;
 
     virtual uint32_t BytesNeeds(uint32_t key_byte_len) const = 0;
+
+    /*
+    Whether every key is compressed to exactly `BytesNeeds` bytes, so that
+    key length doesn't have to be stored.
+    */
+    virtual bool FixedWidth() const { return false; }
+
+    /*
+    Kind of keys this compressor produces, recorded in traces so they are
+    replayed with the same compression.
+    */
+    virtual compression Type() const = 0;
 };
 
+/*
+zstd compressor. Compression contexts are pooled per thread, so `Compress`
+does not allocate a context per key. Keys are compressed to magicless frames
+without content size, checksum and dictionary id, so `BytesNeeds` is only a
+few bytes above the key length.
+*/
 class ZstdCompressor : public ICompressor {
 public:
+    static constexpr int DEFAULT_LEVEL = 6;
+
+    explicit ZstdCompressor(int level = DEFAULT_LEVEL);
+
+    /*
+    Compresses keys against `dictionary`, e.g. one made by
+    `TrainDictionary`. Short keys with a common structure compress much
+    better this way.
+    */
+    ZstdCompressor(const std::string& dictionary, int level = DEFAULT_LEVEL);
+
+    ZstdCompressor(const ZstdCompressor&) = delete;
+    ZstdCompressor& operator=(const ZstdCompressor&) = delete;
+
+    ~ZstdCompressor();
+
     std::string Compress(const std::string& key) const;
 
     uint32_t BytesNeeds(uint32_t key_byte_len) const;
+
+    compression Type() const;
+
+    int Level() const { return level_; }
+
+    /*
+    Dictionary keys are compressed against, empty if there is none.
+    */
+    const std::string& Dictionary() const { return dictionary_; }
+
+    /*
+    Trains a dictionary of at most `max_dict_size` bytes on `samples`.
+    Throws `std::runtime_error` if zstd can't build it (e.g. too few samples).
+    */
+    static std::string TrainDictionary(const std::vector<std::string>& samples,
+                                       size_t max_dict_size = 4096);
+
+private:
+    int level_;
+    std::string dictionary_;
+    ZSTD_CDict_s* cdict_;
+    uint64_t id_;
 };
 
 class MD5Hasher : public ICompressor {
@@ -30,6 +93,10 @@ public:
     std::string Compress(const std::string& key) const;
 
     uint32_t BytesNeeds(uint32_t key_byte_len) const;
+
+    bool FixedWidth() const;
+
+    compression Type() const;
 };
 
 class SHA256Hasher : public ICompressor {
@@ -37,6 +104,30 @@ public:
     std::string Compress(const std::string& key) const;
 
     uint32_t BytesNeeds(uint32_t key_byte_len) const;
+
+    bool FixedWidth() const;
+
+    compression Type() const;
+};
+
+/*
+Fast non-cryptographic fingerprint (wyhash family). Every key is mapped to
+exactly `width_bits / 8` bytes, where `width_bits` is one of 32, 64, 96 or 128.
+*/
+class FingerprintHasher : public ICompressor {
+public:
+    explicit FingerprintHasher(uint32_t width_bits = 64);
+
+    std::string Compress(const std::string& key) const;
+
+    uint32_t BytesNeeds(uint32_t key_byte_len) const;
+
+    bool FixedWidth() const;
+
+    compression Type() const;
+
+private:
+    uint32_t width_bytes_;
 };
 
 class NoCompression : public ICompressor {
@@ -44,6 +135,8 @@ public:
     std::string Compress(const std::string& key) const;
 
     uint32_t BytesNeeds(uint32_t key_byte_len) const;
+
+    compression Type() const;
 };
 
 std::unique_ptr<ICompressor> BuildCompressor(compression type);
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "zddlsm.h"
+
+namespace ZDDLSM {
+/*
+Immutable copy of a storage made by `Storage::Freeze`. Nodes live in one
+array: the top levels first in breadth-first order, then every subtree in
+depth-first order, so a lookup touches few cache lines and the 0-branch of
+a node is usually the next entry. The token part of ZDD is replaced with
+the level itself: every key gets a token of its own, so the token part
+below a key path stands for that one key and key nodes are never shared.
+`Storage` relies on the same property when it flattens, merges and
+renumbers families.
+
+The array has no pointers and can be saved and mapped back from disk.
+Lookups are thread-safe and don't touch SAPPORO.
+*/
+class FrozenIndex {
+public:
+    /*
+    Key bit `pos` and both children. A child is a node index, `EMPTY` or
+    `LEAF` with the index of a level.
+    */
+    struct Node {
+        uint32_t pos;
+        uint32_t children[2];
+    };
+
+    constexpr static uint32_t EMPTY = UINT32_MAX;
+    constexpr static uint32_t LEAF = 1u << 31;
+
+    FrozenIndex(FrozenIndex&& other) noexcept;
+    FrozenIndex& operator=(FrozenIndex&& other) noexcept;
+
+    FrozenIndex(const FrozenIndex&) = delete;
+    FrozenIndex& operator=(const FrozenIndex&) = delete;
+
+    ~FrozenIndex();
+
+    /*
+    Maps an index written by `Save`. `compressor` has to be the one of the
+    frozen storage. Throws `std::runtime_error` if `path` is not an index or
+    its nodes point outside of it, `std::invalid_argument` if it was frozen
+    with another kind of compressor.
+    */
+    static FrozenIndex Open(const std::string& path,
+                            std::shared_ptr<const Compression::ICompressor>
+                                compressor =
+                                    std::make_shared<
+                                        Compression::NoCompression>());
+
+    /*
+    Throws `std::runtime_error` if `path` can't be written.
+    */
+    void Save(const std::string& path) const;
+
+    std::optional<uint32_t> GetLevel(const std::string& key) const;
+
+    std::optional<uint32_t> GetLevel(uint32_t cf_id,
+                                     const std::string& key) const;
+
+    uint64_t Size() const { return leaf_count_; }
+
+    uint64_t NodeCount() const { return node_count_; }
+
+    /*
+    Bytes of nodes, levels and column family roots.
+    */
+    uint64_t Bytes() const;
+
+private:
+    FrozenIndex(uint32_t key_bit_len, uint32_t key_byte_bits,
+                std::shared_ptr<const Compression::ICompressor> compressor);
+
+    /*
+    Appends key nodes of `node` to `tree` in depth-first order and levels
+    of its keys to `levels`, returns the child `node` becomes.
+    */
+    static uint32_t Copy(
+        const Storage& storage, const ZBDD& node,
+        const std::unordered_map<uint64_t, uint32_t>& data,
+        std::vector<Node>& tree, std::vector<uint32_t>& levels);
+
+    /*
+    Lays out `tree`, whose children are indices of `tree`, starting from
+    `roots` and keeps `levels` as they are.
+    */
+    void Build(const std::vector<Node>& tree,
+               const std::vector<std::pair<uint32_t, uint32_t>>& roots,
+               std::vector<uint32_t> levels);
+
+    uint32_t RootOf(uint32_t cf_id) const;
+
+    uint32_t key_bit_len_;
+    uint32_t key_byte_bits_;
+    std::shared_ptr<const Compression::ICompressor> compressor_;
+
+    /*
+    Column family ids with their roots, sorted by id.
+    */
+    std::vector<std::pair<uint32_t, uint32_t>> roots_;
+
+    std::vector<Node> owned_nodes_;
+    std::vector<uint32_t> owned_levels_;
+    void* mapping_;
+    size_t mapping_size_;
+
+    const Node* nodes_;
+    const uint32_t* levels_;
+    uint64_t node_count_;
+    uint64_t leaf_count_;
+
+    friend class Storage;
+    friend class FrozenIterator;
+};
+
+/*
+`Iterator` over a `FrozenIndex`. Seek keys are compared as stored, as with
+`Iterator`. The index must outlive the iterator.
+*/
+class FrozenIterator {
+public:
+    FrozenIterator(const FrozenIndex* index, const std::string& key);
+    FrozenIterator(const FrozenIndex* index, uint32_t cf_id,
+                   const std::string& key);
+    explicit FrozenIterator(const FrozenIndex* index);
+    FrozenIterator(const FrozenIndex* index, uint32_t cf_id);
+
+    std::optional<KeyLevelPair> operator*() const;
+
+    void Next();
+
+    bool HasNext() const { return !end_; }
+
+private:
+    /*
+    Node on the path to the current key, `right` as in `Iterator`.
+    */
+    struct PathNode {
+        uint32_t node;
+        bool right;
+    };
+
+    void Init(uint32_t cf_id, const std::string& key);
+
+    /*
+    Goes to the smallest key under `child`.
+    */
+    void Descend(uint32_t child);
+
+    void Advance();
+
+    const FrozenIndex* index_;
+    std::vector<PathNode> path_;
+    uint32_t leaf_;
+    bool end_;
+};
+}  // namespace ZDDLSM
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace ZDDLSM {
+/*
+Phases of storage operations timed by `Profiler`.
+*/
+enum class Phase {
+    encode,
+    descent,
+    path_build,
+    update,
+    gc,
+    iterator_next,
+};
+
+constexpr static uint32_t PHASES_NUMBER =
+    static_cast<uint32_t>(Phase::iterator_next) + 1;
+
+/*
+HDR-style latency histogram in nanoseconds: every power of two is split into
+`SUB_BUCKETS` linear buckets, so percentiles are within 1/SUB_BUCKETS of
+their true value.
+*/
+class LatencyHistogram {
+public:
+    static constexpr uint32_t SUB_BUCKETS = 8;
+    static constexpr uint32_t MAGNITUDES = 40;
+
+    void Record(uint64_t ns);
+
+    void Merge(const LatencyHistogram& other);
+
+    uint64_t Count() const { return count_; }
+    uint64_t Max() const { return max_; }
+    uint64_t TotalNs() const { return total_ns_; }
+
+    /*
+    Upper bound of the bucket holding percentile `p`, `p` is in [0, 100].
+    */
+    uint64_t Percentile(double p) const;
+
+private:
+    static uint32_t BucketOf(uint64_t ns);
+    static uint64_t BucketUpperBound(uint32_t bucket);
+
+    std::array<uint64_t, SUB_BUCKETS * MAGNITUDES> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t max_ = 0;
+    uint64_t total_ns_ = 0;
+};
+
+/*
+ZDD work done by operations. Divide by `OpCounters` to get it per operation.
+*/
+struct WorkCounters {
+    uint64_t nodes_visited;
+    uint64_t child_calls;
+    uint64_t onset_calls;
+    uint64_t offset_calls;
+};
+
+/*
+Collects phase latencies and work counters. Stays empty unless the library
+is built with `ZDDLSM_PROFILING`.
+*/
+class Profiler {
+public:
+    void Record(Phase phase, uint64_t ns) {
+        histograms_[static_cast<uint32_t>(phase)].Record(ns);
+    }
+
+    const LatencyHistogram& Histogram(Phase phase) const {
+        return histograms_[static_cast<uint32_t>(phase)];
+    }
+
+    WorkCounters& Counters() { return counters_; }
+    const WorkCounters& Counters() const { return counters_; }
+
+    std::string ToString() const;
+
+private:
+    std::array<LatencyHistogram, PHASES_NUMBER> histograms_;
+    WorkCounters counters_{};
+};
+
+/*
+Records time from construction to destruction as `phase`.
+*/
+class PhaseTimer {
+public:
+    PhaseTimer(Profiler& profiler, Phase phase)
+        : profiler_(profiler),
+          phase_(phase),
+          start_(std::chrono::steady_clock::now()) {}
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    ~PhaseTimer() {
+        profiler_.Record(
+            phase_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start_)
+                        .count());
+    }
+
+private:
+    Profiler& profiler_;
+    Phase phase_;
+    std::chrono::steady_clock::time_point start_;
+};
+}  // namespace ZDDLSM
+
+#define ZDDLSM_CONCAT_IMPL(a, b) a##b
+#define ZDDLSM_CONCAT(a, b) ZDDLSM_CONCAT_IMPL(a, b)
+
+#ifdef ZDDLSM_PROFILING
+#define ZDDLSM_PROFILE_PHASE(profiler, phase)  \
+    ::ZDDLSM::PhaseTimer ZDDLSM_CONCAT(phase_timer_, __LINE__)( \
+        profiler, ::ZDDLSM::Phase::phase)
+#define ZDDLSM_COUNT(profiler, counter) ++(profiler).Counters().counter
+#else
+#define ZDDLSM_PROFILE_PHASE(profiler, phase) ((void)0)
+#define ZDDLSM_COUNT(profiler, counter) ((void)0)
+#endif
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "compression.h"
+
+namespace ZDDLSM {
+enum class TraceOp : uint8_t {
+    set,
+    del,
+    get_level,
+    iterator_seek,
+    iterator_next,
+    delete_range,
+    delete_prefix,
+    set_location,
+    iterator_skip,
+    merge_key,
+    drop_column_family,
+};
+
+/*
+One traced operation. `key` is the user key before compression, `time_ns`
+counts from the start of the trace. `end_key` is set for `delete_range`,
+`file_number` and `block_hint` for `set_location` and `merge_key`. Iterator
+operations name their iterator by `iterator_id`, `count` is the distance of
+`iterator_skip`. `merge_key` is a key added or resolved by
+`Storage::MergeFrom`, its `key` is the stored key after compression.
+`drop_column_family` has only `cf_id`.
+*/
+struct TraceRecord {
+    TraceOp op;
+    bool has_cf;
+    uint32_t cf_id;
+    uint32_t level;
+    uint64_t time_ns;
+    std::string key;
+    std::string end_key;
+    uint64_t file_number;
+    uint32_t block_hint;
+    uint64_t iterator_id;
+    uint64_t count;
+};
+
+/*
+Storage parameters a trace has to be replayed with. `stored_len` is the
+compressed key length, which fixes the fingerprint width; zstd traces also
+keep the level and the dictionary.
+*/
+struct TraceHeader {
+    uint32_t key_len;
+    bool column_families;
+    Compression::compression compression;
+    uint32_t stored_len;
+    int32_t zstd_level;
+    std::string zstd_dictionary;
+
+    /*
+    Describes the compressor a storage is traced with.
+    */
+    static TraceHeader Of(uint32_t key_len, bool column_families,
+                          const Compression::ICompressor& compressor);
+
+    /*
+    Compressor that produces the same keys as the traced one.
+    */
+    std::unique_ptr<Compression::ICompressor> BuildCompressor() const;
+};
+
+/*
+Writes a compact binary trace: a header, then records with varint encoded
+time deltas, column families, levels and key lengths.
+*/
+class TraceWriter {
+public:
+    /*
+    Throws `std::runtime_error` if `path` can't be opened.
+    */
+    TraceWriter(const std::string& path, const TraceHeader& header);
+
+    /*
+    Writes `record` stamped with the current time, its `time_ns` is ignored.
+    */
+    void Record(const TraceRecord& record);
+
+    void Flush() { out_.flush(); }
+
+private:
+    void WriteVarint(uint64_t value);
+
+    std::ofstream out_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t last_ns_;
+};
+
+class TraceReader {
+public:
+    /*
+    Throws `std::runtime_error` if `path` is not a trace.
+    */
+    explicit TraceReader(const std::string& path);
+
+    const TraceHeader& Header() const { return header_; }
+
+    /*
+    Reads the next record, returns false at the end of the trace. Throws
+    `std::runtime_error` on a truncated record.
+    */
+    bool Next(TraceRecord& record);
+
+private:
+    bool ReadVarint(uint64_t& value);
+
+    bool ReadString(std::string& value);
+
+    std::ifstream in_;
+    TraceHeader header_;
+    uint64_t time_ns_;
+};
+}  // namespace ZDDLSM
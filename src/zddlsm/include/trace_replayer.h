@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+
+#include "trace.h"
+#include "zddlsm.h"
+
+namespace ZDDLSM {
+/*
+Applies records of a trace made by `Storage::StartTrace` to a storage.
+Iterators are told apart by their trace ids and dropped once they reach the
+end, because exhausted iterators record nothing more.
+
+`storage` must outlive the replayer.
+*/
+class TraceReplayer {
+public:
+    /*
+    Throws `std::invalid_argument` if `storage` doesn't store keys the way
+    the traced one did, e.g. was built with another compression. Build it
+    with `header.BuildCompressor()` to match.
+    */
+    TraceReplayer(Storage& storage, const TraceHeader& header);
+
+    /*
+    Throws `std::runtime_error` for an unknown operation.
+    */
+    void Apply(const TraceRecord& record);
+
+private:
+    Storage& storage_;
+    std::unordered_map<uint64_t, Iterator> iterators_;
+
+    void Seek(const TraceRecord& record);
+    void Step(const TraceRecord& record);
+};
+}  // namespace ZDDLSM
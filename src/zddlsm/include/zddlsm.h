@@ -2,16 +2,29 @@
 
 #include <algorithm>
 #include <atomic>
+#include <bit>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <deque>
+#include <exception>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "../../../SAPPOROBDD/include/ZBDD.h"
 #include "compression.h"
+#include "profiler.h"
+#include "trace.h"
 
 namespace ZDDLSM {
 class KeyLevelPair {
@@ -32,20 +45,92 @@ private:
     uint32_t level_;
 };
 
+/*
+Where a key lives: its level, the SST file of that level and a block hint
+within the file, so that a read goes straight to the block. Only keys set
+with a file or block pay for them, see `Storage::Set`.
+*/
+struct KeyLocation {
+    uint32_t level;
+    uint32_t block_hint = 0;
+    uint64_t file_number = 0;
+
+    bool operator==(const KeyLocation& other) const = default;
+};
+
+struct GcPolicy {
+    /*
+    Collects once nodes allocated since the last collection make up that
+    fraction of all SAPPORO nodes. It's a growth trigger, not the share of
+    dead nodes, which SAPPORO can't tell without collecting; most of the
+    growth is intermediate results of unions and differences, though.
+    0 disables the trigger.
+    */
+    double growth_fraction = 0.5;
+
+    /*
+    Collects once SAPPORO holds more nodes. 0 disables the trigger.
+    */
+    uint64_t node_budget = 0;
+
+    /*
+    Collects on a maintenance thread instead of inside `Set` and `Delete`.
+    The thread takes `Storage::Lock`, which also holds the process-wide
+    SAPPORO lock, and the collection frees nodes of every storage. So every
+    access to any storage of the process has to hold its `Lock` while the
+    thread runs.
+    */
+    bool background = false;
+
+    std::chrono::milliseconds background_period{100};
+};
+
+struct GcStats {
+    uint64_t runs;
+    uint64_t total_pause_us;
+    uint64_t max_pause_us;
+};
+
 class GarbageCollector {
     public:
-    GarbageCollector() : gc_timer_(0) {}
+    explicit GarbageCollector(const GcPolicy& policy = GcPolicy());
 
+    /*
+    Called on every mutation. Collects in place if the policy asks for it,
+    unless collection runs in background.
+    */
     void Notify();
 
+    /*
+    Counts allocated nodes from now on. SAPPORO table is shared, so nodes
+    of other storages are not attributed to this one.
+    */
+    void Start();
+
+    bool ShouldCollect() const;
+
+    void Collect();
+
+    GcStats Stats() const;
+
+    const GcPolicy& Policy() const { return policy_; }
+
     private:
-    int gc_timer_;
+    GcPolicy policy_;
+    // written by the background thread, read inside `Set` and `Delete`
+    std::atomic<uint64_t> used_after_gc_;
+    std::atomic<uint64_t> runs_;
+    std::atomic<uint64_t> total_pause_us_;
+    std::atomic<uint64_t> max_pause_us_;
 };
 
 /*
 LockGuard for concurrent access.
 
-Accessing threads block zdd sequentially.
+Accessing threads block zdd sequentially. SAPPORO's node table and caches
+are process-wide, so the guard also holds one process-wide lock, and
+threads using different storages are serialized too. One thread may hold
+guards of several storages.
 */
 class LockGuard {
 public:
@@ -61,18 +146,191 @@ public:
 private:
     std::atomic<uint32_t>& curr_task_id_;
     std::atomic<uint32_t>& ready_task_id_;
+    std::unique_lock<std::recursive_mutex> sapporo_;
 };
 
 class Iterator;
+class FrozenIndex;
+
+enum class ReorderMethod {
+    /*
+    Tries every order of each three neighbouring token bits and keeps the
+    best one, until no window shrinks ZDD.
+    */
+    window,
+    /*
+    Moves every token bit through all positions and keeps it at the best
+    one.
+    */
+    sifting,
+};
+
+/*
+`swaps` counts neighbour swaps tried on the token model, not ZDD swaps.
+*/
+struct ReorderStats {
+    uint64_t nodes_before;
+    uint64_t nodes_after;
+    uint32_t swaps;
+};
+
+/*
+Location kept by `Storage::MergeFrom` for keys present in both storages,
+`min_level` and `max_level` compare their levels.
+*/
+enum class ConflictPolicy {
+    ours,
+    theirs,
+    min_level,
+    max_level,
+};
+
+struct MergeStats {
+    uint64_t added_keys;
+    uint64_t conflicts;
+};
+
+/*
+Called by `Storage::ParallelScan` workers with the index of the key range
+`key` belongs to.
+*/
+using ScanCallback =
+    std::function<void(uint32_t partition, const KeyLevelPair& key)>;
+
+struct OpCounters {
+    uint64_t sets;
+    uint64_t inserts;
+    uint64_t deletes;
+    uint64_t gets;
+    uint64_t get_hits;
+    uint64_t iterator_seeks;
+    uint64_t iterator_steps;
+};
+
+/*
+Storage snapshot for capacity planning. Byte counts are estimates: ZDD nodes
+live in the shared SAPPORO table, and level maps are sized by their layout.
+`scan_bytes` is held by the copies of column families made by
+`ParallelScan`, which are kept until the family changes and is scanned
+again. `compress_us` counts per-key compression only with `ZDDLSM_PROFILING`,
+otherwise just `BulkLoad`.
+*/
+struct StorageStats {
+    uint64_t live_keys;
+    uint64_t deleted_keys;
+    uint64_t zdd_nodes;
+    uint64_t zdd_bytes;
+    uint64_t data_entries;
+    uint64_t data_bytes;
+    uint64_t scan_bytes;
+    double bytes_per_key;
+    uint64_t compress_us;
+    GcStats gc;
+    OpCounters ops;
+
+    std::string ToString() const;
+    std::string ToJson() const;
+};
+
+enum class VarRegion {
+    data,
+    key,
+};
+
+/*
+Nodes labelled with one ZDD variable. `bit` is the token bit for data
+variables, LSB is 0, and the key bit position otherwise.
+*/
+struct LevelProfile {
+    uint32_t level;
+    VarRegion region;
+    uint32_t bit;
+    uint64_t nodes;
+};
+
+/*
+ZDD shape. `tree_nodes` is the size the ZDD would have without sharing,
+`fan_in[i]` counts nodes with [2^i, 2^(i+1)) parents. Nodes shared between
+column families are counted once in total and in each of them.
+*/
+struct ZddAnalysis {
+    uint64_t nodes;
+    uint64_t data_nodes;
+    uint64_t key_nodes;
+    double tree_nodes;
+    double sharing_ratio;
+    std::vector<LevelProfile> levels;
+    std::vector<uint64_t> fan_in;
+    std::map<uint32_t, uint64_t> nodes_per_cf;
+
+    std::string ToString() const;
+    std::string ToJson() const;
+};
+
+struct ColumnFamilyStats {
+    uint64_t live_keys;
+    uint64_t deleted_keys;
+    uint64_t zdd_nodes;
+    uint64_t zdd_bytes;
+    uint64_t data_bytes;
+    uint64_t scan_bytes;
+};
+
+struct Options {
+    /*
+    Enables column family overloads, otherwise they throw
+    `std::logic_error`.
+    */
+    bool column_families = true;
 
+    /*
+    ZDD node count which triggers `Storage::ReorderTokens` inside the
+    insertion that crosses it. The threshold doubles after every
+    reordering. 0 disables it.
+    */
+    uint64_t token_reorder_threshold = 0;
+
+    /*
+    Leading key bits resolved by a table of sub-ZDD roots per column
+    family, so that lookups start below them. The table has `2^bits`
+    entries, 9 covers the first key byte. 0 disables it.
+    */
+    uint32_t root_table_bits = 9;
+
+    GcPolicy gc;
+};
+
+/*
+Storages of one process are not isolated. They share SAPPORO's node table,
+operation cache and garbage collector: ZDD variables are created on demand
+for the widest key and `NodeCount` counts nodes of one storage, but GC run
+for one storage pauses all of them. SAPPORO is single-threaded, so storages
+used from several threads have to be accessed under `Lock`, which also
+serializes different storages; construction and destruction take the same
+process-wide lock.
+*/
 class Storage {
 public:
+    /*
+    Column family used by overloads without `cf_id`.
+    */
+    static constexpr uint32_t DEFAULT_CF = 0;
+
     Storage(uint32_t key_len,
-            Compression::compression type = Compression::compression::none);
+            Compression::compression type = Compression::compression::none,
+            const Options& options = Options());
+
+    /*
+    Uses caller-configured `compressor`, e.g. `FingerprintHasher` of
+    non-default width.
+    */
+    Storage(uint32_t key_len,
+            std::unique_ptr<Compression::ICompressor> compressor,
+            const Options& options = Options());
 
     LockGuard Lock();
 
-    ~Storage() = default;
+    ~Storage();
 
     void Print();
 
@@ -83,6 +341,17 @@ public:
 
     void Set(uint32_t cf_id, const std::string& key, uint32_t to_level);
 
+    /*
+    Sets `key` to `location`. Setting only a level clears file and block.
+    Levels take 4 bytes per key; a file or block hint adds an entry of a
+    side table, about 40 bytes, so storages that set only levels don't pay
+    for them.
+    */
+    void Set(const std::string& key, const KeyLocation& location);
+
+    void Set(uint32_t cf_id, const std::string& key,
+             const KeyLocation& location);
+
     /*
     Deletes `key`
     */
@@ -90,6 +359,82 @@ public:
 
     void Delete(uint32_t cf_id, const std::string& key);
 
+    /*
+    Deletes every key in [`begin`, `end`) with one ZDD difference and returns
+    their number. An empty `end` means no upper bound, as in `SampleKeys`.
+    Keys are compared as stored, like `Iterator` does, so with compression
+    the range is one of compressed keys.
+    */
+    uint64_t DeleteRange(const std::string& begin, const std::string& end);
+
+    uint64_t DeleteRange(uint32_t cf_id, const std::string& begin,
+                         const std::string& end);
+
+    /*
+    Deletes every key starting with `prefix` with one ZDD difference and
+    returns their number. As in `DeleteRange`, the prefix is matched against
+    stored keys.
+    */
+    uint64_t DeletePrefix(const std::string& prefix);
+
+    uint64_t DeletePrefix(uint32_t cf_id, const std::string& prefix);
+
+    /*
+    Sets levels of many keys at once, later duplicates win. Keys are
+    compressed and sorted on `threads` workers, all cores if 0, then ZDD
+    of new keys is built bottom-up from the sorted keys with one node per
+    split instead of a lookup and a path union per key. SAPPORO is
+    single-threaded, so the build itself runs on the calling thread.
+    */
+    void BulkLoad(const std::vector<std::pair<std::string, uint32_t>>& keys,
+                  uint32_t threads = 0);
+
+    void BulkLoad(uint32_t cf_id,
+                  const std::vector<std::pair<std::string, uint32_t>>& keys,
+                  uint32_t threads = 0);
+
+    /*
+    Copies all column families into an immutable `FrozenIndex`, e.g. once
+    their SST levels won't change. Later changes of the storage are not
+    seen by the copy. Include "frozen_index.h" to use it.
+    */
+    FrozenIndex Freeze() const;
+
+    /*
+    Every column family has its own ZDD root, which `Set` creates on demand.
+    Returns false if `cf_id` already exists.
+    */
+    bool CreateColumnFamily(uint32_t cf_id);
+
+    /*
+    Drops the root of `cf_id` and its levels without touching ZDD of other
+    column families. Returns the number of dropped keys.
+    */
+    uint64_t DropColumnFamily(uint32_t cf_id);
+
+    std::vector<uint32_t> ListColumnFamilies() const;
+
+    /*
+    Walks ZDD of every column family, nodes shared between them are counted
+    in each.
+    */
+    std::map<uint32_t, ColumnFamilyStats> GetColumnFamilyStats() const;
+
+    /*
+    Adds keys of every column family of `other` with one ZDD union per
+    column family. Keys present in both storages get the level chosen by
+    `policy`. Costs ZDD operations over both ZDDs, then a walk of the key
+    nodes of `other` which gives its keys the next tokens of this storage,
+    as sets would, and one level map insert per added key. Tokens stay
+    dense, so storages can be merged any number of times.
+
+    `other` must have the same key length and compression, otherwise
+    `std::invalid_argument` is thrown, and must not be modified meanwhile.
+    Traces record every key of `other` with its resulting location.
+    */
+    MergeStats MergeFrom(const Storage& other,
+                         ConflictPolicy policy = ConflictPolicy::theirs);
+
     /*
     Returns `std::optional` of current `level` of `key` or `std::nullopt` if
     there's not `key` in zdd.
@@ -98,41 +443,219 @@ public:
 
     std::optional<uint32_t> GetLevel(uint32_t cf_id, const std::string& key);
 
+    /*
+    Like `GetLevel`, with the file and block hint of `key`.
+    */
+    std::optional<KeyLocation> GetLocation(const std::string& key);
+
+    std::optional<KeyLocation> GetLocation(uint32_t cf_id,
+                                           const std::string& key);
+
+    /*
+    Number of keys less than `key`. Like iterator seeks, ranks are over
+    stored keys, so they follow user key order without compression only.
+    Costs one step per key bit once subtree sizes are cached.
+    */
+    uint64_t RankOf(const std::string& key);
+
+    uint64_t RankOf(uint32_t cf_id, const std::string& key);
+
+    /*
+    Key with `rank` keys less than it, or `std::nullopt` if there are not so
+    many keys.
+    */
+    std::optional<KeyLevelPair> KeyAtRank(uint64_t rank);
+
+    std::optional<KeyLevelPair> KeyAtRank(uint32_t cf_id, uint64_t rank);
+
+    /*
+    Up to `n` distinct keys of [`begin`, `end`) drawn uniformly, in key
+    order. An empty `end` means no upper bound. Equal seeds give equal
+    samples.
+    */
+    std::vector<KeyLevelPair> SampleKeys(uint32_t n, const std::string& begin,
+                                         const std::string& end,
+                                         uint64_t seed = 0);
+
+    std::vector<KeyLevelPair> SampleKeys(uint32_t cf_id, uint32_t n,
+                                         const std::string& begin,
+                                         const std::string& end,
+                                         uint64_t seed = 0);
+
+    /*
+    Splits keys into `partitions` ranges of equal size and scans them on as
+    many threads. Every range is passed in key order by one thread, lower
+    ranges hold lower keys, and `callback` must be thread-safe. SAPPORO is
+    single-threaded, so ZDD is first copied into a read-only array in one
+    pass, which workers then walk. The copy is kept with the column family
+    and reused by later scans until its keys change; levels are read at scan
+    time. The first exception of `callback` stops the scan and is rethrown.
+    Returns the number of scanned keys.
+    */
+    uint64_t ParallelScan(uint32_t partitions, const ScanCallback& callback);
+
+    uint64_t ParallelScan(uint32_t cf_id, uint32_t partitions,
+                          const ScanCallback& callback);
+
     bool IsEmpty();
 
     static bool IsEmpty(ZBDD store);
 
+    /*
+    Number of ZDD nodes used by this storage. Nodes are counted once, even
+    if SAPPORO shares them with other storages.
+    */
+    uint64_t NodeCount() const;
+
+    /*
+    Runs garbage collection if the policy asks for it, e.g. in idle periods.
+    Returns whether it ran.
+    */
+    bool MaybeCollect();
+
+    GcStats GetGcStats() const;
+
+    /*
+    Walks the whole ZDD to count nodes, so it is as expensive as a scan.
+    */
+    StorageStats GetStats() const;
+
+    /*
+    Walks the whole ZDD to profile nodes per level, sharing and fan-in.
+    */
+    ZddAnalysis Analyze() const;
+
+    /*
+    Graphviz description of the ZDD. Throws `std::length_error` if it has
+    more than `max_nodes` nodes.
+    */
+    std::string ToDot(uint64_t max_nodes = 1000) const;
+
+    /*
+    Phase latencies and ZDD work counters, filled only in builds with
+    `ZDDLSM_PROFILING`.
+    */
+    const Profiler& GetProfile() const { return profiler_; }
+
+    /*
+    Records public Set, Delete, GetLevel and iterator operations to `path`
+    until `StopTrace`, e.g. to replay them with `TraceReplayer` or
+    `zddlsm_replay`. The header keeps the compression. Throws
+    `std::runtime_error` if `path` can't be opened.
+    */
+    void StartTrace(const std::string& path);
+
+    void StopTrace();
+
+    uint32_t Size() const { return size_; }
+    uint32_t Deleted() const { return deleted_; }
+
+    /*
+    Reorders token bits to shrink the token part of ZDD, e.g. once merges
+    spread tokens over many bits. Key bits keep their order, since
+    iteration, ranges and root tables rely on it, so sharing between keys
+    with common prefixes is not affected.
+
+    Sizes are counted on live tokens, recounting two bits per tried swap,
+    so a step costs O(keys) and doesn't touch ZDD; ZDD is permuted once at
+    the end. Invalidates iterators.
+    */
+    ReorderStats ReorderTokens(ReorderMethod method = ReorderMethod::sifting);
+
 private:
     /*
-    Internal representation of a key. Contains column family information.
+    Internal representation of a key. Column family selects the ZDD root and
+    is not a part of the key bits.
+
+    Bits are numbered from the top of ZDD, `byte_bits` per key byte. With 9
+    bits the first bit of every byte is a marker, so key length is explicit
+    and `"a"` differs from `"a\0"`. Keys of fixed-width compressors have
+    implicit length and take 8 bits per byte. Bits past the end of the key
+    are zero and cost nothing in ZDD.
 
     Be sure that `key` lifetime is longer that its ZDD internal representation.
     */
     class InternalKey {
     public:
-        InternalKey(const std::string& key,
-                    const Compression::ICompressor& compressor);
-
         InternalKey(const std::string& key, uint32_t cf_id,
-                    const Compression::ICompressor& compressor);
+                    const Compression::ICompressor& compressor,
+                    uint32_t byte_bits);
 
         const std::string& UserKey() const { return key_; }
 
         uint32_t CfID() const { return cf_id_; }
 
-        char operator[](uint32_t index) const;
+        bool Bit(uint32_t pos) const;
+
+        /*
+        Number of bits up to the last key byte, all further bits are zero.
+        */
+        uint32_t BitLen() const { return total_size_; }
+
+        /*
+        Key bytes as they are stored, after compression.
+        */
+        const std::string& StoredKey() const { return ikey_; }
 
     private:
         const std::string& key_;
         std::string ikey_;
         uint32_t cf_id_;
+        uint32_t byte_bits_;
         uint32_t total_size_;
-        bool has_cf_;
     };
 
-    ZBDD store_;
-    std::unordered_map<uint64_t, uint32_t> data_;
-    std::unique_ptr<Compression::ICompressor> compressor_;
+    /*
+    Read-only copy of a ZDD node. Children are indices of the copy,
+    `FLAT_EMPTY` and `FLAT_SINGLE` stand for the terminals.
+    */
+    struct FlatNode {
+        bddvar var;
+        int level;
+        uint32_t children[2];
+        uint64_t keys;
+    };
+
+    constexpr static uint32_t FLAT_EMPTY = 0;
+    constexpr static uint32_t FLAT_SINGLE = 1;
+
+    /*
+    SST file and block hint of a key, kept apart from its level.
+    */
+    struct FileHint {
+        uint64_t file_number;
+        uint32_t block_hint;
+    };
+
+    /*
+    ZDD root and levels of one column family. `data` maps key tokens to
+    levels, `hints` maps tokens of keys set with a file or block to them.
+    */
+    struct ColumnFamily {
+        ZBDD root;
+        std::unordered_map<uint64_t, uint32_t> data;
+        uint32_t deleted;
+        std::unordered_map<uint64_t, FileHint> hints = {};
+        /*
+        Sub-ZDDs of keys by their first `root_table_bits_` bits. It is
+        current while `table_root` is `root`, otherwise the next lookup
+        rebuilds it. Writes update the entries of prefixes they touch.
+        */
+        std::vector<ZBDD> root_table = {};
+        ZBDD table_root = bddempty;
+        /*
+        Read-only copy of `root` walked by `ParallelScan`, `flat_top` is the
+        index of the root. It is current while `flat_root` is `root`, so
+        scans of an unchanged column family reuse it.
+        */
+        std::vector<FlatNode> flat = {};
+        uint32_t flat_top = FLAT_EMPTY;
+        ZBDD flat_root = bddempty;
+    };
+
+    uint32_t key_len_;
+    std::unordered_map<uint32_t, ColumnFamily> families_;
+    std::shared_ptr<const Compression::ICompressor> compressor_;
     GarbageCollector gc_;
 
     uint64_t current_token_;
@@ -140,20 +663,217 @@ private:
     uint32_t deleted_;
 
     uint32_t key_bit_len_;
+    uint32_t key_byte_bits_;
+    bool column_families_;
 
     std::atomic<uint32_t> curr_task_id_;
     std::atomic<uint32_t> ready_task_id_;
 
     std::vector<bddvar> nz_zdd_vars_;
 
+    /*
+    Variable order. Logical bits are numbered as variables of the initial
+    order: token bits from MSB (1) to LSB (64), then key bits bottom-up.
+    */
+    std::vector<bddvar> bit_var_;
+    std::vector<uint32_t> var_bit_;
+    uint64_t reorder_threshold_;
+    uint32_t root_table_bits_;
+
+    mutable OpCounters ops_;
+    mutable uint64_t compress_ns_;
+    mutable Profiler profiler_;
+
+    std::unique_ptr<TraceWriter> trace_;
+    // names iterators in traces
+    uint64_t next_iterator_id_;
+
+    void Trace(TraceOp op, bool has_cf, uint32_t cf_id,
+               const std::string& key, uint32_t level = 0,
+               const std::string& end_key = std::string(),
+               uint64_t file_number = 0, uint32_t block_hint = 0) {
+        if (trace_ != nullptr) {
+            trace_->Record(TraceRecord{op, has_cf, cf_id, level, 0, key,
+                                       end_key, file_number, block_hint, 0,
+                                       0});
+        }
+    }
+
+    /*
+    ZDD node reached while analyzing. Only non-terminal children are
+    collected themselves.
+    */
+    struct AnalyzedNode {
+        bddvar var;
+        bddword children[2];
+        uint64_t fan_in;
+    };
+
+    /*
+    Nodes reachable from the roots of all column families.
+    */
+    std::unordered_map<bddword, AnalyzedNode> CollectNodes() const;
+
+    /*
+    Number of distinct nodes under `roots`.
+    */
+    static uint64_t CountNodes(const std::vector<ZBDD>& roots);
+
+    /*
+    Number of keys under `family`. Counts of key nodes are cached with the
+    nodes pinned, so cached IDs are never reused; the cache is dropped when
+    it outgrows the ZDD twice.
+    */
+    uint64_t CountKeys(const ZBDD& family);
+
+    std::unordered_map<bddword, std::pair<ZBDD, uint64_t>> key_counts_;
+    uint64_t key_counts_limit_;
+
+    uint64_t RankOfImpl(uint32_t cf_id, const std::string& key);
+
+    std::optional<KeyLevelPair> KeyAtRankImpl(uint32_t cf_id, uint64_t rank);
+
+    std::vector<KeyLevelPair> SampleKeysImpl(uint32_t cf_id, uint32_t n,
+                                             const std::string& begin,
+                                             const std::string& end,
+                                             uint64_t seed);
+
+    /*
+    Copies `node` into `flat` once, returns its index.
+    */
+    uint32_t Flatten(const ZBDD& node, std::vector<FlatNode>& flat,
+                     std::unordered_map<bddword, uint32_t>& index) const;
+
+    /*
+    Passes keys of `flat` with ranks in [`from`, `to`) to `callback`.
+    */
+    void ScanFlat(const std::vector<FlatNode>& flat, uint32_t root,
+                  const std::unordered_map<uint64_t, uint32_t>& data,
+                  uint64_t from, uint64_t to, uint32_t partition,
+                  const ScanCallback& callback,
+                  const std::atomic<bool>& stop) const;
+
+    uint64_t ParallelScanImpl(uint32_t cf_id, uint32_t partitions,
+                              const ScanCallback& callback);
+
+    void BulkLoadImpl(uint32_t cf_id,
+                      const std::vector<std::pair<std::string, uint32_t>>& keys,
+                      uint32_t threads);
+
+    /*
+    ZDD of keys `order[from, to)`, sorted and distinct, which share bits
+    before `pos`. The key at `order[i]` gets token `first_token + i`.
+    */
+    ZBDD BuildSorted(const std::vector<std::optional<InternalKey>>& ikeys,
+                     const std::vector<uint32_t>& order, size_t from,
+                     size_t to, uint32_t pos, uint64_t first_token);
+
+    /*
+    Sets bit of key variable `var`, or key bit `pos`, in `key`, which grows
+    as needed.
+    */
+    void AppendKeyBit(std::string& key, bddvar var) const;
+
+    static void AppendKeyPos(std::string& key, uint32_t pos,
+                             uint32_t byte_bits);
+
+    /*
+    Restores trailing zero bytes of a fixed-width `key` made of key bits.
+    */
+    static void PadKey(std::string& key, uint32_t key_bit_len,
+                       uint32_t byte_bits);
+
+    /*
+    Root of `cf_id`, or the empty family if there's no such column family.
+    */
+    ZBDD RootOf(uint32_t cf_id) const;
+
+    /*
+    Column family of `cf_id`, created if it doesn't exist.
+    */
+    ColumnFamily& FamilyFor(uint32_t cf_id);
+
+    VarRegion RegionOf(bddvar var) const;
+
+    /*
+    `root` of `other` with variables moved to the order of this storage.
+    */
+    ZBDD InOurOrder(const Storage& other, ZBDD root) const;
+
+    /*
+    Gives keys under `node` the next tokens in key order and returns their
+    paths below `node`'s top. Old and new tokens go to `renumbered`.
+    */
+    ZBDD Renumber(const ZBDD& node,
+                  std::vector<std::pair<uint64_t, uint64_t>>& renumbered);
+
+    /*
+    Appends stored keys under `root` of column family `cf_id` to `keys`.
+    */
+    void StoredKeys(uint32_t cf_id, ZBDD root,
+                    std::vector<std::pair<uint32_t, std::string>>& keys) const;
+
+    /*
+    Walks `ours` and `theirs`, roots of `family` and of `other`, in step and
+    sets levels of keys present in both. Returns paths of such keys in
+    `theirs` and adds their tokens to `dropped`. Key nodes are never shared
+    (see `FrozenIndex`), so the walk is bounded by the smaller ZDD.
+    */
+    ZBDD MergeConflicts(ZBDD ours, ZBDD theirs, const ColumnFamily& other,
+                        ColumnFamily& family, ConflictPolicy policy,
+                        std::unordered_set<uint64_t>& dropped);
+
+    std::thread gc_thread_;
+    std::mutex gc_mutex_;
+    std::condition_variable gc_cv_;
+    bool gc_stop_;
+
+    void BackgroundCollect();
+
     bool ProcessZddNode(ZBDD& zdd, int& stack_pointer, int top_var_n);
 
+    /*
+    Collects levels of non-zero key bits with positions below `prefix_len`.
+    */
     void GetNzZddVars(const InternalKey& zdd_ikey,
                       uint32_t prefix_len = 0xFFFFFFFF);
 
-    static inline ZBDD Child(const ZBDD& n, const int child_num);
+    /*
+    ZDD variable of key bit `pos`.
+    */
+    inline bddvar KeyVar(uint32_t pos) const;
+
+    inline uint32_t KeyPos(bddvar var) const;
+
+    /*
+    Index of token bit stored in `var`, LSB is 0.
+    */
+    inline uint32_t TokenBit(bddvar var) const;
+
+    /*
+    Moves token bit `order[i]` to variable `vars[i]`. Bits of `order` are
+    held by `vars` in some order.
+    */
+    void ApplyTokenOrder(const std::vector<bddvar>& vars,
+                         const std::vector<uint32_t>& order);
+
+    InternalKey MakeKey(uint32_t cf_id, const std::string& key,
+                        const Compression::ICompressor& compressor) const;
 
-    inline ZBDD LSMKeyTransform(const InternalKey& key, uint32_t lsm_lev);
+    void CheckColumnFamilies() const;
+
+    inline ZBDD Child(const ZBDD& n, const int child_num) const;
+
+    /*
+    Token part of a key path.
+    */
+    inline ZBDD TokenPath(uint64_t token) const;
+
+    /*
+    Path of `key` with `token`, built from key bit `from_pos` down.
+    */
+    inline ZBDD LSMKeyTransform(const InternalKey& key, uint64_t token,
+                                uint32_t from_pos = 0);
 
     std::optional<ZBDD> GetSubZDDbyKey(const InternalKey& key,
                                        uint32_t prefix_len = 0xFFFFFFFF);
@@ -166,17 +886,114 @@ private:
 
     std::optional<uint32_t> GetLevelNoCompr(uint32_t cf_id, const std::string& key);
 
-    void SetImpl(const InternalKey& ikey, uint32_t to_level);
+    void SetImpl(const InternalKey& ikey, const KeyLocation& location);
+
+    /*
+    Stores `location` of `token`, its file and block only if there are any.
+    */
+    static void SetToken(ColumnFamily& family, uint64_t token,
+                         const KeyLocation& location);
+
+    static void EraseToken(ColumnFamily& family, uint64_t token);
+
+    static KeyLocation LocationOf(const ColumnFamily& family, uint64_t token);
 
     void DeleteImpl(const InternalKey& ikey);
 
-    std::optional<uint32_t> GetLevelImpl(const InternalKey& ikey);
+    uint64_t DeleteRangeImpl(uint32_t cf_id, const std::string& begin,
+                             const std::string& end);
 
-    uint32_t Size() const { return size_; }
-    uint32_t Deleted() const { return deleted_; }
+    uint64_t DeletePrefixImpl(uint32_t cf_id, const std::string& prefix);
+
+    /*
+    Subtracts `keys`, a sub-family of the root of `cf_id`, and frees their
+    levels. Returns the number of removed keys.
+    */
+    uint64_t RemoveKeys(uint32_t cf_id, ZBDD keys);
+
+    /*
+    Keys of `family` less than `bound`. Costs one step per bit of `bound`.
+    */
+    ZBDD KeysLessThan(ZBDD family, const InternalKey& bound) const;
+
+    /*
+    Adds bits [0, `prefix_len`) of `prefix` to every set of `family`.
+    */
+    ZBDD WithPrefix(ZBDD family, const InternalKey& prefix,
+                    uint32_t prefix_len) const;
+
+    /*
+    First `root_table_bits_` bits of `ikey`, the index of its root table
+    entry.
+    */
+    uint32_t TablePrefix(const InternalKey& ikey) const;
+
+    /*
+    Root table entry of `ikey`, the table is rebuilt if it is stale.
+    */
+    ZBDD TableEntry(ColumnFamily& family, const InternalKey& ikey);
+
+    void BuildRootTable(ColumnFamily& family);
+
+    /*
+    Appends non-empty sub-ZDDs of `node` below its first `root_table_bits_`
+    bits to `entries` with their prefixes.
+    */
+    void TableEntries(const ZBDD& node, uint32_t pos, uint32_t prefix,
+                      std::vector<std::pair<uint32_t, ZBDD>>& entries) const;
+
+    /*
+    Adds or removes `paths`, whole keys of `family`, and keeps its root
+    table current if it is: only entries of prefixes in `paths` change.
+    */
+    void UpdateRoot(ColumnFamily& family, const ZBDD& paths, bool add);
+
+    /*
+    Adds or removes the path of `ikey` with `token` and keeps the root
+    table of `family` current if it is.
+    */
+    void AddPath(ColumnFamily& family, const InternalKey& ikey,
+                 uint64_t token);
+
+    void RemovePath(ColumnFamily& family, const InternalKey& ikey,
+                    uint64_t token);
+
+    /*
+    Sets distinct `keys` with one ZDD union of their paths.
+    */
+    void SetMany(const std::vector<std::pair<InternalKey, uint32_t>>& keys);
+
+    /*
+    Deletes distinct `keys` with one ZDD difference.
+    */
+    void DeleteMany(const std::vector<InternalKey>& keys);
+
+    /*
+    Reorders if `Options::token_reorder_threshold` is crossed by insertions since
+    the size was `size_before`.
+    */
+    void MaybeReorder(uint32_t size_before);
+
+    std::optional<uint64_t> GetLevelImpl(const InternalKey& ikey);
+
+    /*
+    Location of `ikey` from locations of its column family.
+    */
+    std::optional<KeyLocation> FindLocation(const InternalKey& ikey);
+
+    std::optional<uint32_t> FindLevel(const InternalKey& ikey);
+
+    /*
+    Reads token of a key from its data sub-ZDD.
+    */
+    std::optional<uint64_t> ReadToken(ZBDD data_zdd) const;
 
     friend class Iterator;
+    friend class FrozenIndex;
+    friend class FrozenIterator;
     friend class ShardedStorage;
+    friend class AsyncStorage;
+    friend class TraceReplayer;
 };
 
 class Iterator {
@@ -192,25 +1009,51 @@ public:
 
     bool HasNext() const;
 
+    /*
+    Moves `n` keys forward, or to the end, in one descent driven by subtree
+    sizes instead of `n` steps.
+    */
+    void SkipN(uint64_t n);
+
 private:
+    /*
+    Node on the path from the root to the current key. `right` is set if the
+    path goes through its 1-branch.
+    */
     struct ZddNode {
-        ZBDD anc;
+        ZBDD zdd;
         int level;
-        bool left;
         bool right;
     };
 
     ZBDD curr_zdd_;
     std::deque<ZddNode> nodes_;
     Storage* zdd_;
+    uint32_t cf_id_;
+    bool has_cf_;
+    uint64_t trace_id_;
     bool end_;
 
-    void Init(const std::string& key, ZBDD& initial_zdd);
+    void Trace(TraceOp op, const std::string& key, uint64_t count = 0) const;
 
-    bool TraverseNode(ZddNode*& curr_node, ZBDD& current_zdd, int& curr_level,
-                      int& stack_pointer, std::vector<bddvar>& nz_zdd_vars);
+    /*
+    Positions iterator at the first key not less than `key`.
+    */
+    void Init(const std::string& key);
+
+    /*
+    Goes down to the least key of `current_zdd`. Returns false if it's empty.
+    */
+    bool Descend(ZBDD current_zdd);
 
-    void UpdateCurrentNode(ZddNode*& curr_node, ZBDD& current_zdd,
-                           int& curr_level);
+    /*
+    Moves to the least key greater than all keys below the current path.
+    */
+    void Advance();
+
+    /*
+    Positions iterator at the key with `rank` keys less than it.
+    */
+    void SeekRank(uint64_t rank);
 };
 }  // namespace ZDDLSM
@@ -0,0 +1,87 @@
+#include "include/profiler.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <sstream>
+
+namespace {
+constexpr static const char* PHASE_NAMES[] = {
+    "encode", "descent", "path_build", "update", "gc", "iterator_next",
+};
+
+constexpr static double PERCENTILES[] = {50, 99, 99.9};
+}  // namespace
+
+namespace ZDDLSM {
+uint32_t LatencyHistogram::BucketOf(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+
+    // `ns` is in [2^exp, 2^(exp + 1)), split into `SUB_BUCKETS` parts
+    uint32_t exp = std::bit_width(ns) - 1;
+    uint32_t shift = exp - std::bit_width(SUB_BUCKETS - 1);
+    uint32_t bucket = (exp - std::bit_width(SUB_BUCKETS - 1) + 1) * SUB_BUCKETS +
+                      (ns >> shift) - SUB_BUCKETS;
+    return std::min(bucket, SUB_BUCKETS * MAGNITUDES - 1);
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(uint32_t bucket) {
+    uint32_t magnitude = bucket / SUB_BUCKETS;
+    uint64_t sub_bucket = bucket % SUB_BUCKETS;
+    if (magnitude == 0) {
+        return sub_bucket;
+    }
+    return ((SUB_BUCKETS + sub_bucket + 1) << (magnitude - 1)) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns) {
+    ++buckets_[BucketOf(ns)];
+    ++count_;
+    total_ns_ += ns;
+    max_ = std::max(max_, ns);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    for (uint32_t bucket = 0; bucket != buckets_.size(); ++bucket) {
+        buckets_[bucket] += other.buckets_[bucket];
+    }
+    count_ += other.count_;
+    total_ns_ += other.total_ns_;
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(p / 100 * count_));
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket != buckets_.size(); ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= rank) {
+            return std::min(BucketUpperBound(bucket), max_);
+        }
+    }
+    return max_;
+}
+
+std::string Profiler::ToString() const {
+    std::ostringstream out;
+    for (uint32_t phase = 0; phase != PHASES_NUMBER; ++phase) {
+        const LatencyHistogram& histogram = histograms_[phase];
+        out << PHASE_NAMES[phase] << ": " << histogram.Count() << " samples";
+        for (double p : PERCENTILES) {
+            out << ", p" << p << " " << histogram.Percentile(p) << " ns";
+        }
+        out << ", max " << histogram.Max() << " ns\n";
+    }
+    out << "nodes visited: " << counters_.nodes_visited
+        << ", Child: " << counters_.child_calls
+        << ", OnSet: " << counters_.onset_calls
+        << ", OffSet: " << counters_.offset_calls << "\n";
+    return out.str();
+}
+}  // namespace ZDDLSM
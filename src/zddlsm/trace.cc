@@ -0,0 +1,250 @@
+#include "include/trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+constexpr static char TRACE_MAGIC[] = {'Z', 'D', 'D', 'T'};
+constexpr static uint8_t TRACE_VERSION = 2;
+
+/*
+Record flags, stored next to the operation.
+*/
+constexpr static uint8_t FLAG_HAS_CF = 1;
+
+constexpr static uint8_t VARINT_PAYLOAD_BITS = 7;
+constexpr static uint8_t VARINT_CONTINUE = 0x80;
+
+bool IsIteratorOp(ZDDLSM::TraceOp op) {
+    return op == ZDDLSM::TraceOp::iterator_seek ||
+           op == ZDDLSM::TraceOp::iterator_next ||
+           op == ZDDLSM::TraceOp::iterator_skip;
+}
+
+bool HasLocation(ZDDLSM::TraceOp op) {
+    return op == ZDDLSM::TraceOp::set_location ||
+           op == ZDDLSM::TraceOp::merge_key;
+}
+
+bool HasLevel(ZDDLSM::TraceOp op) {
+    return op == ZDDLSM::TraceOp::set || HasLocation(op);
+}
+
+bool HasKey(ZDDLSM::TraceOp op) {
+    return op != ZDDLSM::TraceOp::iterator_next &&
+           op != ZDDLSM::TraceOp::iterator_skip &&
+           op != ZDDLSM::TraceOp::drop_column_family;
+}
+}  // namespace
+
+namespace ZDDLSM {
+TraceHeader TraceHeader::Of(uint32_t key_len, bool column_families,
+                            const Compression::ICompressor& compressor) {
+    TraceHeader header{key_len, column_families, compressor.Type(),
+                       compressor.BytesNeeds(key_len), 0, std::string()};
+    if (const auto* zstd =
+            dynamic_cast<const Compression::ZstdCompressor*>(&compressor)) {
+        header.zstd_level = zstd->Level();
+        header.zstd_dictionary = zstd->Dictionary();
+    }
+    return header;
+}
+
+std::unique_ptr<Compression::ICompressor> TraceHeader::BuildCompressor()
+    const {
+    switch (compression) {
+        case Compression::compression::zstd:
+            return std::make_unique<Compression::ZstdCompressor>(
+                zstd_dictionary, zstd_level);
+        case Compression::compression::fingerprint:
+            return std::make_unique<Compression::FingerprintHasher>(
+                stored_len * 8);
+        default:
+            return Compression::BuildCompressor(compression);
+    }
+}
+
+TraceWriter::TraceWriter(const std::string& path, const TraceHeader& header)
+    : out_(path, std::ios::binary | std::ios::trunc),
+      start_(std::chrono::steady_clock::now()),
+      last_ns_(0) {
+    if (!out_) {
+        throw std::runtime_error("can't open trace " + path);
+    }
+
+    out_.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    out_.put(TRACE_VERSION);
+    out_.put(header.column_families ? 1 : 0);
+    WriteVarint(header.key_len);
+    out_.put(static_cast<char>(header.compression));
+    WriteVarint(header.stored_len);
+    WriteVarint(static_cast<uint32_t>(header.zstd_level));
+    WriteVarint(header.zstd_dictionary.size());
+    out_.write(header.zstd_dictionary.data(), header.zstd_dictionary.size());
+}
+
+void TraceWriter::WriteVarint(uint64_t value) {
+    while (value >= VARINT_CONTINUE) {
+        out_.put(static_cast<char>(value | VARINT_CONTINUE));
+        value >>= VARINT_PAYLOAD_BITS;
+    }
+    out_.put(static_cast<char>(value));
+}
+
+void TraceWriter::Record(const TraceRecord& record) {
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count();
+
+    out_.put(static_cast<char>(record.op));
+    out_.put(record.has_cf ? FLAG_HAS_CF : 0);
+    WriteVarint(now_ns - last_ns_);
+    last_ns_ = now_ns;
+
+    if (record.has_cf) {
+        WriteVarint(record.cf_id);
+    }
+    if (HasLevel(record.op)) {
+        WriteVarint(record.level);
+    }
+    if (HasLocation(record.op)) {
+        WriteVarint(record.file_number);
+        WriteVarint(record.block_hint);
+    }
+    if (HasKey(record.op)) {
+        WriteVarint(record.key.size());
+        out_.write(record.key.data(), record.key.size());
+    }
+    if (record.op == TraceOp::delete_range) {
+        WriteVarint(record.end_key.size());
+        out_.write(record.end_key.data(), record.end_key.size());
+    }
+    if (IsIteratorOp(record.op)) {
+        WriteVarint(record.iterator_id);
+    }
+    if (record.op == TraceOp::iterator_skip) {
+        WriteVarint(record.count);
+    }
+}
+
+TraceReader::TraceReader(const std::string& path)
+    : in_(path, std::ios::binary),
+      header_{0, false, Compression::compression::none, 0, 0, std::string()},
+      time_ns_(0) {
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!in_.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC) ||
+        in_.get() != TRACE_VERSION) {
+        throw std::runtime_error(path + " is not a zddlsm trace");
+    }
+
+    header_.column_families = in_.get() != 0;
+    uint64_t key_len = 0;
+    if (!ReadVarint(key_len)) {
+        throw std::runtime_error(path + " is not a zddlsm trace");
+    }
+    header_.key_len = key_len;
+
+    int compression = in_.get();
+    uint64_t stored_len = 0;
+    uint64_t zstd_level = 0;
+    if (compression == std::char_traits<char>::eof() ||
+        compression > static_cast<int>(Compression::compression::fingerprint) ||
+        !ReadVarint(stored_len) || !ReadVarint(zstd_level) ||
+        !ReadString(header_.zstd_dictionary)) {
+        throw std::runtime_error(path + " has a truncated trace header");
+    }
+    header_.compression = static_cast<Compression::compression>(compression);
+    header_.stored_len = stored_len;
+    header_.zstd_level = static_cast<int32_t>(zstd_level);
+}
+
+bool TraceReader::ReadVarint(uint64_t& value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += VARINT_PAYLOAD_BITS) {
+        int byte = in_.get();
+        if (byte == std::char_traits<char>::eof()) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & ~VARINT_CONTINUE) << shift;
+        if ((byte & VARINT_CONTINUE) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TraceReader::ReadString(std::string& value) {
+    uint64_t size = 0;
+    if (!ReadVarint(size)) {
+        return false;
+    }
+    value.resize(size);
+    return static_cast<bool>(in_.read(value.data(), size));
+}
+
+bool TraceReader::Next(TraceRecord& record) {
+    int op = in_.get();
+    if (op == std::char_traits<char>::eof()) {
+        return false;
+    }
+
+    int flags = in_.get();
+    uint64_t delta_ns = 0;
+    if (flags == std::char_traits<char>::eof() || !ReadVarint(delta_ns)) {
+        throw std::runtime_error("truncated trace record");
+    }
+
+    record.op = static_cast<TraceOp>(op);
+    record.has_cf = (flags & FLAG_HAS_CF) != 0;
+    time_ns_ += delta_ns;
+    record.time_ns = time_ns_;
+
+    uint64_t value = 0;
+    record.cf_id = 0;
+    if (record.has_cf) {
+        if (!ReadVarint(value)) {
+            throw std::runtime_error("truncated trace record");
+        }
+        record.cf_id = value;
+    }
+
+    record.level = 0;
+    if (HasLevel(record.op)) {
+        if (!ReadVarint(value)) {
+            throw std::runtime_error("truncated trace record");
+        }
+        record.level = value;
+    }
+
+    record.file_number = 0;
+    record.block_hint = 0;
+    if (HasLocation(record.op)) {
+        if (!ReadVarint(record.file_number) || !ReadVarint(value)) {
+            throw std::runtime_error("truncated trace record");
+        }
+        record.block_hint = value;
+    }
+
+    record.key.clear();
+    if (HasKey(record.op) && !ReadString(record.key)) {
+        throw std::runtime_error("truncated trace record");
+    }
+
+    record.end_key.clear();
+    if (record.op == TraceOp::delete_range && !ReadString(record.end_key)) {
+        throw std::runtime_error("truncated trace record");
+    }
+
+    record.iterator_id = 0;
+    if (IsIteratorOp(record.op) && !ReadVarint(record.iterator_id)) {
+        throw std::runtime_error("truncated trace record");
+    }
+
+    record.count = 0;
+    if (record.op == TraceOp::iterator_skip && !ReadVarint(record.count)) {
+        throw std::runtime_error("truncated trace record");
+    }
+    return true;
+}
+}  // namespace ZDDLSM
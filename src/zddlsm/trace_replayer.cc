@@ -0,0 +1,116 @@
+#include "include/trace_replayer.h"
+
+#include <stdexcept>
+
+namespace ZDDLSM {
+TraceReplayer::TraceReplayer(Storage& storage, const TraceHeader& header)
+    : storage_(storage) {
+    if (storage_.column_families_ != header.column_families ||
+        storage_.key_len_ != header.key_len ||
+        storage_.compressor_->Type() != header.compression ||
+        storage_.compressor_->BytesNeeds(header.key_len) !=
+            header.stored_len) {
+        throw std::invalid_argument(
+            "storage doesn't match the traced storage");
+    }
+}
+
+void TraceReplayer::Seek(const TraceRecord& record) {
+    iterators_.erase(record.iterator_id);
+    auto [it, inserted] =
+        record.has_cf
+            ? iterators_.try_emplace(record.iterator_id, &storage_,
+                                     record.cf_id, record.key)
+            : iterators_.try_emplace(record.iterator_id, &storage_,
+                                     record.key);
+    if (!it->second.HasNext()) {
+        iterators_.erase(it);
+    }
+}
+
+void TraceReplayer::Step(const TraceRecord& record) {
+    auto it = iterators_.find(record.iterator_id);
+    if (it == iterators_.end()) {
+        return;
+    }
+    if (record.op == TraceOp::iterator_skip) {
+        it->second.SkipN(record.count);
+    } else {
+        it->second.Next();
+    }
+    if (!it->second.HasNext()) {
+        iterators_.erase(it);
+    }
+}
+
+void TraceReplayer::Apply(const TraceRecord& record) {
+    switch (record.op) {
+        case TraceOp::set:
+            if (record.has_cf) {
+                storage_.Set(record.cf_id, record.key, record.level);
+            } else {
+                storage_.Set(record.key, record.level);
+            }
+            break;
+        case TraceOp::del:
+            if (record.has_cf) {
+                storage_.Delete(record.cf_id, record.key);
+            } else {
+                storage_.Delete(record.key);
+            }
+            break;
+        case TraceOp::get_level:
+            if (record.has_cf) {
+                storage_.GetLevel(record.cf_id, record.key);
+            } else {
+                storage_.GetLevel(record.key);
+            }
+            break;
+        case TraceOp::iterator_seek:
+            Seek(record);
+            break;
+        case TraceOp::iterator_next:
+        case TraceOp::iterator_skip:
+            Step(record);
+            break;
+        case TraceOp::delete_range:
+            if (record.has_cf) {
+                storage_.DeleteRange(record.cf_id, record.key, record.end_key);
+            } else {
+                storage_.DeleteRange(record.key, record.end_key);
+            }
+            break;
+        case TraceOp::delete_prefix:
+            if (record.has_cf) {
+                storage_.DeletePrefix(record.cf_id, record.key);
+            } else {
+                storage_.DeletePrefix(record.key);
+            }
+            break;
+        case TraceOp::set_location: {
+            KeyLocation location{record.level, record.block_hint,
+                                 record.file_number};
+            if (record.has_cf) {
+                storage_.Set(record.cf_id, record.key, location);
+            } else {
+                storage_.Set(record.key, location);
+            }
+            break;
+        }
+        case TraceOp::merge_key: {
+            // the key is stored as is, whatever the compression
+            Storage::InternalKey ikey(record.key, record.cf_id,
+                                      Compression::NoCompression(),
+                                      storage_.key_byte_bits_);
+            storage_.SetImpl(ikey, KeyLocation{record.level, record.block_hint,
+                                               record.file_number});
+            break;
+        }
+        case TraceOp::drop_column_family:
+            storage_.DropColumnFamily(record.cf_id);
+            break;
+        default:
+            throw std::runtime_error("unknown trace operation");
+    }
+}
+}  // namespace ZDDLSM
@@ -1,5 +1,7 @@
 #include "include/zddlsm.h"
 
+#include "include/frozen_index.h"
+
 namespace {
 
 /*
@@ -9,87 +11,335 @@ SAPPORO.
 constexpr static uint32_t ZDD_INIT_SIZE = 4096;
 constexpr static uint32_t BITS_IN_BYTE = 8;
 constexpr static int DATA_BIT_LEN = sizeof(uint64_t) * BITS_IN_BYTE;
-constexpr static int BITS_FOR_VAL = sizeof(char) * BITS_IN_BYTE;
+
 constexpr static int SHARDS_DEFAULT_NUMBER = 1000;
-constexpr static int GC_MAX_TIMER = 2000;
 
 /*
-Bits for column family information and for other purposes.
+Collection never starts before that many nodes were allocated since the
+previous one, so that a table which GC cannot shrink is not collected on
+every mutation.
+*/
+constexpr static uint64_t GC_MIN_ALLOCATED = 1 << 16;
+
+/*
+Number of insertions between checks of `Options::token_reorder_threshold`.
+*/
+constexpr static uint32_t REORDER_CHECK_PERIOD = 1024;
+
+/*
+Sifting stops moving a variable in one direction once ZDD grows that much.
+*/
+constexpr static double SIFTING_MAX_GROWTH = 1.2;
+
+/*
+Bytes of variable-width keys are encoded with a leading marker bit and 8
+data bits. Fixed-width keys take 8 bits per byte.
+*/
+constexpr static uint32_t BITS_PER_KEY_BYTE = BITS_IN_BYTE + 1;
+
+/*
+Root tables larger than that are mostly empty entries.
+*/
+constexpr static uint32_t MAX_ROOT_TABLE_BITS = 20;
+
+/*
+Approximate size of a 64-bit SAPPORO node together with its share of the
+unique table.
+*/
+constexpr static uint64_t ZDD_NODE_BYTES = 24;
+
+/*
+Cached subtree sizes are kept until there are that many of them, or twice
+as many as ZDD nodes at the last drop.
 */
-constexpr static uint32_t ZDD_ADDITIONAL_BITS = 32;
+constexpr static uint64_t KEY_COUNTS_MIN_LIMIT = 1 << 16;
+
+/*
+Approximate heap size of a token map.
+*/
+template <typename Map>
+uint64_t DataBytes(const Map& data) {
+    return data.size() * (sizeof(typename Map::value_type) + sizeof(void*)) +
+           data.bucket_count() * sizeof(void*);
+}
 
-std::string GetMinKey(size_t key_bit_len) {
-    std::string min_key(key_bit_len / 8, 0);
-    min_key[min_key.size() - 1] = 1;
-    return min_key;
+const char* RegionName(ZDDLSM::VarRegion region) {
+    switch (region) {
+        case ZDDLSM::VarRegion::data:
+            return "data";
+        default:
+            return "key";
+    }
 }
 
 /*
-Singleton object initilizes ZDD.
+Token part of ZDD under an order of token bits, counted on live tokens
+instead of ZDD. Nodes of the bit at position `i`, counted from the bottom,
+are distinct tokens with that bit cut to bits at positions up to `i`.
+Swapping neighbours changes the nodes of these two bits only, so a step
+recounts two positions in O(tokens) and ZDD is left alone.
 */
-class ZDDSystem {
+class TokenOrder {
 public:
-    static void InitOnce(uint32_t total_vars) {
-        static ZDDSystem instance(total_vars);
+    TokenOrder(std::vector<uint64_t> tokens, std::vector<uint32_t> order)
+        : tokens_(std::move(tokens)),
+          order_(std::move(order)),
+          nodes_(order_.size()),
+          size_(0),
+          swaps_(0) {
+        for (uint32_t pos = 0; pos != order_.size(); ++pos) {
+            nodes_[pos] = CountAt(pos);
+            size_ += nodes_[pos];
+        }
+    }
+
+    const std::vector<uint32_t>& Order() const { return order_; }
+
+    uint32_t Swaps() const { return swaps_; }
+
+    /*
+    Tries every order of each three neighbouring bits and keeps the best,
+    until a pass over all windows doesn't shrink the size.
+    */
+    void Window() {
+        for (bool improved = true; improved;) {
+            improved = false;
+            for (uint32_t pos = 0; pos + 2 < order_.size(); ++pos) {
+                // the swaps visit the other 5 orders of the window
+                const uint32_t steps[] = {pos, pos + 1, pos, pos + 1, pos};
+                uint64_t best_size = size_;
+                uint32_t best_step = 0;
+                for (uint32_t step = 0; step != std::size(steps); ++step) {
+                    Swap(steps[step]);
+                    if (size_ < best_size) {
+                        best_size = size_;
+                        best_step = step + 1;
+                    }
+                }
+                // swapping back retraces the orders in reverse
+                for (uint32_t step = std::size(steps); step != best_step;
+                     --step) {
+                    Swap(steps[step - 1]);
+                }
+                improved = improved || best_step != 0;
+            }
+        }
+    }
+
+    /*
+    Moves every bit through all positions and leaves it at the best one.
+    A direction is abandoned once the size grows by `SIFTING_MAX_GROWTH`.
+    */
+    void Sift() {
+        std::vector<uint32_t> bits = order_;
+        for (uint32_t bit : bits) {
+            uint32_t pos =
+                std::find(order_.begin(), order_.end(), bit) - order_.begin();
+            uint32_t best_pos = pos;
+            uint64_t best_size = size_;
+            auto step = [&](uint32_t swap_pos, uint32_t new_pos) {
+                Swap(swap_pos);
+                pos = new_pos;
+                if (size_ < best_size) {
+                    best_size = size_;
+                    best_pos = pos;
+                }
+                return size_ <= best_size * SIFTING_MAX_GROWTH;
+            };
+
+            while (pos > 0 && step(pos - 1, pos - 1)) {
+            }
+            while (pos + 1 < order_.size() && step(pos, pos + 1)) {
+            }
+            while (pos > best_pos) {
+                step(pos - 1, pos - 1);
+            }
+            while (pos < best_pos) {
+                step(pos, pos + 1);
+            }
+        }
     }
 
 private:
-    ZDDSystem(uint32_t total_vars) {
-        BDD_Init(ZDD_INIT_SIZE);
-        for (bddvar v = 1; v <= total_vars; ++v) {
+    void Swap(uint32_t pos) {
+        std::swap(order_[pos], order_[pos + 1]);
+        size_ -= nodes_[pos] + nodes_[pos + 1];
+        nodes_[pos] = CountAt(pos);
+        nodes_[pos + 1] = CountAt(pos + 1);
+        size_ += nodes_[pos] + nodes_[pos + 1];
+        ++swaps_;
+    }
+
+    uint64_t CountAt(uint32_t pos) {
+        uint64_t mask = 0;
+        for (uint32_t below = 0; below <= pos; ++below) {
+            mask |= 1ULL << order_[below];
+        }
+        uint64_t bit = 1ULL << order_[pos];
+        seen_.clear();
+        for (uint64_t token : tokens_) {
+            if ((token & bit) != 0) {
+                seen_.insert(token & mask);
+            }
+        }
+        return seen_.size();
+    }
+
+    std::vector<uint64_t> tokens_;
+    std::vector<uint32_t> order_;
+    std::vector<uint64_t> nodes_;
+    std::unordered_set<uint64_t> seen_;
+    uint64_t size_;
+    uint32_t swaps_;
+};
+
+/*
+Guards SAPPORO's process-wide node table, caches and GC. Recursive, so a
+thread can hold guards of several storages.
+*/
+std::recursive_mutex& SapporoMutex() {
+    static std::recursive_mutex mutex;
+    return mutex;
+}
+
+/*
+Singleton object initilizes ZDD. SAPPORO node table is process-wide, so
+storages share it, and variables are created on demand for the widest key.
+*/
+class ZDDSystem {
+public:
+    static void ReserveVars(uint32_t total_vars) {
+        std::lock_guard<std::recursive_mutex> guard(SapporoMutex());
+        static ZDDSystem instance;
+        // new variables go on top, so that variable and level stay equal
+        for (bddvar v = BDD_VarUsed() + 1; v <= total_vars; ++v) {
             BDD_NewVarOfLev(v);
         }
     }
+
+private:
+    ZDDSystem() { BDD_Init(ZDD_INIT_SIZE); }
 };
 }  // namespace
 
 namespace ZDDLSM {
+GarbageCollector::GarbageCollector(const GcPolicy& policy)
+    : policy_(policy),
+      used_after_gc_(0),
+      runs_(0),
+      total_pause_us_(0),
+      max_pause_us_(0) {
+    if (policy_.growth_fraction < 0 || policy_.growth_fraction >= 1) {
+        throw std::invalid_argument("growth fraction must be in [0, 1)");
+    }
+}
+
 void GarbageCollector::Notify() {
-    ++gc_timer_;
+    if (!policy_.background && ShouldCollect()) {
+        Collect();
+    }
+}
+
+void GarbageCollector::Start() { used_after_gc_ = BDD_Used(); }
+
+bool GarbageCollector::ShouldCollect() const {
+    uint64_t used = BDD_Used();
+    uint64_t used_after_gc = used_after_gc_.load();
+    if (used < used_after_gc + GC_MIN_ALLOCATED) {
+        return false;
+    }
+
+    return (policy_.node_budget != 0 && used > policy_.node_budget) ||
+           (policy_.growth_fraction != 0 &&
+            used - used_after_gc >= policy_.growth_fraction * used);
+}
 
-    if (gc_timer_ == GC_MAX_TIMER) {
-        gc_timer_ = 0;
-        BDD_GC();
+void GarbageCollector::Collect() {
+    auto start = std::chrono::steady_clock::now();
+    BDD_GC();
+    uint64_t pause_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    used_after_gc_ = BDD_Used();
+    ++runs_;
+    total_pause_us_ += pause_us;
+    if (pause_us > max_pause_us_) {
+        max_pause_us_ = pause_us;
     }
 }
 
-Storage::InternalKey::InternalKey(const std::string& key,
-                                  const Compression::ICompressor& compressor)
-    : key_(key), cf_id_(0), has_cf_(false) {
-    ikey_ = compressor.Compress(key);
-    total_size_ = ikey_.size();
+GcStats GarbageCollector::Stats() const {
+    return GcStats{runs_, total_pause_us_, max_pause_us_};
 }
 
 Storage::InternalKey::InternalKey(const std::string& key, uint32_t cf_id,
-                                  const Compression::ICompressor& compressor)
-    : key_(key), cf_id_(cf_id), has_cf_(true) {
+                                  const Compression::ICompressor& compressor,
+                                  uint32_t byte_bits)
+    : key_(key), cf_id_(cf_id), byte_bits_(byte_bits) {
     ikey_ = compressor.Compress(key);
-    total_size_ = ikey_.size() + sizeof(cf_id_);
+    total_size_ = ikey_.size() * byte_bits_;
 }
 
-char Storage::InternalKey::operator[](uint32_t index) const {
-    if (index >= total_size_) {
-        return 0;
+bool Storage::InternalKey::Bit(uint32_t pos) const {
+    if (pos >= total_size_) {
+        return false;
+    }
+
+    uint32_t bit = pos % byte_bits_;
+    if (byte_bits_ == BITS_PER_KEY_BYTE) {
+        if (bit == 0) {
+            return true;
+        }
+        --bit;
     }
-    if (has_cf_ && index < sizeof(cf_id_)) {
-        uint32_t byte_pos = sizeof(cf_id_) - index - 1;
-        return static_cast<char>((cf_id_ >> byte_pos * 8 * sizeof(char)) &
-                                 0x000000FF);
-    } else if (has_cf_) {
-        return ikey_[index - sizeof(cf_id_)];
+    uint8_t byte = ikey_[pos / byte_bits_];
+    return (byte >> (BITS_IN_BYTE - bit - 1)) & 1;
+}
+
+inline bddvar Storage::KeyVar(uint32_t pos) const {
+    return bit_var_[DATA_BIT_LEN + key_bit_len_ - pos];
+}
+
+inline uint32_t Storage::KeyPos(bddvar var) const {
+    return DATA_BIT_LEN + key_bit_len_ - var_bit_[var];
+}
+
+inline uint32_t Storage::TokenBit(bddvar var) const {
+    return DATA_BIT_LEN - var_bit_[var];
+}
+
+Storage::InternalKey Storage::MakeKey(
+    uint32_t cf_id, const std::string& key,
+    const Compression::ICompressor& compressor) const {
+    ZDDLSM_PROFILE_PHASE(profiler_, encode);
+#ifdef ZDDLSM_PROFILING
+    auto start = std::chrono::steady_clock::now();
+    InternalKey ikey(key, cf_id, compressor, key_byte_bits_);
+    compress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    return ikey;
+#else
+    return InternalKey(key, cf_id, compressor, key_byte_bits_);
+#endif
+}
+
+void Storage::CheckColumnFamilies() const {
+    if (!column_families_) {
+        throw std::logic_error("column families are disabled for storage");
     }
-    return ikey_[index];
 }
 
-void Storage::GetNzZddVars(const InternalKey& zdd_ikey, uint32_t prefix_len) {
+void Storage::GetNzZddVars(const InternalKey& zdd_ikey,
+                           uint32_t prefix_len) {
     nz_zdd_vars_.clear();
-    int nz_bits_n = 0;
 
-    for (uint32_t i = std::min(key_bit_len_, prefix_len), j = key_bit_len_ - i;
-         i != 0; --i, ++j) {
-        if (0 != (zdd_ikey[(i - 1) / BITS_FOR_VAL] & 1 << j % BITS_FOR_VAL)) {
-            nz_zdd_vars_.push_back(BDD_LevOfVar(DATA_BIT_LEN + j + 1));
-            ++nz_bits_n;
+    // key bits are collected from the bottom, so levels come out sorted
+    for (uint32_t pos = std::min({key_bit_len_, prefix_len, zdd_ikey.BitLen()});
+         pos > 0; --pos) {
+        if (zdd_ikey.Bit(pos - 1)) {
+            nz_zdd_vars_.push_back(BDD_LevOfVar(KeyVar(pos - 1)));
         }
     }
 
@@ -99,6 +349,7 @@ void Storage::GetNzZddVars(const InternalKey& zdd_ikey, uint32_t prefix_len) {
 }
 
 bool Storage::ProcessZddNode(ZBDD& zdd, int& stack_pointer, int top_var_n) {
+    ZDDLSM_COUNT(profiler_, nodes_visited);
     auto level_of_top_var = BDD_LevOfVar(top_var_n);
     if (stack_pointer < 0 ||
         level_of_top_var > static_cast<int64_t>(nz_zdd_vars_[stack_pointer])) {
@@ -113,32 +364,39 @@ bool Storage::ProcessZddNode(ZBDD& zdd, int& stack_pointer, int top_var_n) {
     return true;
 }
 
-inline ZBDD Storage::Child(const ZBDD& n, const int child_num) {
+inline ZBDD Storage::Child(const ZBDD& n, const int child_num) const {
+    ZDDLSM_COUNT(profiler_, child_calls);
     ZBDD g;
-    if (child_num != 0)
+    if (child_num != 0) {
+        ZDDLSM_COUNT(profiler_, onset_calls);
         g = n.OnSet0(n.Top());
-    else
+    } else {
+        ZDDLSM_COUNT(profiler_, offset_calls);
         g = n.OffSet(n.Top());
+    }
     return g;
 }
 
-inline ZBDD Storage::LSMKeyTransform(const InternalKey& zdd_ikey,
-                                     uint32_t lsm_lev) {
-    ZBDD resulting_zdd = bddsingle;
-
-    // last node stands for msb
-    uint64_t bit_mask = std::pow(2, DATA_BIT_LEN - 1);
-    for (size_t i = 1; i <= DATA_BIT_LEN; ++i) {
-        if ((bit_mask & lsm_lev) != 0) {
-            resulting_zdd = resulting_zdd.Change(i);
+inline ZBDD Storage::TokenPath(uint64_t token) const {
+    ZBDD path = bddsingle;
+    for (bddvar var = 1; var <= DATA_BIT_LEN; ++var) {
+        if ((token >> TokenBit(var) & 1) != 0) {
+            path = path.Change(var);
         }
-        bit_mask = bit_mask >> 1;
     }
+    return path;
+}
 
-    for (size_t i = key_bit_len_, j = 0; i != 0; --i, ++j) {
-        if (0 != (zdd_ikey[(i - 1) / BITS_FOR_VAL] & 1 << j % BITS_FOR_VAL)) {
-            resulting_zdd =
-                resulting_zdd.Change(DATA_BIT_LEN + (key_bit_len_ - i) + 1);
+inline ZBDD Storage::LSMKeyTransform(const InternalKey& zdd_ikey,
+                                     uint64_t token, uint32_t from_pos) {
+    ZDDLSM_PROFILE_PHASE(profiler_, path_build);
+    ZBDD resulting_zdd = TokenPath(token);
+
+    // bottom-up, so that every `Change` only adds a new top node
+    for (uint32_t pos = std::min(key_bit_len_, zdd_ikey.BitLen());
+         pos > from_pos; --pos) {
+        if (zdd_ikey.Bit(pos - 1)) {
+            resulting_zdd = resulting_zdd.Change(KeyVar(pos - 1));
         }
     }
 
@@ -148,13 +406,18 @@ inline ZBDD Storage::LSMKeyTransform(const InternalKey& zdd_ikey,
 std::optional<ZBDD> Storage::GetSubZDDbyKey(const InternalKey& key,
                                             uint32_t prefix_len) {
     GetNzZddVars(key, prefix_len);
-    ZBDD current_zdd(store_);
+    ZBDD current_zdd = RootOf(key.CfID());
 
     if (IsEmpty(current_zdd)) {
         return std::nullopt;
     }
 
     int stack_pointer = nz_zdd_vars_.size() - 1;
+    if (root_table_bits_ != 0 && prefix_len >= root_table_bits_) {
+        // ones of the prefix are the top variables of `nz_zdd_vars_`
+        current_zdd = TableEntry(FamilyFor(key.CfID()), key);
+        stack_pointer -= std::popcount(TablePrefix(key));
+    }
     for (size_t i = 1; i <= key_bit_len_; ++i) {
         auto top_var_n = current_zdd.Top();
         if (IsEmpty(current_zdd) || top_var_n <= DATA_BIT_LEN ||
@@ -169,7 +432,9 @@ std::optional<ZBDD> Storage::GetSubZDDbyKey(const InternalKey& key,
         }
     }
 
-    if (stack_pointer < 0 && !IsEmpty(current_zdd)) {
+    if (prefix_len == 0xFFFFFFFF && stack_pointer < 0 &&
+        !IsEmpty(current_zdd)) {
+        ZDDLSM_COUNT(profiler_, onset_calls);
         current_zdd = current_zdd.OnSet(current_zdd.Top());
     }
 
@@ -178,399 +443,2004 @@ std::optional<ZBDD> Storage::GetSubZDDbyKey(const InternalKey& key,
                : std::optional<ZBDD>{current_zdd};
 }
 
-Storage::Storage(uint32_t key_len, Compression::compression type)
-    : store_(bddsingle),
+Storage::Storage(uint32_t key_len, Compression::compression type,
+                 const Options& options)
+    : Storage(key_len, Compression::BuildCompressor(type), options) {}
+
+Storage::Storage(uint32_t key_len,
+                 std::unique_ptr<Compression::ICompressor> compressor,
+                 const Options& options)
+    : key_len_(key_len),
+      compressor_(std::move(compressor)),
+      gc_(options.gc),
       current_token_(0),
       size_(0),
       deleted_(0),
       curr_task_id_(0),
-      ready_task_id_(0) {
-    compressor_ = Compression::BuildCompressor(type);
-    key_bit_len_ = compressor_->BytesNeeds(key_len) * 8 + ZDD_ADDITIONAL_BITS;
-    ZDDSystem::InitOnce(key_bit_len_ + DATA_BIT_LEN);
+      ready_task_id_(0),
+      ops_{},
+      compress_ns_(0),
+      next_iterator_id_(0),
+      gc_stop_(false) {
+    std::lock_guard<std::recursive_mutex> guard(SapporoMutex());
+    column_families_ = options.column_families;
+    // length of fixed-width keys is implicit, so they need no markers
+    key_byte_bits_ =
+        compressor_->FixedWidth() ? BITS_IN_BYTE : BITS_PER_KEY_BYTE;
+    key_bit_len_ = compressor_->BytesNeeds(key_len) * key_byte_bits_;
+    ZDDSystem::ReserveVars(key_bit_len_ + DATA_BIT_LEN);
     nz_zdd_vars_.reserve(key_bit_len_);
-}
-
-LockGuard Storage::Lock() { return LockGuard(curr_task_id_, ready_task_id_); }
-
-void Storage::Print() { store_.Print(); }
+    gc_.Start();
 
-void Storage::SetImpl(const InternalKey& ikey, uint32_t to_level) {
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        data_[level_key.value()] = to_level;
-    } else {
-        store_ += LSMKeyTransform(ikey, ++current_token_);
-        ++size_;
-        data_[current_token_] = to_level;
-        gc_.Notify();
+    reorder_threshold_ = options.token_reorder_threshold;
+    if (options.root_table_bits > MAX_ROOT_TABLE_BITS) {
+        throw std::invalid_argument("root table can't have more than " +
+                                    std::to_string(MAX_ROOT_TABLE_BITS) +
+                                    " bits");
+    }
+    root_table_bits_ = std::min(options.root_table_bits, key_bit_len_);
+    key_counts_limit_ = KEY_COUNTS_MIN_LIMIT;
+    bit_var_.resize(key_bit_len_ + DATA_BIT_LEN + 1);
+    var_bit_.resize(key_bit_len_ + DATA_BIT_LEN + 1);
+    for (bddvar var = 0; var != bit_var_.size(); ++var) {
+        bit_var_[var] = var;
+        var_bit_[var] = var;
     }
-}
 
-void Storage::Set(const std::string& key, uint32_t to_level) {
-    InternalKey ikey(key, *compressor_);
-    SetImpl(ikey, to_level);
+    if (options.gc.background) {
+        gc_thread_ = std::thread(&Storage::BackgroundCollect, this);
+    }
 }
 
-void Storage::Set(uint32_t cf_id, const std::string& key, uint32_t to_level) {
-    InternalKey ikey(key, cf_id, *compressor_);
-    SetImpl(ikey, to_level);
+Storage::~Storage() {
+    if (gc_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(gc_mutex_);
+            gc_stop_ = true;
+        }
+        gc_cv_.notify_one();
+        gc_thread_.join();
+    }
+    // released nodes change reference counts in the shared node table
+    std::lock_guard<std::recursive_mutex> guard(SapporoMutex());
+    families_.clear();
+    key_counts_.clear();
 }
 
-void Storage::SetNoCompr(uint32_t cf_id, const std::string& key,
-                         uint32_t to_level) {
-    InternalKey ikey(key, cf_id, Compression::NoCompression());
-    SetImpl(ikey, to_level);
+void Storage::BackgroundCollect() {
+    std::unique_lock<std::mutex> lock(gc_mutex_);
+    while (!gc_cv_.wait_for(lock, gc_.Policy().background_period,
+                            [this]() { return gc_stop_; })) {
+        LockGuard guard = Lock();
+        MaybeCollect();
+    }
 }
 
-void Storage::SetNoCompr(const std::string& key, uint32_t to_level) {
-    InternalKey ikey(key, Compression::NoCompression());
-    SetImpl(ikey, to_level);
+bool Storage::MaybeCollect() {
+    if (!gc_.ShouldCollect()) {
+        return false;
+    }
+    gc_.Collect();
+    return true;
 }
 
-void Storage::DeleteImpl(const InternalKey& ikey) {
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        data_.erase(level_key.value());
-        store_ -= LSMKeyTransform(ikey, level_key.value());
-        --size_;
-        ++deleted_;
-        gc_.Notify();
+GcStats Storage::GetGcStats() const { return gc_.Stats(); }
+
+StorageStats Storage::GetStats() const {
+    StorageStats stats;
+    stats.live_keys = size_;
+    stats.deleted_keys = deleted_;
+    stats.zdd_nodes = NodeCount();
+    stats.zdd_bytes = stats.zdd_nodes * ZDD_NODE_BYTES;
+    stats.data_entries = 0;
+    stats.data_bytes = 0;
+    stats.scan_bytes = 0;
+    for (const auto& [cf_id, family] : families_) {
+        stats.data_entries += family.data.size();
+        stats.data_bytes += DataBytes(family.data) + DataBytes(family.hints);
+        stats.scan_bytes += family.flat.capacity() * sizeof(FlatNode);
     }
+    stats.bytes_per_key =
+        size_ == 0 ? 0
+                   : static_cast<double>(stats.zdd_bytes + stats.data_bytes +
+                                         stats.scan_bytes) /
+                         size_;
+    stats.compress_us = compress_ns_ / 1000;
+    stats.gc = gc_.Stats();
+    stats.ops = ops_;
+    return stats;
 }
 
-void Storage::Delete(const std::string& key) {
-    InternalKey ikey(key, *compressor_);
-    DeleteImpl(ikey);
+std::string StorageStats::ToString() const {
+    std::ostringstream out;
+    out << "live keys: " << live_keys << "\n"
+        << "deleted keys: " << deleted_keys << "\n"
+        << "zdd nodes: " << zdd_nodes << " (~" << zdd_bytes << " bytes)\n"
+        << "data entries: " << data_entries << " (~" << data_bytes
+        << " bytes)\n"
+        << "scan copies: ~" << scan_bytes << " bytes\n"
+        << "bytes per key: " << bytes_per_key << "\n"
+        << "compression: " << compress_us << " us\n"
+        << "gc: " << gc.runs << " runs, " << gc.total_pause_us
+        << " us total, " << gc.max_pause_us << " us max\n"
+        << "ops: " << ops.sets << " sets (" << ops.inserts << " inserts), "
+        << ops.deletes << " deletes, " << ops.gets << " gets ("
+        << ops.get_hits << " hits), " << ops.iterator_seeks << " seeks, "
+        << ops.iterator_steps << " steps\n";
+    return out.str();
 }
 
-void Storage::Delete(uint32_t cf_id, const std::string& key) {
-    InternalKey ikey(key, cf_id, *compressor_);
-    DeleteImpl(ikey);
+std::string StorageStats::ToJson() const {
+    std::ostringstream out;
+    out << "{\"live_keys\": " << live_keys
+        << ", \"deleted_keys\": " << deleted_keys
+        << ", \"zdd_nodes\": " << zdd_nodes
+        << ", \"zdd_bytes\": " << zdd_bytes
+        << ", \"data_entries\": " << data_entries
+        << ", \"data_bytes\": " << data_bytes
+        << ", \"scan_bytes\": " << scan_bytes
+        << ", \"bytes_per_key\": " << bytes_per_key
+        << ", \"compress_us\": " << compress_us
+        << ", \"gc\": {\"runs\": " << gc.runs
+        << ", \"total_pause_us\": " << gc.total_pause_us
+        << ", \"max_pause_us\": " << gc.max_pause_us << "}"
+        << ", \"ops\": {\"sets\": " << ops.sets
+        << ", \"inserts\": " << ops.inserts
+        << ", \"deletes\": " << ops.deletes << ", \"gets\": " << ops.gets
+        << ", \"get_hits\": " << ops.get_hits
+        << ", \"iterator_seeks\": " << ops.iterator_seeks
+        << ", \"iterator_steps\": " << ops.iterator_steps << "}}";
+    return out.str();
 }
 
-std::optional<uint32_t> Storage::GetLevelImpl(const InternalKey& ikey) {
-    std::optional<ZBDD> maybe_subzdd = GetSubZDDbyKey(ikey);
+LockGuard Storage::Lock() { return LockGuard(curr_task_id_, ready_task_id_); }
 
-    if (IsEmpty() || !maybe_subzdd.has_value() ||
-        IsEmpty(maybe_subzdd.value())) {
-        return std::nullopt;
+void Storage::Print() {
+    for (uint32_t cf_id : ListColumnFamilies()) {
+        std::cout << "column family " << cf_id << ": ";
+        std::cout.flush();
+        families_.at(cf_id).root.Print();
     }
+}
 
-    ZBDD curr_zdd = maybe_subzdd.value();
-    ZBDD current_bit_is_taken;
-    ZBDD current_bit_is_not_taken;
-
-    if (BDD_LevOfVar(curr_zdd.Top()) > DATA_BIT_LEN) {
-        return std::nullopt;
+uint64_t Storage::NodeCount() const {
+    std::vector<ZBDD> roots;
+    for (const auto& [cf_id, family] : families_) {
+        roots.push_back(family.root);
     }
+    return CountNodes(roots);
+}
 
-    uint32_t data_key_ = 0;
+uint64_t Storage::CountNodes(const std::vector<ZBDD>& roots) {
+    if (roots.size() == 1) {
+        return roots.front().Size();
+    }
 
-    for (int bit = 0; bit != DATA_BIT_LEN; ++bit) {
-        current_bit_is_not_taken = Child(curr_zdd, 0);
-        current_bit_is_taken = Child(curr_zdd, 1);
-        if (current_bit_is_not_taken != bddfalse) {
-            curr_zdd = current_bit_is_not_taken;
-        } else if (current_bit_is_taken != bddfalse) {
-            data_key_ = data_key_ | (1 << (DATA_BIT_LEN - curr_zdd.Top()));
-            curr_zdd = current_bit_is_taken;
-        } else {
-            return std::nullopt;
+    std::unordered_set<bddword> seen;
+    std::vector<ZBDD> stack;
+    for (const ZBDD& root : roots) {
+        if (!IsEmpty(root) && seen.insert(root.GetID()).second) {
+            stack.push_back(root);
         }
-
-        if (curr_zdd == bddtrue) {
-            break;
+    }
+    while (!stack.empty()) {
+        ZBDD node = stack.back();
+        stack.pop_back();
+        for (ZBDD child : {node.OffSet(node.Top()), node.OnSet0(node.Top())}) {
+            if (!IsEmpty(child) && seen.insert(child.GetID()).second) {
+                stack.push_back(child);
+            }
         }
     }
+    return seen.size();
+}
 
-    return data_key_;
+ZBDD Storage::RootOf(uint32_t cf_id) const {
+    auto it = families_.find(cf_id);
+    return it == families_.end() ? ZBDD(bddempty) : it->second.root;
 }
 
-std::optional<uint32_t> Storage::GetLevel(const std::string& key) {
-    InternalKey ikey(key, *compressor_);
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        return data_[level_key.value()];
-    }
-    return std::nullopt;
+Storage::ColumnFamily& Storage::FamilyFor(uint32_t cf_id) {
+    auto [it, inserted] =
+        families_.try_emplace(cf_id, ColumnFamily{bddempty, {}, 0});
+    return it->second;
 }
 
-std::optional<uint32_t> Storage::GetLevel(uint32_t cf_id,
-                                          const std::string& key) {
-    InternalKey ikey(key, cf_id, *compressor_);
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        return data_[level_key.value()];
+bool Storage::CreateColumnFamily(uint32_t cf_id) {
+    if (cf_id != DEFAULT_CF) {
+        CheckColumnFamilies();
     }
-    return std::nullopt;
+    return families_.try_emplace(cf_id, ColumnFamily{bddempty, {}, 0}).second;
 }
 
-std::optional<uint32_t> Storage::GetLevelNoCompr(const std::string& key) {
-    InternalKey ikey(key, Compression::NoCompression());
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        return data_[level_key.value()];
+uint64_t Storage::DropColumnFamily(uint32_t cf_id) {
+    if (cf_id != DEFAULT_CF) {
+        CheckColumnFamilies();
+    }
+    Trace(TraceOp::drop_column_family, true, cf_id, std::string());
+    auto it = families_.find(cf_id);
+    if (it == families_.end()) {
+        return 0;
     }
-    return std::nullopt;
-}
 
-std::optional<uint32_t> Storage::GetLevelNoCompr(uint32_t cf_id,
-                                                 const std::string& key) {
-    InternalKey ikey(key, cf_id, Compression::NoCompression());
-    std::optional<uint32_t> level_key = GetLevelImpl(ikey);
-    if (level_key.has_value()) {
-        return data_[level_key.value()];
+    uint64_t dropped = it->second.data.size();
+    families_.erase(it);
+    size_ -= dropped;
+    deleted_ += dropped;
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
     }
-    return std::nullopt;
+    return dropped;
 }
 
-bool Storage::IsEmpty() { return store_ == bddtrue || store_ == bddfalse; }
-
-bool Storage::IsEmpty(ZBDD store) {
-    return store == bddtrue || store == bddfalse;
+std::vector<uint32_t> Storage::ListColumnFamilies() const {
+    std::vector<uint32_t> cf_ids;
+    for (const auto& [cf_id, family] : families_) {
+        cf_ids.push_back(cf_id);
+    }
+    std::sort(cf_ids.begin(), cf_ids.end());
+    return cf_ids;
 }
 
-LockGuard::LockGuard(std::atomic<uint32_t>& curr_task_id,
-                     std::atomic<uint32_t>& ready_task)
-    : curr_task_id_(curr_task_id), ready_task_id_(ready_task) {
-    id = curr_task_id.fetch_add(1);
-
-    while (ready_task.load() != id) {
+std::map<uint32_t, ColumnFamilyStats> Storage::GetColumnFamilyStats() const {
+    std::map<uint32_t, ColumnFamilyStats> stats;
+    for (const auto& [cf_id, family] : families_) {
+        uint64_t nodes = family.root.Size();
+        stats[cf_id] = {family.data.size(), family.deleted, nodes,
+                        nodes * ZDD_NODE_BYTES,
+                        DataBytes(family.data) + DataBytes(family.hints),
+                        family.flat.capacity() * sizeof(FlatNode)};
     }
+    return stats;
 }
 
-LockGuard::~LockGuard() { ready_task_id_.fetch_add(1); }
-
-bool Iterator::TraverseNode(ZddNode*& curr_node, ZBDD& current_zdd,
-                            int& curr_level, int& stack_pointer,
-                            std::vector<bddvar>& nz_zdd_vars) {
-    if (stack_pointer < 0 ||
-        curr_level > static_cast<int64_t>(nz_zdd_vars[stack_pointer])) {
-        nodes_.push_back(
-            {current_zdd.OnSet(current_zdd.Top()), 0, false, false});
-
-        current_zdd = zdd_->Child(current_zdd, 0);
-
-        curr_level = BDD_LevOfVar(current_zdd.Top());
-        curr_node->left = true;
-        curr_node = &nodes_.back();
-        curr_node->level = curr_level;
-
-    } else if (curr_level < static_cast<int64_t>(nz_zdd_vars[stack_pointer])) {
-        curr_node = &nodes_.back();
-        curr_level = curr_node->level;
-        nodes_.pop_back();
-        return false;
-
-    } else {
-        nodes_.push_back(
-            {current_zdd.OnSet(current_zdd.Top()), 0, false, false});
-
-        current_zdd = zdd_->Child(current_zdd, 1);
-
-        curr_level = BDD_LevOfVar(current_zdd.Top());
-        curr_node->left = true;
-        curr_node->right = true;
-        curr_node = &nodes_.back();
-        curr_node->level = curr_level;
-
-        --stack_pointer;
+ZBDD Storage::InOurOrder(const Storage& other, ZBDD root) const {
+    // `held[bit]` is the variable of `bit` in `root` so far
+    std::vector<bddvar> held = other.bit_var_;
+    std::vector<uint32_t> bit_of(var_bit_.size());
+    for (uint32_t bit = 1; bit < held.size(); ++bit) {
+        bit_of[held[bit]] = bit;
     }
-    return true;
-}
 
-void Iterator::UpdateCurrentNode(ZddNode*& curr_node, ZBDD& current_zdd,
-                                 int& curr_level) {
-    if (current_zdd != bddfalse) {
-        curr_level = BDD_LevOfVar(current_zdd.Top());
-        curr_node = &nodes_.back();
-        curr_node->level = curr_level;
-    } else {
-        current_zdd = nodes_.back().anc;
-        nodes_.pop_back();
-        curr_node = &nodes_.back();
-        curr_level = curr_node->level;
+    for (uint32_t bit = 1; bit < held.size(); ++bit) {
+        bddvar var = bit_var_[bit];
+        if (held[bit] == var) {
+            continue;
+        }
+        uint32_t other_bit = bit_of[var];
+        root = root.Swap(held[bit], var);
+        std::swap(held[bit], held[other_bit]);
+        bit_of[held[bit]] = bit;
+        bit_of[held[other_bit]] = other_bit;
     }
+    return root;
 }
 
-void Iterator::Init(const std::string& key, ZBDD& initial_zdd) {
-    nodes_ = std::deque<ZddNode>();
-    zdd_->GetNzZddVars(Storage::InternalKey(key, Compression::NoCompression()));
-
-    ZBDD current_zdd(initial_zdd);
-
-    nodes_.push_back({bddnull, BDD_LevOfVar(current_zdd.Top()), false, false});
-
-    if (zdd_->IsEmpty(current_zdd)) {
-        end_ = true;
-        return;
+ZBDD Storage::MergeConflicts(ZBDD ours, ZBDD theirs,
+                             const ColumnFamily& other, ColumnFamily& family,
+                             ConflictPolicy policy,
+                             std::unordered_set<uint64_t>& dropped) {
+    if (ours == bddempty || theirs == bddempty) {
+        return bddempty;
     }
 
-    int stack_pointer = zdd_->nz_zdd_vars_.size() - 1;
-    int curr_level = BDD_LevOfVar(current_zdd.Top());
-    ZddNode* curr_node = &nodes_.back();
+    int our_level = BDD_LevOfVar(ours.Top());
+    int their_level = BDD_LevOfVar(theirs.Top());
+    if (our_level > DATA_BIT_LEN || their_level > DATA_BIT_LEN) {
+        // a key bit taken by one side only can't lead to a common key
+        if (our_level > their_level) {
+            return MergeConflicts(Child(ours, 0), theirs, other, family,
+                                  policy, dropped);
+        }
+        if (their_level > our_level) {
+            return MergeConflicts(ours, Child(theirs, 0), other, family,
+                                  policy, dropped);
+        }
+        bddvar var = ours.Top();
+        ZBDD without = MergeConflicts(Child(ours, 0), Child(theirs, 0), other,
+                                      family, policy, dropped);
+        ZBDD with = MergeConflicts(Child(ours, 1), Child(theirs, 1), other,
+                                   family, policy, dropped);
+        return without + with.Change(var);
+    }
 
-    for (size_t i = 1; i <= zdd_->key_bit_len_; ++i) {
-        if (zdd_->IsEmpty(current_zdd) || current_zdd.Top() <= DATA_BIT_LEN) {
-            break;
+    // both keys end here, so it's the same key
+    std::optional<uint64_t> our_token = ReadToken(ours);
+    std::optional<uint64_t> their_token = ReadToken(theirs);
+    if (!our_token.has_value() || !their_token.has_value()) {
+        return bddempty;
+    }
+    dropped.insert(their_token.value());
+
+    // file and block go along with the level they belong to
+    auto their_it = other.data.find(their_token.value());
+    if (their_it != other.data.end()) {
+        uint32_t our_lsm_level = family.data[our_token.value()];
+        uint32_t their_lsm_level = their_it->second;
+        bool take = false;
+        switch (policy) {
+            case ConflictPolicy::ours:
+                break;
+            case ConflictPolicy::theirs:
+                take = true;
+                break;
+            case ConflictPolicy::min_level:
+                take = their_lsm_level < our_lsm_level;
+                break;
+            case ConflictPolicy::max_level:
+                take = their_lsm_level > our_lsm_level;
+                break;
         }
+        if (take) {
+            SetToken(family, our_token.value(),
+                     LocationOf(other, their_token.value()));
+        }
+    }
+    return theirs;
+}
 
-        if (!TraverseNode(curr_node, current_zdd, curr_level, stack_pointer,
-                          zdd_->nz_zdd_vars_)) {
-            break;
+ZBDD Storage::Renumber(const ZBDD& node,
+                       std::vector<std::pair<uint64_t, uint64_t>>& renumbered) {
+    if (node == bddempty) {
+        return bddempty;
+    }
+    if (node == bddsingle || BDD_LevOfVar(node.Top()) <= DATA_BIT_LEN) {
+        // the token of one key, see `FrozenIndex`
+        std::optional<uint64_t> token =
+            node == bddsingle ? std::optional<uint64_t>(0) : ReadToken(node);
+        if (!token.has_value()) {
+            return bddempty;
         }
+        renumbered.emplace_back(token.value(), ++current_token_);
+        return TokenPath(current_token_);
     }
 
-    if (!(stack_pointer >= 0 || current_zdd == bddfalse)) {
-        if (!nodes_.empty() && nodes_.back().level <= DATA_BIT_LEN) {
-            nodes_.pop_back();
-        } else if (nodes_.empty()) {
-            end_ = true;
+    bddvar var = node.Top();
+    ZBDD without = Renumber(Child(node, 0), renumbered);
+    ZBDD with = Renumber(Child(node, 1), renumbered);
+    return without + with.Change(var);
+}
+
+MergeStats Storage::MergeFrom(const Storage& other, ConflictPolicy policy) {
+    if (&other == this) {
+        throw std::invalid_argument("can't merge storage into itself");
+    }
+    if (other.key_bit_len_ != key_bit_len_ ||
+        other.key_byte_bits_ != key_byte_bits_) {
+        throw std::invalid_argument("merged storage has another key length");
+    }
+    if (other.compressor_->Type() != compressor_->Type()) {
+        throw std::invalid_argument("merged storage has another compression");
+    }
+    for (const auto& [cf_id, family] : other.families_) {
+        if (cf_id != DEFAULT_CF) {
+            CheckColumnFamilies();
         }
-        return;
+    }
+    // keys of `other` get the next tokens, as if they were set here
+    if (other.size_ > UINT64_MAX - current_token_) {
+        throw std::overflow_error("no tokens left to merge storage");
     }
 
-    if (current_zdd == bddfalse) {
-        if (nodes_.empty()) {
-            end_ = true;
-            return;
+    MergeStats stats{0, 0};
+    uint32_t size_before = size_;
+    // traces keep merged keys themselves, so replays don't need `other`
+    std::vector<std::pair<uint32_t, std::string>> merged;
+    for (const auto& [cf_id, other_family] : other.families_) {
+        ColumnFamily& family = FamilyFor(cf_id);
+        ZBDD theirs = InOurOrder(other, other_family.root);
+        if (trace_ != nullptr) {
+            StoredKeys(cf_id, theirs, merged);
         }
-        nodes_.pop_back();
-        current_zdd = curr_node->anc;
-        curr_node = &nodes_.back();
 
-        curr_zdd_ = current_zdd;
+        std::unordered_set<uint64_t> dropped;
+        theirs -= MergeConflicts(family.root, theirs, other_family, family,
+                                 policy, dropped);
 
-        if (nodes_.empty()) {
-            end_ = true;
-            return;
+        std::vector<std::pair<uint64_t, uint64_t>> renumbered;
+        ZBDD added;
+        {
+            ZDDLSM_PROFILE_PHASE(profiler_, path_build);
+            added = Renumber(theirs, renumbered);
         }
+        UpdateRoot(family, added, true);
+        family.data.reserve(family.data.size() + renumbered.size());
+        for (const auto& [their_token, token] : renumbered) {
+            SetToken(family, token, LocationOf(other_family, their_token));
+        }
+        stats.added_keys += renumbered.size();
+        stats.conflicts += dropped.size();
     }
 
-    curr_zdd_ = current_zdd;
+    size_ += stats.added_keys;
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
+    }
+    MaybeReorder(size_before);
+
+    for (const auto& [cf_id, key] : merged) {
+        InternalKey ikey(key, cf_id, Compression::NoCompression(),
+                         key_byte_bits_);
+        KeyLocation location =
+            LocationOf(FamilyFor(cf_id), GetLevelImpl(ikey).value());
+        Trace(TraceOp::merge_key, column_families_, cf_id, key,
+              location.level, std::string(), location.file_number,
+              location.block_hint);
+    }
+    return stats;
+}
 
-    Next();
+void Storage::StoredKeys(
+    uint32_t cf_id, ZBDD root,
+    std::vector<std::pair<uint32_t, std::string>>& keys) const {
+    std::vector<std::pair<ZBDD, std::string>> stack;
+    stack.emplace_back(root, std::string());
+    while (!stack.empty()) {
+        auto [node, key] = std::move(stack.back());
+        stack.pop_back();
+        if (node == bddempty) {
+            continue;
+        }
+        if (node == bddsingle || BDD_LevOfVar(node.Top()) <= DATA_BIT_LEN) {
+            PadKey(key, key_bit_len_, key_byte_bits_);
+            keys.emplace_back(cf_id, std::move(key));
+            continue;
+        }
+        std::string with = key;
+        AppendKeyBit(with, node.Top());
+        stack.emplace_back(Child(node, 1), std::move(with));
+        stack.emplace_back(Child(node, 0), std::move(key));
+    }
 }
 
-Iterator::Iterator(ZDDLSM::Storage* zdd, const std::string& key)
-    : zdd_(zdd), end_(false) {
-    Init(key, zdd_->store_);
+void Storage::StartTrace(const std::string& path) {
+    trace_ = std::make_unique<TraceWriter>(
+        path, TraceHeader::Of(key_len_, column_families_, *compressor_));
 }
 
-Iterator::Iterator(Storage* zdd, uint32_t cf_id, const std::string& key)
-    : zdd_(zdd), end_(false) {
-    Storage::InternalKey ikey("", cf_id, Compression::NoCompression());
-    ZBDD initial_zdd = zdd->GetSubZDDbyKey(ikey, 32).value_or(bddnull);
-    if (initial_zdd == bddnull) {
-        end_ = true;
-    } else {
-        Init(key, initial_zdd);
+void Storage::StopTrace() { trace_.reset(); }
+
+uint32_t Storage::TablePrefix(const InternalKey& ikey) const {
+    uint32_t prefix = 0;
+    for (uint32_t pos = 0; pos != root_table_bits_; ++pos) {
+        prefix = prefix << 1 | (ikey.Bit(pos) ? 1 : 0);
     }
+    return prefix;
 }
 
-Iterator::Iterator(ZDDLSM::Storage* zdd)
-    : Iterator(zdd, GetMinKey(zdd->key_bit_len_)) {}
+ZBDD Storage::TableEntry(ColumnFamily& family, const InternalKey& ikey) {
+    if (family.root_table.empty() || family.table_root != family.root) {
+        BuildRootTable(family);
+    }
+    return family.root_table[TablePrefix(ikey)];
+}
 
-Iterator::Iterator(ZDDLSM::Storage* zdd, uint32_t cf_id)
-    : Iterator(zdd, cf_id, GetMinKey(zdd->key_bit_len_)) {}
+void Storage::BuildRootTable(ColumnFamily& family) {
+    family.root_table.assign(size_t{1} << root_table_bits_, bddempty);
+    std::vector<std::pair<uint32_t, ZBDD>> entries;
+    TableEntries(family.root, 0, 0, entries);
+    for (auto& [prefix, entry] : entries) {
+        family.root_table[prefix] = std::move(entry);
+    }
+    family.table_root = family.root;
+}
 
-bool Iterator::HasNext() const { return !end_; }
+void Storage::TableEntries(
+    const ZBDD& node, uint32_t pos, uint32_t prefix,
+    std::vector<std::pair<uint32_t, ZBDD>>& entries) const {
+    if (node == bddempty) {
+        return;
+    }
+    if (pos == root_table_bits_) {
+        entries.emplace_back(prefix, node);
+        return;
+    }
 
-void Iterator::Next() {
-    if (end_) {
+    if (static_cast<bddvar>(node.Top()) == KeyVar(pos)) {
+        TableEntries(Child(node, 0), pos + 1, prefix << 1, entries);
+        TableEntries(Child(node, 1), pos + 1, prefix << 1 | 1, entries);
+    } else {
+        TableEntries(node, pos + 1, prefix << 1, entries);
+    }
+}
+
+void Storage::UpdateRoot(ColumnFamily& family, const ZBDD& paths, bool add) {
+    bool table = !family.root_table.empty() &&
+                 family.table_root == family.root;
+    ZDDLSM_PROFILE_PHASE(profiler_, update);
+    if (table) {
+        std::vector<std::pair<uint32_t, ZBDD>> entries;
+        TableEntries(paths, 0, 0, entries);
+        for (const auto& [prefix, entry] : entries) {
+            if (add) {
+                family.root_table[prefix] += entry;
+            } else {
+                family.root_table[prefix] -= entry;
+            }
+        }
+    }
+    if (add) {
+        family.root += paths;
+    } else {
+        family.root -= paths;
+    }
+    if (table) {
+        family.table_root = family.root;
+    }
+}
+
+void Storage::AddPath(ColumnFamily& family, const InternalKey& ikey,
+                      uint64_t token) {
+    bool table = !family.root_table.empty() &&
+                 family.table_root == family.root;
+    ZBDD path = LSMKeyTransform(ikey, token, table ? root_table_bits_ : 0);
+    ZDDLSM_PROFILE_PHASE(profiler_, update);
+    if (table) {
+        family.root_table[TablePrefix(ikey)] += path;
+        path = WithPrefix(path, ikey, root_table_bits_);
+    }
+    family.root += path;
+    if (table) {
+        family.table_root = family.root;
+    }
+}
+
+void Storage::RemovePath(ColumnFamily& family, const InternalKey& ikey,
+                         uint64_t token) {
+    bool table = !family.root_table.empty() &&
+                 family.table_root == family.root;
+    ZBDD path = LSMKeyTransform(ikey, token, table ? root_table_bits_ : 0);
+    ZDDLSM_PROFILE_PHASE(profiler_, update);
+    if (table) {
+        family.root_table[TablePrefix(ikey)] -= path;
+        path = WithPrefix(path, ikey, root_table_bits_);
+    }
+    family.root -= path;
+    if (table) {
+        family.table_root = family.root;
+    }
+}
+
+void Storage::SetImpl(const InternalKey& ikey, const KeyLocation& location) {
+    ++ops_.sets;
+    std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+    ColumnFamily& family = FamilyFor(ikey.CfID());
+    if (level_key.has_value()) {
+        SetToken(family, level_key.value(), location);
+    } else {
+        AddPath(family, ikey, ++current_token_);
+        ++ops_.inserts;
+        ++size_;
+        SetToken(family, current_token_, location);
+        {
+            ZDDLSM_PROFILE_PHASE(profiler_, gc);
+            gc_.Notify();
+        }
+
+        MaybeReorder(size_ - 1);
+    }
+}
+
+void Storage::SetMany(
+    const std::vector<std::pair<InternalKey, uint32_t>>& keys) {
+    uint32_t size_before = size_;
+    std::map<uint32_t, ZBDD> paths;
+    for (const auto& [ikey, to_level] : keys) {
+        ++ops_.sets;
+        std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+        ColumnFamily& family = FamilyFor(ikey.CfID());
+        if (level_key.has_value()) {
+            SetToken(family, level_key.value(), KeyLocation{to_level});
+            continue;
+        }
+        auto [it, inserted] = paths.try_emplace(ikey.CfID(), bddempty);
+        it->second += LSMKeyTransform(ikey, ++current_token_);
+        ++ops_.inserts;
+        ++size_;
+        SetToken(family, current_token_, KeyLocation{to_level});
+    }
+    if (size_ == size_before) {
         return;
     }
 
-    ZddNode* curr_node = &nodes_.back();
-    int curr_level = curr_node->level;
-    ZBDD current_zdd = curr_zdd_;
+    for (const auto& [cf_id, cf_paths] : paths) {
+        UpdateRoot(families_.at(cf_id), cf_paths, true);
+    }
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
+    }
+    MaybeReorder(size_before);
+}
+
+void Storage::MaybeReorder(uint32_t size_before) {
+    if (reorder_threshold_ != 0 &&
+        size_before / REORDER_CHECK_PERIOD != size_ / REORDER_CHECK_PERIOD &&
+        NodeCount() > reorder_threshold_) {
+        reorder_threshold_ = 2 * ReorderTokens().nodes_after;
+    }
+}
 
-    if (curr_level <= DATA_BIT_LEN) {
-        nodes_.pop_back();
-        current_zdd = curr_node->anc;
-        curr_node = &nodes_.back();
-        curr_level = curr_node->level;
+void Storage::Set(const std::string& key, uint32_t to_level) {
+    Trace(TraceOp::set, false, DEFAULT_CF, key, to_level);
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, *compressor_);
+    SetImpl(ikey, KeyLocation{to_level});
+}
+
+void Storage::Set(uint32_t cf_id, const std::string& key, uint32_t to_level) {
+    CheckColumnFamilies();
+    Trace(TraceOp::set, true, cf_id, key, to_level);
+    InternalKey ikey = MakeKey(cf_id, key, *compressor_);
+    SetImpl(ikey, KeyLocation{to_level});
+}
+
+void Storage::Set(const std::string& key, const KeyLocation& location) {
+    Trace(TraceOp::set_location, false, DEFAULT_CF, key, location.level,
+          std::string(), location.file_number, location.block_hint);
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, *compressor_);
+    SetImpl(ikey, location);
+}
+
+void Storage::Set(uint32_t cf_id, const std::string& key,
+                  const KeyLocation& location) {
+    CheckColumnFamilies();
+    Trace(TraceOp::set_location, true, cf_id, key, location.level,
+          std::string(), location.file_number, location.block_hint);
+    InternalKey ikey = MakeKey(cf_id, key, *compressor_);
+    SetImpl(ikey, location);
+}
+
+void Storage::SetNoCompr(uint32_t cf_id, const std::string& key,
+                         uint32_t to_level) {
+    InternalKey ikey = MakeKey(cf_id, key, Compression::NoCompression());
+    SetImpl(ikey, KeyLocation{to_level});
+}
+
+void Storage::SetNoCompr(const std::string& key, uint32_t to_level) {
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, Compression::NoCompression());
+    SetImpl(ikey, KeyLocation{to_level});
+}
+
+void Storage::DeleteImpl(const InternalKey& ikey) {
+    ++ops_.deletes;
+    std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+    if (level_key.has_value()) {
+        ColumnFamily& family = FamilyFor(ikey.CfID());
+        EraseToken(family, level_key.value());
+        RemovePath(family, ikey, level_key.value());
+        ++family.deleted;
+        --size_;
+        ++deleted_;
+        {
+            ZDDLSM_PROFILE_PHASE(profiler_, gc);
+            gc_.Notify();
+        }
+    }
+}
+
+void Storage::DeleteMany(const std::vector<InternalKey>& keys) {
+    std::map<uint32_t, ZBDD> paths;
+    for (const InternalKey& ikey : keys) {
+        ++ops_.deletes;
+        std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+        if (!level_key.has_value()) {
+            continue;
+        }
+        ColumnFamily& family = FamilyFor(ikey.CfID());
+        EraseToken(family, level_key.value());
+        ++family.deleted;
+        auto [it, inserted] = paths.try_emplace(ikey.CfID(), bddempty);
+        it->second += LSMKeyTransform(ikey, level_key.value());
+        --size_;
+        ++deleted_;
+    }
+    if (paths.empty()) {
+        return;
+    }
+
+    for (const auto& [cf_id, cf_paths] : paths) {
+        UpdateRoot(families_.at(cf_id), cf_paths, false);
+    }
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
+    }
+}
+
+void Storage::Delete(const std::string& key) {
+    Trace(TraceOp::del, false, DEFAULT_CF, key);
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, *compressor_);
+    DeleteImpl(ikey);
+}
+
+void Storage::Delete(uint32_t cf_id, const std::string& key) {
+    CheckColumnFamilies();
+    Trace(TraceOp::del, true, cf_id, key);
+    InternalKey ikey = MakeKey(cf_id, key, *compressor_);
+    DeleteImpl(ikey);
+}
+
+ZBDD Storage::WithPrefix(ZBDD family, const InternalKey& prefix,
+                         uint32_t prefix_len) const {
+    for (uint32_t pos = prefix_len; pos != 0; --pos) {
+        if (prefix.Bit(pos - 1)) {
+            family = family.Change(KeyVar(pos - 1));
+        }
+    }
+    return family;
+}
+
+ZBDD Storage::KeysLessThan(ZBDD family, const InternalKey& bound) const {
+    // keys which leave the path of `bound` through a 0-branch, where
+    // `bound` has 1, are less than it
+    std::vector<std::pair<bddvar, ZBDD>> less_at;
+    uint32_t bound_len = std::min(key_bit_len_, bound.BitLen());
+    for (uint32_t pos = 0; pos < bound_len && family != bddempty; ++pos) {
+        bddvar var = KeyVar(pos);
+        if (bound.Bit(pos)) {
+            less_at.emplace_back(var, family.OffSet(var));
+            family = family.OnSet0(var);
+        } else {
+            family = family.OffSet(var);
+        }
+    }
+
+    // the rest of `family` is equal to `bound` or longer, so not less
+    ZBDD less = bddempty;
+    for (auto it = less_at.rbegin(); it != less_at.rend(); ++it) {
+        less = it->second + less.Change(it->first);
+    }
+    return less;
+}
+
+uint64_t Storage::DeleteRangeImpl(uint32_t cf_id, const std::string& begin,
+                                  const std::string& end) {
+    if (!end.empty() && !(begin < end)) {
+        return 0;
+    }
+
+    ZBDD family = RootOf(cf_id);
+    InternalKey begin_ikey =
+        MakeKey(cf_id, begin, Compression::NoCompression());
+    ZBDD below_end = family;
+    if (!end.empty()) {
+        InternalKey end_ikey =
+            MakeKey(cf_id, end, Compression::NoCompression());
+        below_end = KeysLessThan(family, end_ikey);
+    }
+    ZBDD range = below_end - KeysLessThan(family, begin_ikey);
+    if (range == bddempty) {
+        return 0;
+    }
+    return RemoveKeys(cf_id, range);
+}
+
+uint64_t Storage::DeletePrefixImpl(uint32_t cf_id, const std::string& prefix) {
+    InternalKey ikey = MakeKey(cf_id, prefix, Compression::NoCompression());
+    if (ikey.BitLen() > key_bit_len_) {
+        return 0;
+    }
+    std::optional<ZBDD> keys = GetSubZDDbyKey(ikey, ikey.BitLen());
+    if (!keys.has_value() || keys.value() == bddempty) {
+        return 0;
+    }
+    return RemoveKeys(cf_id, WithPrefix(keys.value(), ikey, ikey.BitLen()));
+}
+
+uint64_t Storage::RemoveKeys(uint32_t cf_id, ZBDD keys) {
+    ColumnFamily& family = FamilyFor(cf_id);
+    // levels of deleted keys are reclaimed by tokens under their paths
+    uint64_t deleted = 0;
+    for (std::vector<ZBDD> stack{keys}; !stack.empty();) {
+        ZBDD node = stack.back();
+        stack.pop_back();
+        if (BDD_LevOfVar(node.Top()) <= DATA_BIT_LEN) {
+            std::optional<uint64_t> token = ReadToken(node);
+            if (token.has_value()) {
+                EraseToken(family, token.value());
+            }
+            ++deleted;
+            continue;
+        }
+        for (int child_num : {0, 1}) {
+            ZBDD child = Child(node, child_num);
+            if (child != bddempty) {
+                stack.push_back(child);
+            }
+        }
+    }
+
+    UpdateRoot(family, keys, false);
+    family.deleted += deleted;
+    ops_.deletes += deleted;
+    size_ -= deleted;
+    deleted_ += deleted;
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
+    }
+    return deleted;
+}
+
+ZBDD Storage::BuildSorted(const std::vector<std::optional<InternalKey>>& ikeys,
+                          const std::vector<uint32_t>& order, size_t from,
+                          size_t to, uint32_t pos, uint64_t first_token) {
+    if (to - from == 1) {
+        return LSMKeyTransform(ikeys[order[from]].value(), first_token + from,
+                               pos);
+    }
+
+    // keys are sorted, so the ones with 0 at `pos` go first
+    auto split = std::partition_point(
+        order.begin() + from, order.begin() + to,
+        [&](uint32_t i) { return !ikeys[i]->Bit(pos); });
+    size_t mid = split - order.begin();
+    ZBDD without = mid == from ? ZBDD(bddempty)
+                               : BuildSorted(ikeys, order, from, mid, pos + 1,
+                                             first_token);
+    ZBDD with = mid == to ? ZBDD(bddempty)
+                          : BuildSorted(ikeys, order, mid, to, pos + 1,
+                                        first_token);
+    return without + with.Change(KeyVar(pos));
+}
+
+void Storage::BulkLoadImpl(
+    uint32_t cf_id, const std::vector<std::pair<std::string, uint32_t>>& keys,
+    uint32_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<uint32_t>(1, std::min<size_t>(threads, keys.size()));
+
+    // workers compress, then sort their chunks, which are merged pairwise
+    std::vector<std::optional<InternalKey>> ikeys(keys.size());
+    std::vector<uint32_t> order(keys.size());
+    uint32_t stored_len = key_bit_len_ / key_byte_bits_;
+    auto less = [&](uint32_t lhs, uint32_t rhs) {
+        return ikeys[lhs]->StoredKey().compare(0, stored_len,
+                                               ikeys[rhs]->StoredKey(), 0,
+                                               stored_len) < 0;
+    };
+    std::vector<size_t> bounds;
+    for (uint32_t chunk = 0; chunk <= threads; ++chunk) {
+        bounds.push_back(keys.size() * chunk / threads);
+    }
+
+    // the first error of a compressor is thrown once all workers are done,
+    // before the storage changes
+    auto start = std::chrono::steady_clock::now();
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (uint32_t chunk = 0; chunk != threads; ++chunk) {
+        workers.emplace_back([&, chunk]() {
+            try {
+                for (size_t i = bounds[chunk]; i != bounds[chunk + 1]; ++i) {
+                    ikeys[i].emplace(keys[i].first, cf_id, *compressor_,
+                                     key_byte_bits_);
+                    order[i] = i;
+                }
+                std::stable_sort(order.begin() + bounds[chunk],
+                                 order.begin() + bounds[chunk + 1], less);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    compress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+
+    for (size_t width = 1; width < threads; width *= 2) {
+        workers.clear();
+        for (size_t chunk = 0; chunk + width < threads; chunk += 2 * width) {
+            workers.emplace_back([&, chunk, width]() {
+                std::inplace_merge(
+                    order.begin() + bounds[chunk],
+                    order.begin() + bounds[chunk + width],
+                    order.begin() + bounds[std::min<size_t>(chunk + 2 * width,
+                                                            threads)],
+                    less);
+            });
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // sorting is stable, so the last of equal keys is the latest one
+    ColumnFamily& family = FamilyFor(cf_id);
+    bool has_keys = !IsEmpty(family.root);
+    std::vector<uint32_t> fresh;
+    fresh.reserve(order.size());
+    ops_.sets += keys.size();
+    for (size_t i = 0; i != order.size(); ++i) {
+        if (i + 1 != order.size() && !less(order[i], order[i + 1])) {
+            continue;
+        }
+        const InternalKey& ikey = ikeys[order[i]].value();
+        std::optional<uint64_t> token =
+            has_keys ? GetLevelImpl(ikey) : std::nullopt;
+        if (token.has_value()) {
+            SetToken(family, token.value(), KeyLocation{keys[order[i]].second});
+        } else {
+            fresh.push_back(order[i]);
+        }
+    }
+    if (fresh.empty()) {
+        return;
+    }
+
+    uint32_t size_before = size_;
+    uint64_t first_token = current_token_ + 1;
+    UpdateRoot(family,
+               BuildSorted(ikeys, fresh, 0, fresh.size(), 0, first_token),
+               true);
+    family.data.reserve(family.data.size() + fresh.size());
+    for (size_t i = 0; i != fresh.size(); ++i) {
+        family.data[first_token + i] = keys[fresh[i]].second;
+    }
+    current_token_ += fresh.size();
+    ops_.inserts += fresh.size();
+    size_ += fresh.size();
+    {
+        ZDDLSM_PROFILE_PHASE(profiler_, gc);
+        gc_.Notify();
+    }
+
+    MaybeReorder(size_before);
+}
+
+void Storage::BulkLoad(
+    const std::vector<std::pair<std::string, uint32_t>>& keys,
+    uint32_t threads) {
+    for (const auto& [key, level] : keys) {
+        Trace(TraceOp::set, false, DEFAULT_CF, key, level);
+    }
+    BulkLoadImpl(DEFAULT_CF, keys, threads);
+}
+
+void Storage::BulkLoad(
+    uint32_t cf_id, const std::vector<std::pair<std::string, uint32_t>>& keys,
+    uint32_t threads) {
+    CheckColumnFamilies();
+    for (const auto& [key, level] : keys) {
+        Trace(TraceOp::set, true, cf_id, key, level);
+    }
+    BulkLoadImpl(cf_id, keys, threads);
+}
+
+uint64_t Storage::DeleteRange(const std::string& begin,
+                              const std::string& end) {
+    Trace(TraceOp::delete_range, false, DEFAULT_CF, begin, 0, end);
+    return DeleteRangeImpl(DEFAULT_CF, begin, end);
+}
+
+uint64_t Storage::DeleteRange(uint32_t cf_id, const std::string& begin,
+                              const std::string& end) {
+    CheckColumnFamilies();
+    Trace(TraceOp::delete_range, true, cf_id, begin, 0, end);
+    return DeleteRangeImpl(cf_id, begin, end);
+}
+
+uint64_t Storage::DeletePrefix(const std::string& prefix) {
+    Trace(TraceOp::delete_prefix, false, DEFAULT_CF, prefix);
+    return DeletePrefixImpl(DEFAULT_CF, prefix);
+}
+
+uint64_t Storage::DeletePrefix(uint32_t cf_id, const std::string& prefix) {
+    CheckColumnFamilies();
+    Trace(TraceOp::delete_prefix, true, cf_id, prefix);
+    return DeletePrefixImpl(cf_id, prefix);
+}
+
+std::optional<uint64_t> Storage::GetLevelImpl(const InternalKey& ikey) {
+    ZDDLSM_PROFILE_PHASE(profiler_, descent);
+    std::optional<ZBDD> maybe_subzdd = GetSubZDDbyKey(ikey);
+
+    if (IsEmpty() || !maybe_subzdd.has_value() ||
+        IsEmpty(maybe_subzdd.value())) {
+        return std::nullopt;
+    }
+
+    return ReadToken(maybe_subzdd.value());
+}
+
+std::optional<uint64_t> Storage::ReadToken(ZBDD curr_zdd) const {
+    ZBDD current_bit_is_taken;
+    ZBDD current_bit_is_not_taken;
+
+    if (BDD_LevOfVar(curr_zdd.Top()) > DATA_BIT_LEN) {
+        return std::nullopt;
     }
 
-    while (!nodes_.empty()) {
-        if (current_zdd != bddfalse && curr_level <= DATA_BIT_LEN) {
+    uint64_t data_key_ = 0;
+
+    for (int bit = 0; bit != DATA_BIT_LEN; ++bit) {
+        ZDDLSM_COUNT(profiler_, nodes_visited);
+        current_bit_is_not_taken = Child(curr_zdd, 0);
+        current_bit_is_taken = Child(curr_zdd, 1);
+        if (current_bit_is_not_taken != bddfalse) {
+            curr_zdd = current_bit_is_not_taken;
+        } else if (current_bit_is_taken != bddfalse) {
+            data_key_ = data_key_ | (1ULL << TokenBit(curr_zdd.Top()));
+            curr_zdd = current_bit_is_taken;
+        } else {
+            return std::nullopt;
+        }
+
+        if (curr_zdd == bddtrue) {
             break;
         }
+    }
+
+    return data_key_;
+}
+
+void Storage::SetToken(ColumnFamily& family, uint64_t token,
+                       const KeyLocation& location) {
+    family.data[token] = location.level;
+    if (location.file_number != 0 || location.block_hint != 0) {
+        family.hints[token] = {location.file_number, location.block_hint};
+    } else if (!family.hints.empty()) {
+        family.hints.erase(token);
+    }
+}
+
+void Storage::EraseToken(ColumnFamily& family, uint64_t token) {
+    family.data.erase(token);
+    if (!family.hints.empty()) {
+        family.hints.erase(token);
+    }
+}
+
+KeyLocation Storage::LocationOf(const ColumnFamily& family, uint64_t token) {
+    KeyLocation location{family.data.at(token)};
+    auto hint = family.hints.find(token);
+    if (hint != family.hints.end()) {
+        location.file_number = hint->second.file_number;
+        location.block_hint = hint->second.block_hint;
+    }
+    return location;
+}
+
+std::optional<KeyLocation> Storage::FindLocation(const InternalKey& ikey) {
+    ++ops_.gets;
+    std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+    if (level_key.has_value()) {
+        ++ops_.get_hits;
+        return LocationOf(FamilyFor(ikey.CfID()), level_key.value());
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> Storage::FindLevel(const InternalKey& ikey) {
+    ++ops_.gets;
+    std::optional<uint64_t> level_key = GetLevelImpl(ikey);
+    if (level_key.has_value()) {
+        ++ops_.get_hits;
+        return FamilyFor(ikey.CfID()).data[level_key.value()];
+    }
+    return std::nullopt;
+}
 
-        if (current_zdd == bddfalse) {
-            current_zdd = curr_node->anc;
-            curr_node = &nodes_.back();
-            curr_level = curr_node->level;
+std::optional<uint32_t> Storage::GetLevel(const std::string& key) {
+    Trace(TraceOp::get_level, false, DEFAULT_CF, key);
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, *compressor_);
+    return FindLevel(ikey);
+}
+
+std::optional<uint32_t> Storage::GetLevel(uint32_t cf_id,
+                                          const std::string& key) {
+    CheckColumnFamilies();
+    Trace(TraceOp::get_level, true, cf_id, key);
+    InternalKey ikey = MakeKey(cf_id, key, *compressor_);
+    return FindLevel(ikey);
+}
+
+std::optional<KeyLocation> Storage::GetLocation(const std::string& key) {
+    Trace(TraceOp::get_level, false, DEFAULT_CF, key);
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, *compressor_);
+    return FindLocation(ikey);
+}
+
+std::optional<KeyLocation> Storage::GetLocation(uint32_t cf_id,
+                                                const std::string& key) {
+    CheckColumnFamilies();
+    Trace(TraceOp::get_level, true, cf_id, key);
+    InternalKey ikey = MakeKey(cf_id, key, *compressor_);
+    return FindLocation(ikey);
+}
+
+uint64_t Storage::CountKeys(const ZBDD& family) {
+    if (family == bddempty) {
+        return 0;
+    }
+    // every key owns one token path
+    if (BDD_LevOfVar(family.Top()) <= DATA_BIT_LEN) {
+        return 1;
+    }
+
+    auto it = key_counts_.find(family.GetID());
+    if (it != key_counts_.end()) {
+        return it->second.second;
+    }
+    uint64_t count = CountKeys(Child(family, 0)) + CountKeys(Child(family, 1));
+    if (key_counts_.size() >= key_counts_limit_) {
+        key_counts_.clear();
+        key_counts_limit_ = std::max(KEY_COUNTS_MIN_LIMIT, 2 * NodeCount());
+    }
+    key_counts_.emplace(family.GetID(), std::make_pair(family, count));
+    return count;
+}
+
+void Storage::AppendKeyBit(std::string& key, bddvar var) const {
+    AppendKeyPos(key, KeyPos(var), key_byte_bits_);
+}
+
+void Storage::AppendKeyPos(std::string& key, uint32_t pos,
+                           uint32_t byte_bits) {
+    uint32_t char_n = pos / byte_bits;
+    uint32_t bit = pos % byte_bits;
+    if (key.size() <= char_n) {
+        key.resize(char_n + 1, 0);
+    }
+    if (byte_bits == BITS_PER_KEY_BYTE) {
+        if (bit == 0) {
+            return;
+        }
+        --bit;
+    }
+    key[char_n] =
+        static_cast<char>(key[char_n] | (1 << (BITS_IN_BYTE - bit - 1)));
+}
+
+void Storage::PadKey(std::string& key, uint32_t key_bit_len,
+                     uint32_t byte_bits) {
+    // trailing zero bytes of fixed-width keys have no bits set
+    if (byte_bits == BITS_IN_BYTE) {
+        key.resize(key_bit_len / BITS_IN_BYTE, 0);
+    }
+}
+
+uint64_t Storage::RankOfImpl(uint32_t cf_id, const std::string& key) {
+    // keys which leave the path of `key` through a 0-branch, where `key`
+    // has 1, are less than it
+    InternalKey ikey = MakeKey(cf_id, key, Compression::NoCompression());
+    ZBDD family = RootOf(cf_id);
+    uint64_t rank = 0;
+    uint32_t key_len = std::min(key_bit_len_, ikey.BitLen());
+    for (uint32_t pos = 0; pos < key_len && family != bddempty; ++pos) {
+        bddvar var = KeyVar(pos);
+        bool has_var = static_cast<bddvar>(family.Top()) == var;
+        if (ikey.Bit(pos)) {
+            rank += CountKeys(has_var ? Child(family, 0) : family);
+            family = has_var ? Child(family, 1) : ZBDD(bddempty);
+        } else if (has_var) {
+            family = Child(family, 0);
+        }
+    }
+    return rank;
+}
+
+std::optional<KeyLevelPair> Storage::KeyAtRankImpl(uint32_t cf_id,
+                                                   uint64_t rank) {
+    ZBDD family = RootOf(cf_id);
+    if (rank >= CountKeys(family)) {
+        return std::nullopt;
+    }
+
+    std::string key;
+    while (BDD_LevOfVar(family.Top()) > DATA_BIT_LEN) {
+        ZBDD left = Child(family, 0);
+        uint64_t left_keys = CountKeys(left);
+        if (rank < left_keys) {
+            family = left;
             continue;
         }
+        rank -= left_keys;
+        AppendKeyBit(key, family.Top());
+        family = Child(family, 1);
+    }
+    PadKey(key, key_bit_len_, key_byte_bits_);
+
+    uint32_t level = 0;
+    std::optional<uint64_t> token = ReadToken(family);
+    const std::unordered_map<uint64_t, uint32_t>& data =
+        families_.at(cf_id).data;
+    if (token.has_value() && data.contains(token.value())) {
+        level = data.at(token.value());
+    }
+    return KeyLevelPair(std::move(key), level);
+}
 
-        if (!curr_node->left && !curr_node->right) {
-            nodes_.push_back(
-                {current_zdd.OnSet(current_zdd.Top()), 0, false, false});
-            current_zdd = zdd_->Child(current_zdd, 0);
-            curr_node->left = true;
+std::vector<KeyLevelPair> Storage::SampleKeysImpl(uint32_t cf_id, uint32_t n,
+                                                  const std::string& begin,
+                                                  const std::string& end,
+                                                  uint64_t seed) {
+    uint64_t from = RankOfImpl(cf_id, begin);
+    uint64_t to =
+        end.empty() ? CountKeys(RootOf(cf_id)) : RankOfImpl(cf_id, end);
+    if (from >= to) {
+        return {};
+    }
 
-            UpdateCurrentNode(curr_node, current_zdd, curr_level);
-        } else if (curr_node->left && !curr_node->right) {
-            nodes_.push_back(
-                {current_zdd.OnSet(current_zdd.Top()), 0, false, false});
-            current_zdd = zdd_->Child(current_zdd, 1);
-            curr_node->right = true;
+    // Floyd's algorithm draws distinct ranks in `n` steps
+    uint64_t range = to - from;
+    std::set<uint64_t> ranks;
+    if (n >= range) {
+        for (uint64_t rank = 0; rank != range; ++rank) {
+            ranks.insert(rank);
+        }
+    } else {
+        std::mt19937_64 gen(seed);
+        for (uint64_t j = range - n; j != range; ++j) {
+            uint64_t rank = std::uniform_int_distribution<uint64_t>(0, j)(gen);
+            if (!ranks.insert(rank).second) {
+                ranks.insert(j);
+            }
+        }
+    }
 
-            UpdateCurrentNode(curr_node, current_zdd, curr_level);
-        } else if (curr_node->left && curr_node->right) {
-            if (nodes_.empty()) {
-                break;
+    std::vector<KeyLevelPair> samples;
+    samples.reserve(ranks.size());
+    for (uint64_t rank : ranks) {
+        samples.push_back(KeyAtRankImpl(cf_id, from + rank).value());
+    }
+    return samples;
+}
+
+uint32_t Storage::Flatten(const ZBDD& node, std::vector<FlatNode>& flat,
+                          std::unordered_map<bddword, uint32_t>& index) const {
+    if (node == bddempty) {
+        return FLAT_EMPTY;
+    }
+    if (node == bddsingle) {
+        return FLAT_SINGLE;
+    }
+    // only token nodes can be shared, see `FrozenIndex`
+    int level = BDD_LevOfVar(node.Top());
+    bool data_node = level <= DATA_BIT_LEN;
+    if (data_node) {
+        auto it = index.find(node.GetID());
+        if (it != index.end()) {
+            return it->second;
+        }
+    }
+
+    uint32_t left = Flatten(Child(node, 0), flat, index);
+    uint32_t right = Flatten(Child(node, 1), flat, index);
+    uint64_t keys = data_node ? 1 : flat[left].keys + flat[right].keys;
+    flat.push_back({static_cast<bddvar>(node.Top()), level, {left, right},
+                    keys});
+    if (data_node) {
+        index.emplace(node.GetID(), flat.size() - 1);
+    }
+    return flat.size() - 1;
+}
+
+void Storage::ScanFlat(const std::vector<FlatNode>& flat, uint32_t root,
+                       const std::unordered_map<uint64_t, uint32_t>& data,
+                       uint64_t from, uint64_t to, uint32_t partition,
+                       const ScanCallback& callback,
+                       const std::atomic<bool>& stop) const {
+    // path to the current key, nodes are paired with `right` of `Iterator`
+    std::vector<std::pair<uint32_t, bool>> path;
+    uint32_t node = root;
+    uint64_t rank = from;
+    while (flat[node].level > DATA_BIT_LEN) {
+        uint64_t left_keys = flat[flat[node].children[0]].keys;
+        bool right = rank >= left_keys;
+        path.emplace_back(node, right);
+        if (right) {
+            rank -= left_keys;
+        }
+        node = flat[node].children[right ? 1 : 0];
+    }
+
+    for (uint64_t scanned = from; scanned != to && !stop; ++scanned) {
+        std::string key;
+        for (const auto& [path_node, right] : path) {
+            if (right) {
+                AppendKeyBit(key, flat[path_node].var);
+            }
+        }
+        PadKey(key, key_bit_len_, key_byte_bits_);
+        uint64_t token = 0;
+        for (uint32_t data_node = node; data_node != FLAT_SINGLE &&
+                                        data_node != FLAT_EMPTY;) {
+            const FlatNode& current = flat[data_node];
+            if (current.children[0] != FLAT_EMPTY) {
+                data_node = current.children[0];
+            } else {
+                token |= 1ULL << TokenBit(current.var);
+                data_node = current.children[1];
             }
+        }
+        auto location = data.find(token);
+        callback(partition,
+                 KeyLevelPair(std::move(key), location == data.end()
+                                                  ? 0
+                                                  : location->second));
+
+        // the same step as `Iterator::Advance`
+        while (!path.empty() && path.back().second) {
+            path.pop_back();
+        }
+        if (path.empty()) {
+            return;
+        }
+        path.back().second = true;
+        node = flat[path.back().first].children[1];
+        while (flat[node].level > DATA_BIT_LEN) {
+            bool right = flat[node].children[0] == FLAT_EMPTY;
+            path.emplace_back(node, right);
+            node = flat[node].children[right ? 1 : 0];
+        }
+    }
+}
+
+uint32_t FrozenIndex::Copy(
+    const Storage& storage, const ZBDD& node,
+    const std::unordered_map<uint64_t, uint32_t>& data,
+    std::vector<Node>& tree, std::vector<uint32_t>& levels) {
+    if (node == bddempty) {
+        return EMPTY;
+    }
+    if (tree.size() >= LEAF || levels.size() >= LEAF - 1) {
+        throw std::overflow_error("storage is too large to freeze");
+    }
+
+    // a token part stands for one key, see `FrozenIndex`
+    if (node == bddsingle || BDD_LevOfVar(node.Top()) <= DATA_BIT_LEN) {
+        uint64_t token =
+            node == bddsingle ? 0 : storage.ReadToken(node).value_or(0);
+        auto location = data.find(token);
+        levels.push_back(location == data.end() ? 0 : location->second);
+        return LEAF | (levels.size() - 1);
+    }
+
+    uint32_t index = tree.size();
+    tree.push_back({storage.KeyPos(node.Top()), {EMPTY, EMPTY}});
+    uint32_t left = Copy(storage, storage.Child(node, 0), data, tree, levels);
+    uint32_t right = Copy(storage, storage.Child(node, 1), data, tree, levels);
+    tree[index].children[0] = left;
+    tree[index].children[1] = right;
+    return index;
+}
+
+FrozenIndex Storage::Freeze() const {
+    FrozenIndex index(key_bit_len_, key_byte_bits_, compressor_);
+    std::vector<FrozenIndex::Node> tree;
+    std::vector<uint32_t> levels;
+    levels.reserve(size_);
+    std::vector<std::pair<uint32_t, uint32_t>> roots;
+    for (const auto& [cf_id, family] : families_) {
+        roots.emplace_back(cf_id, FrozenIndex::Copy(*this, family.root,
+                                                    family.data, tree,
+                                                    levels));
+    }
+    index.Build(tree, roots, std::move(levels));
+    return index;
+}
 
-            current_zdd = nodes_.back().anc;
-            nodes_.pop_back();
-            if (!nodes_.empty()) {
-                curr_node = &nodes_.back();
-                curr_level = curr_node->level;
+uint64_t Storage::ParallelScanImpl(uint32_t cf_id, uint32_t partitions,
+                                   const ScanCallback& callback) {
+    if (partitions == 0) {
+        throw std::invalid_argument("scan needs at least one partition");
+    }
+    auto family = families_.find(cf_id);
+    if (family == families_.end()) {
+        return 0;
+    }
+
+    ColumnFamily& scanned = family->second;
+    if (scanned.flat.empty() || scanned.flat_root != scanned.root) {
+        scanned.flat = {{0, 0, {FLAT_EMPTY, FLAT_EMPTY}, 0},
+                        {0, 0, {FLAT_EMPTY, FLAT_EMPTY}, 1}};
+        std::unordered_map<bddword, uint32_t> index;
+        scanned.flat_top = Flatten(scanned.root, scanned.flat, index);
+        scanned.flat.shrink_to_fit();
+        scanned.flat_root = scanned.root;
+    }
+    const std::vector<FlatNode>& flat = scanned.flat;
+    uint32_t root = scanned.flat_top;
+    uint64_t total = flat[root].keys;
+
+    std::atomic<bool> stop(false);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (uint32_t partition = 0; partition != partitions; ++partition) {
+        uint64_t from = total * partition / partitions;
+        uint64_t to = total * (partition + 1) / partitions;
+        if (from == to) {
+            continue;
+        }
+        workers.emplace_back([&, partition, from, to]() {
+            try {
+                ScanFlat(flat, root, scanned.data, from, to,
+                         partition, callback, stop);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                stop = true;
             }
-            if (current_zdd == bddfalse) {
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    ops_.iterator_steps += total;
+    return total;
+}
+
+uint64_t Storage::ParallelScan(uint32_t partitions,
+                               const ScanCallback& callback) {
+    return ParallelScanImpl(DEFAULT_CF, partitions, callback);
+}
+
+uint64_t Storage::ParallelScan(uint32_t cf_id, uint32_t partitions,
+                               const ScanCallback& callback) {
+    CheckColumnFamilies();
+    return ParallelScanImpl(cf_id, partitions, callback);
+}
+
+uint64_t Storage::RankOf(const std::string& key) {
+    return RankOfImpl(DEFAULT_CF, key);
+}
+
+uint64_t Storage::RankOf(uint32_t cf_id, const std::string& key) {
+    CheckColumnFamilies();
+    return RankOfImpl(cf_id, key);
+}
+
+std::optional<KeyLevelPair> Storage::KeyAtRank(uint64_t rank) {
+    return KeyAtRankImpl(DEFAULT_CF, rank);
+}
+
+std::optional<KeyLevelPair> Storage::KeyAtRank(uint32_t cf_id,
+                                               uint64_t rank) {
+    CheckColumnFamilies();
+    return KeyAtRankImpl(cf_id, rank);
+}
+
+std::vector<KeyLevelPair> Storage::SampleKeys(uint32_t n,
+                                              const std::string& begin,
+                                              const std::string& end,
+                                              uint64_t seed) {
+    return SampleKeysImpl(DEFAULT_CF, n, begin, end, seed);
+}
+
+std::vector<KeyLevelPair> Storage::SampleKeys(uint32_t cf_id, uint32_t n,
+                                              const std::string& begin,
+                                              const std::string& end,
+                                              uint64_t seed) {
+    CheckColumnFamilies();
+    return SampleKeysImpl(cf_id, n, begin, end, seed);
+}
+
+std::optional<uint32_t> Storage::GetLevelNoCompr(const std::string& key) {
+    InternalKey ikey = MakeKey(DEFAULT_CF, key, Compression::NoCompression());
+    return FindLevel(ikey);
+}
+
+std::optional<uint32_t> Storage::GetLevelNoCompr(uint32_t cf_id,
+                                                 const std::string& key) {
+    InternalKey ikey = MakeKey(cf_id, key, Compression::NoCompression());
+    return FindLevel(ikey);
+}
+
+bool Storage::IsEmpty() {
+    for (const auto& [cf_id, family] : families_) {
+        if (!IsEmpty(family.root)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Storage::IsEmpty(ZBDD store) {
+    return store == bddtrue || store == bddfalse;
+}
+
+void Storage::ApplyTokenOrder(const std::vector<bddvar>& vars,
+                              const std::vector<uint32_t>& order) {
+    // `vars[i]` gets token bit `order[i]`, whose variable is above `i` so far
+    for (size_t i = 0; i != vars.size(); ++i) {
+        bddvar var = vars[i];
+        bddvar held = bit_var_[DATA_BIT_LEN - order[i]];
+        if (held == var) {
+            continue;
+        }
+        for (auto& [cf_id, family] : families_) {
+            family.root = family.root.Swap(var, held);
+        }
+        std::swap(var_bit_[var], var_bit_[held]);
+        bit_var_[var_bit_[var]] = var;
+        bit_var_[var_bit_[held]] = held;
+    }
+}
+
+ReorderStats Storage::ReorderTokens(ReorderMethod method) {
+    // tables would keep nodes of the old order alive, so they are dropped
+    // while tokens move and built again from the new roots
+    std::vector<uint32_t> tabled;
+    for (auto& [cf_id, family] : families_) {
+        if (!family.root_table.empty()) {
+            tabled.push_back(cf_id);
+            family.root_table.clear();
+        }
+    }
+    ReorderStats stats{NodeCount(), 0, 0};
+
+    // bits no token has make no nodes, so they stay where they are
+    std::vector<uint64_t> tokens;
+    tokens.reserve(size_);
+    uint64_t used_bits = 0;
+    for (const auto& [cf_id, family] : families_) {
+        for (const auto& [token, location] : family.data) {
+            tokens.push_back(token);
+            used_bits |= token;
+        }
+    }
+    std::vector<bddvar> vars;
+    std::vector<uint32_t> order;
+    for (bddvar var = 1; var <= DATA_BIT_LEN; ++var) {
+        if ((used_bits >> TokenBit(var) & 1) != 0) {
+            vars.push_back(var);
+            order.push_back(TokenBit(var));
+        }
+    }
+
+    TokenOrder model(std::move(tokens), std::move(order));
+    if (method == ReorderMethod::window) {
+        model.Window();
+    } else {
+        model.Sift();
+    }
+    ApplyTokenOrder(vars, model.Order());
+    for (uint32_t cf_id : tabled) {
+        BuildRootTable(families_.at(cf_id));
+    }
+
+    stats.swaps = model.Swaps();
+    stats.nodes_after = NodeCount();
+    return stats;
+}
+
+VarRegion Storage::RegionOf(bddvar var) const {
+    return var <= DATA_BIT_LEN ? VarRegion::data : VarRegion::key;
+}
+
+std::unordered_map<bddword, Storage::AnalyzedNode> Storage::CollectNodes()
+    const {
+    std::unordered_map<bddword, AnalyzedNode> nodes;
+    std::vector<ZBDD> stack;
+    for (const auto& [cf_id, family] : families_) {
+        if (IsEmpty(family.root)) {
+            continue;
+        }
+        // roots shared by equal families count as fan-in
+        auto [it, inserted] = nodes.try_emplace(
+            family.root.GetID(),
+            AnalyzedNode{static_cast<bddvar>(family.root.Top()), {0, 0}, 0});
+        if (!inserted) {
+            ++it->second.fan_in;
+        } else {
+            stack.push_back(family.root);
+        }
+    }
+    while (!stack.empty()) {
+        ZBDD node = stack.back();
+        stack.pop_back();
+        for (int child_num : {0, 1}) {
+            ZBDD child = Child(node, child_num);
+            nodes[node.GetID()].children[child_num] = child.GetID();
+            if (IsEmpty(child)) {
+                continue;
+            }
+            auto [it, inserted] = nodes.try_emplace(
+                child.GetID(),
+                AnalyzedNode{static_cast<bddvar>(child.Top()), {0, 0}, 0});
+            ++it->second.fan_in;
+            if (inserted) {
+                stack.push_back(child);
+            }
+        }
+    }
+    return nodes;
+}
+
+ZddAnalysis Storage::Analyze() const {
+    ZddAnalysis analysis{};
+    std::unordered_map<bddword, AnalyzedNode> nodes = CollectNodes();
+    analysis.nodes = nodes.size();
+    if (nodes.empty()) {
+        return analysis;
+    }
+
+    std::map<bddvar, uint64_t> var_nodes;
+    for (const auto& [id, node] : nodes) {
+        ++var_nodes[node.var];
+        switch (RegionOf(node.var)) {
+            case VarRegion::data:
+                ++analysis.data_nodes;
                 break;
+            case VarRegion::key:
+                ++analysis.key_nodes;
+                break;
+        }
+        if (node.fan_in != 0) {
+            uint32_t bucket = std::bit_width(node.fan_in) - 1;
+            if (analysis.fan_in.size() <= bucket) {
+                analysis.fan_in.resize(bucket + 1);
+            }
+            ++analysis.fan_in[bucket];
+        }
+    }
+
+    for (auto it = var_nodes.rbegin(); it != var_nodes.rend(); ++it) {
+        VarRegion region = RegionOf(it->first);
+        analysis.levels.push_back(
+            {static_cast<uint32_t>(BDD_LevOfVar(it->first)), region,
+             region == VarRegion::data ? TokenBit(it->first)
+                                       : KeyPos(it->first),
+             it->second});
+    }
+
+    // children are below their parents, so bottom-up order is topological
+    std::vector<std::pair<int, bddword>> bottom_up;
+    for (const auto& [id, node] : nodes) {
+        bottom_up.emplace_back(BDD_LevOfVar(node.var), id);
+    }
+    std::sort(bottom_up.begin(), bottom_up.end());
+    std::unordered_map<bddword, double> tree_nodes;
+    for (const auto& [level, id] : bottom_up) {
+        double size = 1;
+        for (bddword child : nodes[id].children) {
+            if (nodes.contains(child)) {
+                size += tree_nodes[child];
             }
         }
+        tree_nodes[id] = size;
+    }
+    for (const auto& [cf_id, family] : families_) {
+        if (!IsEmpty(family.root)) {
+            analysis.tree_nodes += tree_nodes[family.root.GetID()];
+        }
+        if (column_families_) {
+            analysis.nodes_per_cf[cf_id] = family.root.Size();
+        }
+    }
+    analysis.sharing_ratio = analysis.tree_nodes / analysis.nodes;
+
+    return analysis;
+}
+
+std::string ZddAnalysis::ToString() const {
+    std::ostringstream out;
+    out << "nodes: " << nodes << " (data " << data_nodes << ", key "
+        << key_nodes << ")\n"
+        << "tree nodes: " << tree_nodes << ", sharing ratio "
+        << sharing_ratio << "\n"
+        << "fan-in:";
+    for (size_t i = 0; i != fan_in.size(); ++i) {
+        out << " " << (1ULL << i) << ".." << (2ULL << i) - 1 << ": "
+            << fan_in[i] << (i + 1 == fan_in.size() ? "" : ",");
+    }
+    out << "\n";
+    for (const auto& [cf_id, cf_nodes] : nodes_per_cf) {
+        out << "column family " << cf_id << ": " << cf_nodes << " nodes\n";
+    }
+    out << "level region bit nodes\n";
+    for (const LevelProfile& level : levels) {
+        out << level.level << " " << RegionName(level.region) << " "
+            << level.bit << " " << level.nodes << "\n";
+    }
+    return out.str();
+}
+
+std::string ZddAnalysis::ToJson() const {
+    std::ostringstream out;
+    out << "{\"nodes\": " << nodes << ", \"data_nodes\": " << data_nodes
+        << ", \"key_nodes\": " << key_nodes
+        << ", \"tree_nodes\": " << tree_nodes
+        << ", \"sharing_ratio\": " << sharing_ratio << ", \"fan_in\": [";
+    for (size_t i = 0; i != fan_in.size(); ++i) {
+        out << (i == 0 ? "" : ", ") << fan_in[i];
+    }
+    out << "], \"nodes_per_cf\": {";
+    for (auto it = nodes_per_cf.begin(); it != nodes_per_cf.end(); ++it) {
+        out << (it == nodes_per_cf.begin() ? "" : ", ") << "\"" << it->first
+            << "\": " << it->second;
+    }
+    out << "}, \"levels\": [";
+    for (size_t i = 0; i != levels.size(); ++i) {
+        out << (i == 0 ? "" : ", ") << "{\"level\": " << levels[i].level
+            << ", \"region\": \"" << RegionName(levels[i].region)
+            << "\", \"bit\": " << levels[i].bit
+            << ", \"nodes\": " << levels[i].nodes << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+std::string Storage::ToDot(uint64_t max_nodes) const {
+    std::unordered_map<bddword, AnalyzedNode> nodes = CollectNodes();
+    if (nodes.size() > max_nodes) {
+        throw std::length_error("ZDD has " + std::to_string(nodes.size()) +
+                                " nodes, more than " +
+                                std::to_string(max_nodes));
+    }
 
-        curr_zdd_ = current_zdd;
+    std::ostringstream out;
+    out << "digraph zdd {\n"
+        << "    terminal [shape=box, label=\"1\"];\n";
+    for (const auto& [cf_id, family] : families_) {
+        if (IsEmpty(family.root)) {
+            continue;
+        }
+        out << "    cf" << cf_id << " [shape=box, label=\"cf " << cf_id
+            << "\"];\n"
+            << "    cf" << cf_id << " -> n" << family.root.GetID() << ";\n";
+    }
+    for (const auto& [id, node] : nodes) {
+        VarRegion region = RegionOf(node.var);
+        out << "    n" << id << " [label=\"" << RegionName(region) << " "
+            << (region == VarRegion::data ? TokenBit(node.var)
+                                          : KeyPos(node.var))
+            << "\"];\n";
+        for (int child_num : {0, 1}) {
+            // 0-edges are dashed, edges to the empty family are omitted
+            bddword child = node.children[child_num];
+            if (child == bddempty) {
+                continue;
+            }
+            out << "    n" << id << " -> "
+                << (child == bddsingle ? std::string("terminal")
+                                       : "n" + std::to_string(child))
+                << (child_num == 0 ? " [style=dashed]" : "") << ";\n";
+        }
     }
+    out << "}\n";
+    return out.str();
+}
+
+LockGuard::LockGuard(std::atomic<uint32_t>& curr_task_id,
+                     std::atomic<uint32_t>& ready_task)
+    : curr_task_id_(curr_task_id), ready_task_id_(ready_task) {
+    id = curr_task_id.fetch_add(1);
+
+    while (ready_task.load() != id) {
+    }
+    // the turn of this storage comes first, so waiters of one storage keep
+    // their order
+    sapporo_ = std::unique_lock<std::recursive_mutex>(SapporoMutex());
+}
+
+LockGuard::~LockGuard() {
+    sapporo_.unlock();
+    ready_task_id_.fetch_add(1);
+}
+
+bool Iterator::Descend(ZBDD current_zdd) {
+    while (current_zdd != bddfalse &&
+           BDD_LevOfVar(current_zdd.Top()) > DATA_BIT_LEN) {
+        ZDDLSM_COUNT(zdd_->profiler_, nodes_visited);
+        ZBDD left = zdd_->Child(current_zdd, 0);
+        bool right = left == bddfalse;
+        nodes_.push_back(
+            {current_zdd, BDD_LevOfVar(current_zdd.Top()), right});
+        current_zdd = right ? zdd_->Child(current_zdd, 1) : left;
+    }
+
+    if (current_zdd == bddfalse) {
+        return false;
+    }
+
+    curr_zdd_ = current_zdd;
+    return true;
+}
+
+void Iterator::Advance() {
+    // deepest node on the path whose 1-branch is not visited yet
+    while (!nodes_.empty() && nodes_.back().right) {
+        nodes_.pop_back();
+    }
+
     if (nodes_.empty()) {
         end_ = true;
         return;
     }
 
-    nodes_.pop_back();
+    nodes_.back().right = true;
+    Descend(zdd_->Child(nodes_.back().zdd, 1));
 }
 
-std::optional<KeyLevelPair> Iterator::operator*() const {
-    std::string str(zdd_->key_bit_len_ / 8, 0);
+void Iterator::Init(const std::string& key) {
+    ++zdd_->ops_.iterator_seeks;
+    nodes_ = std::deque<ZddNode>();
 
-    if (end_) {
-        return std::nullopt;
+    ZBDD current_zdd = zdd_->RootOf(cf_id_);
+    if (zdd_->IsEmpty(current_zdd)) {
+        end_ = true;
+        return;
+    }
+
+    Storage::InternalKey ikey =
+        zdd_->MakeKey(cf_id_, key, Compression::NoCompression());
+    zdd_->GetNzZddVars(ikey);
+    const std::vector<bddvar>& nz_zdd_vars = zdd_->nz_zdd_vars_;
+    int stack_pointer = nz_zdd_vars.size() - 1;
+
+    // follow `key` while it's possible, then step to the first larger key
+    while (current_zdd != bddfalse) {
+        ZDDLSM_COUNT(zdd_->profiler_, nodes_visited);
+        int curr_level = BDD_LevOfVar(current_zdd.Top());
+
+        if (curr_level <= DATA_BIT_LEN) {
+            if (stack_pointer < 0) {
+                curr_zdd_ = current_zdd;
+                return;
+            }
+            break;
+        }
+
+        if (stack_pointer < 0 ||
+            curr_level > static_cast<int64_t>(nz_zdd_vars[stack_pointer])) {
+            ZBDD left = zdd_->Child(current_zdd, 0);
+            if (left == bddfalse) {
+                nodes_.push_back({current_zdd, curr_level, true});
+                Descend(zdd_->Child(current_zdd, 1));
+                return;
+            }
+            nodes_.push_back({current_zdd, curr_level, false});
+            current_zdd = left;
+        } else if (curr_level <
+                   static_cast<int64_t>(nz_zdd_vars[stack_pointer])) {
+            break;
+        } else {
+            nodes_.push_back({current_zdd, curr_level, true});
+            current_zdd = zdd_->Child(current_zdd, 1);
+            --stack_pointer;
+        }
     }
 
-    for (ZddNode node : nodes_) {
-        int bit_pos = (node.level - DATA_BIT_LEN - 1);
-        int char_n = str.size() - bit_pos / 8 - 1;
-        str[char_n] = str[char_n] | ((node.right * 1) << bit_pos % 8);
+    // every key below the path is less than `key`
+    Advance();
+}
+
+Iterator::Iterator(ZDDLSM::Storage* zdd, const std::string& key)
+    : zdd_(zdd),
+      cf_id_(Storage::DEFAULT_CF),
+      has_cf_(false),
+      trace_id_(zdd->next_iterator_id_++),
+      end_(false) {
+    Trace(TraceOp::iterator_seek, key);
+    Init(key);
+}
+
+Iterator::Iterator(Storage* zdd, uint32_t cf_id, const std::string& key)
+    : zdd_(zdd),
+      cf_id_(cf_id),
+      has_cf_(true),
+      trace_id_(zdd->next_iterator_id_++),
+      end_(false) {
+    zdd_->CheckColumnFamilies();
+    Trace(TraceOp::iterator_seek, key);
+    Init(key);
+}
+
+Iterator::Iterator(ZDDLSM::Storage* zdd) : Iterator(zdd, std::string()) {}
+
+Iterator::Iterator(ZDDLSM::Storage* zdd, uint32_t cf_id)
+    : Iterator(zdd, cf_id, std::string()) {}
+
+bool Iterator::HasNext() const { return !end_; }
+
+void Iterator::Trace(TraceOp op, const std::string& key, uint64_t count) const {
+    if (zdd_->trace_ != nullptr) {
+        zdd_->trace_->Record(TraceRecord{op, has_cf_, cf_id_, 0, 0, key,
+                                         std::string(), 0, 0, trace_id_,
+                                         count});
     }
+}
 
-    auto r_it = str.rbegin();
-    while (*r_it == 0) {
-        ++r_it;
+void Iterator::SkipN(uint64_t n) {
+    if (end_ || n == 0) {
+        return;
     }
-    str.resize(str.size() - std::distance(str.rbegin(), r_it));
 
-    auto it = str.begin();
-    while (*it == 0) {
-        ++it;
+    ++zdd_->ops_.iterator_seeks;
+    Trace(TraceOp::iterator_skip, std::string(), n);
+    uint64_t rank = 0;
+    for (const ZddNode& node : nodes_) {
+        if (node.right) {
+            rank += zdd_->CountKeys(zdd_->Child(node.zdd, 0));
+        }
     }
-    str.erase(0, std::distance(str.begin(), it));
+    SeekRank(rank + n);
+}
 
-    uint32_t level = zdd_->GetLevelNoCompr(str).value_or(0);
+void Iterator::SeekRank(uint64_t rank) {
+    nodes_ = std::deque<ZddNode>();
+    ZBDD current_zdd = zdd_->RootOf(cf_id_);
+    if (rank >= zdd_->CountKeys(current_zdd)) {
+        end_ = true;
+        return;
+    }
+
+    while (BDD_LevOfVar(current_zdd.Top()) > DATA_BIT_LEN) {
+        ZDDLSM_COUNT(zdd_->profiler_, nodes_visited);
+        ZBDD left = zdd_->Child(current_zdd, 0);
+        uint64_t left_keys = zdd_->CountKeys(left);
+        bool right = rank >= left_keys;
+        nodes_.push_back(
+            {current_zdd, BDD_LevOfVar(current_zdd.Top()), right});
+        if (right) {
+            rank -= left_keys;
+            current_zdd = zdd_->Child(current_zdd, 1);
+        } else {
+            current_zdd = left;
+        }
+    }
+    curr_zdd_ = current_zdd;
+}
+
+void Iterator::Next() {
+    if (end_) {
+        return;
+    }
+
+    ++zdd_->ops_.iterator_steps;
+    Trace(TraceOp::iterator_next, std::string());
+    ZDDLSM_PROFILE_PHASE(zdd_->profiler_, iterator_next);
+    Advance();
+}
+
+std::optional<KeyLevelPair> Iterator::operator*() const {
+    if (end_) {
+        return std::nullopt;
+    }
+
+    std::string str;
+
+    for (const ZddNode& node : nodes_) {
+        if (!node.right) {
+            continue;
+        }
+
+        zdd_->AppendKeyBit(str, BDD_VarOfLev(node.level));
+    }
+    Storage::PadKey(str, zdd_->key_bit_len_, zdd_->key_byte_bits_);
+
+    uint32_t level = 0;
+    std::optional<uint64_t> token = zdd_->ReadToken(curr_zdd_);
+    auto family = zdd_->families_.find(cf_id_);
+    if (token.has_value() && family != zdd_->families_.end()) {
+        auto it = family->second.data.find(token.value());
+        if (it != family->second.data.end()) {
+            level = it->second;
+        }
+    }
 
     return KeyLevelPair(std::move(str), level);
 }